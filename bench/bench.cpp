@@ -0,0 +1,503 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+#include "active_set.h"
+#include "cpu_dispatch.h"
+#include "inpaint.h"
+#include "masked_image.h"
+#include "nnf.h"
+#include "pyramid.h"
+#include "random.h"
+#include "session.h"
+#include "thread_pool.h"
+#include "video.h"
+
+/**
+ * Micro-benchmarks of the kernels and end-to-end inpainting of synthetic images.
+ * Prints a JSON document to stdout (the progress goes to stderr):
+ *     {"isa": ..., "nr_threads": ..., "benchmarks": [{"name", "params", "runs", "seconds", "min_seconds",
+ *      "throughput", "unit", "peak_rss_mb"}, ...]}
+ * seconds is the median of the runs. peak_rss_mb is the peak resident memory of the process during the benchmark
+ * where Linux lets it be reset (/proc/self/clear_refs), since the start of the process otherwise.
+ *
+ * Usage: patchmatch_bench [--quick] [--filter substring] [--threads n] [--isa name] [--preset name] [--min-time s]
+ *
+ * With --check-determinism, it instead inpaints a small synthetic image with 1 and n threads (4 by default) and every
+ * instruction set the CPU has, and checks that the results are bit-identical; the exit status is 1 if they are not.
+ */
+
+// Reaches the private steps of Inpainting (see the friend declaration in inpaint.h).
+class InpaintingBench {
+public:
+    InpaintingBench(const MaskedImage &source, const PatchDistanceMetric *metric)
+        : m_inpainting(source.image(), source.mask(), metric), m_source(source), m_target(), m_source2target() {
+        m_target = source.clone();
+        m_target.clear_mask();
+        m_inpainting.m_active_set = std::make_shared<ActiveSet>(m_source, metric->patch_size());
+        m_source2target = NearestNeighborField(m_source, m_target, metric, m_inpainting.m_active_set, random_key(1212, 0));
+        m_source2target.minimize(2, m_inpainting.m_thread_pool);
+    }
+
+    inline void expectation_step(cv::Mat &vote) {
+        m_inpainting._expectation_step(m_source2target, true, vote, m_source, false);
+    }
+    inline void maximization_step(MaskedImage &target, const cv::Mat &vote) {
+        m_inpainting._maximization_step(target, vote);
+    }
+    inline const MaskedImage &target() const {
+        return m_target;
+    }
+
+private:
+    Inpainting m_inpainting;
+    MaskedImage m_source;
+    MaskedImage m_target;
+    NearestNeighborField m_source2target;
+};
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Settings {
+    bool quick = false;
+    std::string filter;
+    std::string preset = "balanced";
+    double min_time = 0.5;
+};
+
+struct Timing {
+    int runs = 0;
+    double seconds = 0;  // The median.
+    double min_seconds = 0;
+};
+
+void reset_peak_rss() {
+    // Linux >= 4.0: resets VmHWM to the current resident size.
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    if (clear_refs) clear_refs << "5";
+}
+
+double peak_rss_mb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) return std::atof(line.c_str() + 6) / 1024;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+}
+
+// Runs setup() then func() until min_time seconds were spent in func (and at least min_runs times); only func is timed.
+Timing measure(double min_time, int min_runs, const std::function<void()> &setup, const std::function<void()> &func) {
+    reset_peak_rss();
+    std::vector<double> times;
+    double total = 0;
+    while (static_cast<int>(times.size()) < min_runs || total < min_time) {
+        setup();
+        const auto start = Clock::now();
+        func();
+        times.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+        total += times.back();
+    }
+    std::sort(times.begin(), times.end());
+    Timing timing;
+    timing.runs = static_cast<int>(times.size());
+    timing.seconds = times[times.size() / 2];
+    timing.min_seconds = times.front();
+    return timing;
+}
+
+class Report {
+public:
+    explicit Report(const Settings &settings) : m_settings(settings), m_entries() {
+        // pass
+    }
+
+    inline bool selected(const std::string &name) const {
+        return m_settings.filter.empty() || name.find(m_settings.filter) != std::string::npos;
+    }
+
+    // params is a list of "key": value JSON members; work is the number of units (unit) processed by one run.
+    void add(const std::string &name, const std::string &params, const Timing &timing, double work, const std::string &unit) {
+        std::ostringstream entry;
+        entry.precision(6);
+        entry << "    {\"name\": \"" << name << "\", \"params\": {" << params << "}, \"runs\": " << timing.runs
+              << ", \"seconds\": " << timing.seconds << ", \"min_seconds\": " << timing.min_seconds
+              << ", \"throughput\": " << work / timing.seconds << ", \"unit\": \"" << unit << "/s\""
+              << ", \"peak_rss_mb\": " << peak_rss_mb() << "}";
+        m_entries.push_back(entry.str());
+        std::cerr << name << ": " << timing.seconds * 1e3 << " ms (" << timing.runs << " runs)" << std::endl;
+    }
+
+    void print(std::ostream &out) const {
+        out << "{\n  \"isa\": \"" << cpu_isa_name(cpu_active_isa()) << "\", \"nr_threads\": " << ThreadPool::global().nr_threads()
+            << ", \"preset\": \"" << m_settings.preset << "\",\n  \"benchmarks\": [\n";
+        for (size_t k = 0; k < m_entries.size(); ++k) out << m_entries[k] << (k + 1 < m_entries.size() ? ",\n" : "\n");
+        out << "  ]\n}" << std::endl;
+    }
+
+private:
+    const Settings &m_settings;
+    std::vector<std::string> m_entries;
+};
+
+// A deterministic texture: blocks of random colors, smooth waves and some pixel noise.
+cv::Mat synthetic_image(int width, int height) {
+    cv::Mat image(cv::Size(width, height), CV_8UC3);
+    for (int y = 0; y < height; ++y) {
+        unsigned char *row = image.ptr<unsigned char>(y);
+        for (int x = 0; x < width; ++x) {
+            const uint64_t block = random_key(random_key(7, y / 24), x / 24);
+            const uint64_t noise = random_mix(static_cast<uint64_t>(y) * width + x);
+            const double wave = 40 * std::sin(0.07 * x + 0.03 * y) + 20 * std::sin(0.011 * x - 0.05 * y);
+            for (int c = 0; c < 3; ++c) {
+                const double value = 64 + ((block >> (8 * c)) & 127) + wave + ((noise >> (8 * c)) & 15);
+                row[3 * x + c] = static_cast<unsigned char>(std::max(0.0, std::min(255.0, value)));
+            }
+        }
+    }
+    return image;
+}
+
+// Eight square holes, one per cell of a 4x2 grid, covering about the given fraction of the image.
+cv::Mat synthetic_mask(int width, int height, double coverage) {
+    cv::Mat mask(cv::Size(width, height), CV_8UC1);
+    mask.setTo(cv::Scalar(0));
+    const int cell_width = width / 4, cell_height = height / 2;
+    const int side = std::min(std::min(cell_width, cell_height) - 2, static_cast<int>(std::sqrt(coverage * width * height / 8)));
+    for (int k = 0; k < 8; ++k) {
+        const uint64_t key = random_key(11, k);
+        const int x0 = (k % 4) * cell_width + 1 + static_cast<int>(random_mix(key) % (cell_width - side - 1));
+        const int y0 = (k / 4) * cell_height + 1 + static_cast<int>(random_mix(key + 1) % (cell_height - side - 1));
+        for (int y = y0; y < y0 + side; ++y) {
+            for (int x = x0; x < x0 + side; ++x) mask.at<unsigned char>(y, x) = 1;
+        }
+    }
+    return mask;
+}
+
+double hole_fraction(const cv::Mat &mask) {
+    double count = 0;
+    for (int y = 0; y < mask.rows; ++y) {
+        for (int x = 0; x < mask.cols; ++x) count += mask.at<unsigned char>(y, x) != 0;
+    }
+    return count / mask.total();
+}
+
+std::string param(const std::string &key, double value) {
+    std::ostringstream out;
+    out << "\"" << key << "\": " << value;
+    return out.str();
+}
+
+std::string param(const std::string &key, const std::string &value) {
+    return "\"" + key + "\": \"" + value + "\"";
+}
+
+void bench_distance(Report &report, const Settings &settings) {
+    const int width = 512, height = 512, nr_pairs = 1 << 16;
+    const cv::Mat image = synthetic_image(width, height);
+    const cv::Mat mask = synthetic_mask(width, height, 0.05);
+    cv::Mat ijmap(cv::Size(width, height), CV_32FC3);
+    for (int y = 0; y < height; ++y) {
+        float *row = ijmap.ptr<float>(y);
+        for (int x = 0; x < width; ++x) row[3 * x] = std::sin(0.1f * x), row[3 * x + 1] = std::cos(0.1f * y), row[3 * x + 2] = 0.5f;
+    }
+
+    const int patch_sizes[] = {1, 2, 3, 5, 7};
+    for (int patch_size : patch_sizes) {
+        std::vector<int> pairs(4 * nr_pairs);
+        for (int k = 0; k < nr_pairs; ++k) {
+            const uint64_t key = random_key(3, k);
+            pairs[4 * k] = random_mix(key) % height, pairs[4 * k + 1] = random_mix(key + 1) % width;
+            pairs[4 * k + 2] = random_mix(key + 2) % height, pairs[4 * k + 3] = random_mix(key + 3) % width;
+        }
+
+        const PatchSSDDistanceMetric ssd(patch_size);
+        const RegularityGuidedPatchDistanceMetricV2 regularity(patch_size, ijmap, 0.25);
+        struct Variant {
+            const char *name;
+            const PatchDistanceMetric *metric;
+            bool packed;
+        } variants[] = {{"ssd", &ssd, true}, {"ssd_unpacked", &ssd, false}, {"regularity_v2", &regularity, true}};
+
+        for (const auto &variant : variants) {
+            const std::string name = std::string("distance/") + variant.name + "/p" + std::to_string(patch_size);
+            if (!report.selected(name)) continue;
+            MaskedImage source(image, mask), target(image.clone(), mask.clone());
+            target.clear_mask();
+            source.compute_image_gradients();
+            target.compute_image_gradients();
+            if (variant.packed) {
+                source.compute_packed_features(patch_size + 1);
+                target.compute_packed_features(patch_size + 1);
+            }
+
+            volatile int64_t sink = 0;
+            const auto timing = measure(settings.min_time, 3, []() {}, [&]() {
+                int64_t sum = 0;
+                for (int k = 0; k < nr_pairs; ++k) {
+                    sum += (*variant.metric)(source, pairs[4 * k], pairs[4 * k + 1], target, pairs[4 * k + 2], pairs[4 * k + 3]);
+                }
+                sink = sink + sum;
+            });
+            report.add(name, param("patch_size", patch_size) + ", " + param("size", "512x512"), timing, nr_pairs, "distances");
+        }
+    }
+}
+
+void bench_minimize(Report &report, const Settings &settings) {
+    const int width = 1024, height = 1024;
+    const cv::Mat image = synthetic_image(width, height);
+    const cv::Mat mask = synthetic_mask(width, height, 0.1);
+    const int patch_sizes[] = {2, 3, 7};
+    for (int patch_size : patch_sizes) {
+        const std::string name = "nnf_minimize/p" + std::to_string(patch_size);
+        if (!report.selected(name)) continue;
+
+        const PatchSSDDistanceMetric metric(patch_size);
+        MaskedImage source(image, mask), target(image.clone(), mask.clone());
+        target.clear_mask();
+        source.compute_packed_features(patch_size + 1);
+        target.compute_packed_features(patch_size + 1);
+        auto active = std::make_shared<ActiveSet>(source, patch_size);
+
+        NearestNeighborField nnf;
+        const auto timing = measure(settings.min_time, 3,
+            [&]() { nnf = NearestNeighborField(source, target, &metric, active, random_key(1212, 0)); },
+            [&]() { nnf.minimize(1, &ThreadPool::global()); });
+        report.add(name, param("patch_size", patch_size) + ", " + param("active_pixels", active->nr_pixels()) + ", " + param("passes", 1),
+                   timing, active->nr_pixels(), "pixels");
+    }
+}
+
+void bench_pyramid(Report &report, const Settings &settings) {
+    const int sides[] = {1024, 2048};
+    for (int side : sides) {
+        const cv::Mat image = synthetic_image(side, side);
+        const cv::Mat mask = synthetic_mask(side, side, 0.05);
+        const MaskedImage masked(image, mask);
+        const std::string size = std::to_string(side) + "x" + std::to_string(side);
+        const double nr_pixels = static_cast<double>(side) * side;
+
+        if (report.selected("downsample/" + size)) {
+            const auto timing = measure(settings.min_time, 3, []() {}, [&]() { masked.downsample(); });
+            report.add("downsample/" + size, param("size", size), timing, nr_pixels, "pixels");
+        }
+        if (report.selected("upsample/" + size)) {
+            const MaskedImage half = masked.downsample();
+            const auto timing = measure(settings.min_time, 3, []() {}, [&]() { half.upsample(side, side); });
+            report.add("upsample/" + size, param("size", size), timing, nr_pixels, "pixels");
+        }
+        if (report.selected("gradients/" + size)) {
+            // A new image every run: the copies of an image share their gradients.
+            MaskedImage fresh;
+            const auto timing = measure(settings.min_time, 3, [&]() { fresh = MaskedImage(image, mask); }, [&]() { fresh.compute_image_gradients(); });
+            report.add("gradients/" + size, param("size", size), timing, nr_pixels, "pixels");
+        }
+        if (report.selected("pyramid/" + size)) {
+            // Every level with its gradients and packed features, as Inpainting::_initialize_pyramid builds them.
+            const PyramidBuilder builder(&ThreadPool::global(), 4);
+            const auto timing = measure(settings.min_time, 3, []() {}, [&]() { builder.build(MaskedImage(image, mask), 16, 3); });
+            report.add("pyramid/" + size, param("size", size), timing, nr_pixels, "pixels");
+        }
+    }
+}
+
+void bench_em_steps(Report &report, const Settings &settings) {
+    const int side = 1024, patch_size = 3;
+    const std::string size = std::to_string(side) + "x" + std::to_string(side);
+    if (!report.selected("expectation_step/" + size) && !report.selected("maximization_step/" + size)) return;
+
+    const PatchSSDDistanceMetric metric(patch_size);
+    MaskedImage source(synthetic_image(side, side), synthetic_mask(side, side, 0.1));
+    source.compute_packed_features(patch_size + 1);
+    InpaintingBench bench(source, &metric);
+    const double nr_pixels = static_cast<double>(side) * side;
+
+    cv::Mat vote(source.size(), CV_64FC4);
+    auto clear_vote = [&]() { vote.setTo(cv::Scalar::all(0)); };
+    if (report.selected("expectation_step/" + size)) {
+        const auto timing = measure(settings.min_time, 3, clear_vote, [&]() { bench.expectation_step(vote); });
+        report.add("expectation_step/" + size, param("size", size) + ", " + param("patch_size", patch_size), timing, nr_pixels, "pixels");
+    }
+    if (report.selected("maximization_step/" + size)) {
+        clear_vote();
+        bench.expectation_step(vote);
+        MaskedImage target;
+        const auto timing = measure(settings.min_time, 3, [&]() { target = bench.target().clone(); }, [&]() { bench.maximization_step(target, vote); });
+        report.add("maximization_step/" + size, param("size", size) + ", " + param("patch_size", patch_size), timing, nr_pixels, "pixels");
+    }
+}
+
+void bench_end_to_end(Report &report, const Settings &settings) {
+    InpaintingOptions options;
+    InpaintingOptions::preset(settings.preset, options);
+    const PatchSSDDistanceMetric metric(3);
+
+    std::vector<int> sides = {1024, 2048};
+    if (!settings.quick) sides.push_back(4096);
+    std::vector<double> coverages = {0.01, 0.05, 0.2};
+    if (settings.quick) coverages = {0.05};
+
+    for (int side : sides) {
+        for (double coverage : coverages) {
+            std::ostringstream name;
+            name << "inpaint/" << (side * side >> 20) << "mp/" << static_cast<int>(coverage * 100) << "pct";
+            if (!report.selected(name.str())) continue;
+
+            const cv::Mat image = synthetic_image(side, side);
+            const cv::Mat mask = synthetic_mask(side, side, coverage);
+            const double hole = hole_fraction(mask);
+            const auto timing = measure(0, 1, []() {}, [&]() {
+                Inpainting inpainting(image, mask, &metric);
+                inpainting.set_options(options);
+                inpainting.run();
+            });
+            const std::string size = std::to_string(side) + "x" + std::to_string(side);
+            report.add(name.str(), param("size", size) + ", " + param("hole_fraction", hole) + ", " + param("patch_size", 3),
+                       timing, hole * side * side, "hole_pixels");
+        }
+    }
+}
+
+uint64_t checksum(const cv::Mat &image) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (int y = 0; y < image.rows; ++y) {
+        const unsigned char *row = image.ptr<unsigned char>(y);
+        for (size_t x = 0; x < image.cols * image.elemSize(); ++x) hash = (hash ^ row[x]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// The results of every path that claims to be independent of the pool size and of the instruction set: a plain run,
+// a run with stats (whose counters are compiled in separately), a warm-started video frame and a session update.
+std::vector<uint64_t> determinism_checksums(ThreadPool *pool, const InpaintingOptions &options) {
+    const PatchSSDDistanceMetric metric(3);
+    const cv::Mat image = synthetic_image(192, 160);
+    const cv::Mat mask = synthetic_mask(192, 160, 0.05);
+    cv::Mat next_mask = mask.clone();
+    next_mask(cv::Rect(40, 40, 24, 16)).setTo(cv::Scalar(1));
+
+    std::vector<uint64_t> checksums;
+    for (int with_stats = 0; with_stats < 2; ++with_stats) {
+        Inpainting inpainting(image, mask, &metric);
+        inpainting.set_thread_pool(pool);
+        inpainting.set_options(options);
+        inpainting.set_stats_enabled(with_stats != 0);
+        checksums.push_back(checksum(inpainting.run()));
+    }
+
+    VideoInpainting video(&metric);
+    video.set_thread_pool(pool);
+    video.set_options(options);
+    video.next_frame(image, mask);
+    checksums.push_back(checksum(video.next_frame(image, next_mask)));
+
+    InpaintingSession session(image, &metric);
+    session.set_thread_pool(pool);
+    session.set_options(options);
+    session.inpaint(mask);
+    checksums.push_back(checksum(session.inpaint(next_mask)));
+    return checksums;
+}
+
+int check_determinism(const Settings &settings, int nr_threads) {
+    InpaintingOptions options;
+    InpaintingOptions::preset(settings.preset, options);
+    const char *names[] = {"inpaint", "inpaint+stats", "video", "session"};
+    const int active_isa = cpu_active_isa();
+
+    std::vector<uint64_t> reference;
+    bool ok = true;
+    for (int isa = kISAScalar; isa <= cpu_detected_isa(); ++isa) {
+        if (cpu_set_isa(isa) != isa) continue;
+        for (int threads : {1, nr_threads}) {
+            ThreadPool pool(threads);
+            const auto checksums = determinism_checksums(&pool, options);
+            if (reference.empty()) reference = checksums;
+            for (size_t k = 0; k < checksums.size(); ++k) {
+                const bool same = checksums[k] == reference[k] && (k != 1 || checksums[1] == checksums[0]);
+                ok = ok && same;
+                std::cerr << names[k] << " isa=" << cpu_isa_name(isa) << " threads=" << threads << ": " << std::hex << checksums[k] << std::dec
+                          << (same ? "" : " MISMATCH") << std::endl;
+            }
+        }
+    }
+    cpu_set_isa(active_isa);
+    std::cout << (ok ? "Deterministic." : "Not deterministic.") << std::endl;
+    return ok ? 0 : 1;
+}
+
+int isa_from_name(const std::string &name) {
+    for (int isa = kISAScalar; isa <= kISAAVX512; ++isa) {
+        if (name == cpu_isa_name(isa)) return isa;
+    }
+    return -1;
+}
+
+}
+
+int main(int argc, char **argv) {
+    Settings settings;
+    bool determinism = false;
+    int nr_threads = 4;
+    for (int k = 1; k < argc; ++k) {
+        const std::string arg = argv[k];
+        const bool has_value = k + 1 < argc;
+        if (arg == "--quick") {
+            settings.quick = true;
+            settings.min_time = 0.2;
+        } else if (arg == "--filter" && has_value) {
+            settings.filter = argv[++k];
+        } else if (arg == "--threads" && has_value) {
+            nr_threads = std::max(std::atoi(argv[++k]), 1);
+            ThreadPool::set_global_nr_threads(nr_threads);
+        } else if (arg == "--isa" && has_value) {
+            const int isa = isa_from_name(argv[++k]);
+            if (isa < 0 || cpu_set_isa(isa) != isa) {
+                std::cerr << "Instruction set not available: " << argv[k] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--preset" && has_value) {
+            InpaintingOptions options;
+            settings.preset = argv[++k];
+            if (!InpaintingOptions::preset(settings.preset, options)) {
+                std::cerr << "Unknown preset: " << settings.preset << std::endl;
+                return 1;
+            }
+        } else if (arg == "--min-time" && has_value) {
+            settings.min_time = std::atof(argv[++k]);
+        } else if (arg == "--check-determinism") {
+            determinism = true;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--quick] [--filter substring] [--threads n] [--isa name] [--preset name] [--min-time seconds]"
+                      << " [--check-determinism]" << std::endl;
+            return 1;
+        }
+    }
+    if (determinism) return check_determinism(settings, nr_threads);
+
+    Report report(settings);
+    bench_distance(report, settings);
+    bench_minimize(report, settings);
+    bench_pyramid(report, settings);
+    bench_em_steps(report, settings);
+    bench_end_to_end(report, settings);
+    report.print(std::cout);
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include <algorithm>
+
+#include "active_set.h"
+
+namespace {
+
+// Counts, for every pixel, the non-zero pixels of the CV_8U indicator within the (2 radius + 1)^2 window around
+// it (clipped to the image). Separable running sums, so the cost does not depend on the radius.
+cv::Mat box_count(const cv::Mat &indicator, int radius) {
+    const int height = indicator.rows, width = indicator.cols;
+
+    cv::Mat horizontal(indicator.size(), CV_32SC1);
+    std::vector<int> prefix(width + 1);
+    for (int i = 0; i < height; ++i) {
+        const unsigned char *in = indicator.ptr<unsigned char>(i);
+        prefix[0] = 0;
+        for (int j = 0; j < width; ++j) prefix[j + 1] = prefix[j] + (in[j] != 0);
+
+        int *out = horizontal.ptr<int>(i);
+        for (int j = 0; j < width; ++j) {
+            out[j] = prefix[std::min(width, j + radius + 1)] - prefix[std::max(0, j - radius)];
+        }
+    }
+
+    cv::Mat count(indicator.size(), CV_16UC1);
+    std::vector<int> window(width, 0);
+    for (int i = 0; i < std::min(height, radius); ++i) {
+        const int *row = horizontal.ptr<int>(i);
+        for (int j = 0; j < width; ++j) window[j] += row[j];
+    }
+    for (int i = 0; i < height; ++i) {
+        if (i + radius < height) {
+            const int *entering = horizontal.ptr<int>(i + radius);
+            for (int j = 0; j < width; ++j) window[j] += entering[j];
+        }
+        if (i - radius - 1 >= 0) {
+            const int *leaving = horizontal.ptr<int>(i - radius - 1);
+            for (int j = 0; j < width; ++j) window[j] -= leaving[j];
+        }
+
+        unsigned short *out = count.ptr<unsigned short>(i);
+        for (int j = 0; j < width; ++j) out[j] = static_cast<unsigned short>(window[j]);
+    }
+    return count;
+}
+
+}
+
+ActiveSet::ActiveSet(const MaskedImage &source, int patch_size)
+    : m_size(source.size()), m_patch_size(patch_size), m_spans(), m_row_offsets(), m_nr_pixels(0), m_bounding_box(), m_identity_count() {
+    const int height = m_size.height, width = m_size.width;
+
+    // The hole as seen by contains_mask: masked, but not globally masked.
+    cv::Mat hole(m_size, CV_8UC1);
+    for (int i = 0; i < height; ++i) {
+        unsigned char *out = hole.ptr<unsigned char>(i);
+        for (int j = 0; j < width; ++j) out[j] = source.is_masked(i, j) && !source.is_globally_masked(i, j);
+    }
+    cv::Mat hole_count = box_count(hole, patch_size);
+
+    // The identity pixels vote with their own patch; globally masked pixels do not vote at all.
+    cv::Mat identity(m_size, CV_8UC1);
+    int y_min = height, y_max = -1, x_min = width, x_max = -1;
+    m_row_offsets.reserve(height + 1);
+    for (int i = 0; i < height; ++i) {
+        m_row_offsets.push_back(static_cast<int>(m_spans.size()));
+        const unsigned short *active = hole_count.ptr<unsigned short>(i);
+        unsigned char *out = identity.ptr<unsigned char>(i);
+        for (int j = 0; j < width; ++j) out[j] = active[j] == 0 && !source.is_globally_masked(i, j);
+
+        for (int j = 0; j < width; ) {
+            if (active[j] == 0) {
+                ++j;
+                continue;
+            }
+            int j_end = j;
+            while (j_end < width && active[j_end] != 0) ++j_end;
+            m_spans.push_back(Span{i, j, j_end});
+            m_nr_pixels += j_end - j;
+            y_min = std::min(y_min, i), y_max = i;
+            x_min = std::min(x_min, j), x_max = std::max(x_max, j_end - 1);
+            j = j_end;
+        }
+    }
+    m_row_offsets.push_back(static_cast<int>(m_spans.size()));
+
+    if (y_max >= 0) m_bounding_box = cv::Rect(x_min, y_min, x_max - x_min + 1, y_max - y_min + 1);
+    m_identity_count = box_count(identity, patch_size);
+}
+
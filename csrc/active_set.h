@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "masked_image.h"
+
+/**
+ * The active pixels of a pyramid level: the pixels whose patch touches the hole (see MaskedImage::contains_mask),
+ * stored as row spans in raster order. Every other pixel is matched with itself in both NNF directions and never
+ * changes, so the NNF initialization, the minimization and the voting only need to visit the active pixels.
+ * The set is built once per level from a box dilation of the hole, in O(width * height).
+ */
+class ActiveSet {
+public:
+    struct Span {
+        int y, x_begin, x_end;
+    };
+
+    ActiveSet() : m_size(), m_patch_size(0), m_spans(), m_row_offsets(), m_nr_pixels(0), m_bounding_box(), m_identity_count() {
+        // pass
+    }
+    ActiveSet(const MaskedImage &source, int patch_size);
+
+    inline cv::Size size() const {
+        return m_size;
+    }
+    inline int patch_size() const {
+        return m_patch_size;
+    }
+    inline int nr_pixels() const {
+        return m_nr_pixels;
+    }
+    inline const std::vector<Span> &spans() const {
+        return m_spans;
+    }
+    // The spans of row y are spans()[row_begin(y)] to spans()[row_end(y) - 1].
+    inline int row_begin(int y) const {
+        return m_row_offsets[y];
+    }
+    inline int row_end(int y) const {
+        return m_row_offsets[y + 1];
+    }
+    inline cv::Rect bounding_box() const {
+        return m_bounding_box;
+    }
+
+    // The number of identity pixels (outside the set and not globally masked) whose patch covers (y, x).
+    inline int identity_count(int y, int x) const {
+        return m_identity_count.at<unsigned short>(y, x);
+    }
+
+private:
+    cv::Size m_size;
+    int m_patch_size;
+    std::vector<Span> m_spans;
+    std::vector<int> m_row_offsets;
+    int m_nr_pixels;
+    cv::Rect m_bounding_box;
+    cv::Mat m_identity_count;  // CV_16UC1
+};
+
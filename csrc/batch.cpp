@@ -0,0 +1,47 @@
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <numeric>
+
+#include "batch.h"
+#include "inpaint.h"
+
+int BatchInpainting::add(cv::Mat image, cv::Mat mask) {
+    return add(image, mask, cv::Mat());
+}
+
+int BatchInpainting::add(cv::Mat image, cv::Mat mask, cv::Mat global_mask) {
+    m_images.push_back(image);
+    m_masks.push_back(mask);
+    m_global_masks.push_back(global_mask);
+    return size() - 1;
+}
+
+std::vector<cv::Mat> BatchInpainting::run(bool verbose, unsigned int random_seed) {
+    const int nr_images = size();
+    std::vector<cv::Mat> results(nr_images);
+
+    std::vector<int> order(nr_images);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [this](int a, int b) { return m_images[a].size().area() > m_images[b].size().area(); });
+    if (verbose) std::cerr << "Batch inpainting: " << nr_images << " image(s)." << std::endl;
+
+    // The inpaintings are created inside the jobs, so only the images in flight hold their pyramids.
+    auto run_job = [&](int rank) {
+        const int k = order[rank];
+        std::unique_ptr<Inpainting> job;
+        if (m_global_masks[k].empty()) job.reset(new Inpainting(m_images[k], m_masks[k], m_distance_metric));
+        else job.reset(new Inpainting(m_images[k], m_masks[k], m_global_masks[k], m_distance_metric));
+        job->set_thread_pool(m_thread_pool);
+        job->set_options(m_options);
+        results[k] = job->run(false, false, random_seed + static_cast<unsigned int>(k) * 2654435761u);
+    };
+
+    if (m_thread_pool == nullptr) {
+        for (int rank = 0; rank < nr_images; ++rank) run_job(rank);
+    } else {
+        m_thread_pool->parallel_for(0, nr_images, run_job);
+    }
+
+    return results;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "inpaint.h"
+#include "nnf.h"
+#include "thread_pool.h"
+
+/**
+ * Inpaints a batch of independent images concurrently on one pool.
+ * The images are started largest first (longest processing time first), so a large image does not start last and
+ * stall the batch; and since every image also parallelizes its own work on the same pool, the workers left idle at
+ * the end of the batch help with the images still running. The image k is inpainted with the seed
+ * random_seed + k * 2654435761, whatever the schedule, so the results do not depend on the number of threads.
+ */
+class BatchInpainting {
+public:
+    explicit BatchInpainting(const PatchDistanceMetric *metric) : m_distance_metric(metric), m_thread_pool(&ThreadPool::global()), m_options(), m_images(), m_masks(), m_global_masks() {
+        // pass
+    }
+
+    // Returns the index of the image in the batch.
+    int add(cv::Mat image, cv::Mat mask);
+    int add(cv::Mat image, cv::Mat mask, cv::Mat global_mask);
+    // The results, in the order of the images.
+    std::vector<cv::Mat> run(bool verbose = false, unsigned int random_seed = 1212);
+
+    inline void set_thread_pool(ThreadPool *pool) {
+        m_thread_pool = pool;
+    }
+    // The options of every image.
+    inline void set_options(const InpaintingOptions &options) {
+        m_options = options;
+    }
+    inline int size() const {
+        return static_cast<int>(m_images.size());
+    }
+
+private:
+    const PatchDistanceMetric *m_distance_metric;
+    ThreadPool *m_thread_pool;
+    InpaintingOptions m_options;
+    std::vector<cv::Mat> m_images;
+    std::vector<cv::Mat> m_masks;
+    std::vector<cv::Mat> m_global_masks;
+};
+
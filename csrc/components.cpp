@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+
+#include "active_set.h"
+#include "components.h"
+
+/**
+ * Connected-component decomposition of the hole (see components.h).
+ */
+
+ComponentInpainting::ComponentInpainting(cv::Mat image, cv::Mat mask, const PatchDistanceMetric *metric)
+    : m_image(image), m_mask(mask), m_global_mask(), m_distance_metric(metric), m_thread_pool(&ThreadPool::global()), m_options(), m_cancel_flag(nullptr), m_cancelled(false), m_crops() {
+    _initialize_crops();
+}
+
+ComponentInpainting::ComponentInpainting(cv::Mat image, cv::Mat mask, cv::Mat global_mask, const PatchDistanceMetric *metric)
+    : m_image(image), m_mask(mask), m_global_mask(global_mask), m_distance_metric(metric), m_thread_pool(&ThreadPool::global()), m_options(), m_cancel_flag(nullptr), m_cancelled(false), m_crops() {
+    _initialize_crops();
+}
+
+int ComponentInpainting::context_margin(int extent, int patch_size) {
+    // The pyramid of a job halves the hole until it fits in a patch radius (see Inpainting::nr_hole_levels); keep two
+    // patch widths of context at that level.
+    const int patch_width = 2 * patch_size + 1;
+    return (2 * patch_width) << Inpainting::nr_hole_levels(extent, patch_size);
+}
+
+void ComponentInpainting::_initialize_crops() {
+    auto mask_row = [this](int y) { return m_mask.ptr<unsigned char>(y); };
+    auto global_mask_row = [this](int y) { return m_global_mask.empty() ? nullptr : m_global_mask.ptr<unsigned char>(y); };
+    auto boxes = hole_component_boxes(m_image.size(), mask_row, global_mask_row);
+    m_crops = component_crops(boxes, m_image.size(), m_distance_metric->patch_size());
+}
+
+namespace {
+
+struct HoleRun {
+    int x_begin, x_end, label;
+};
+
+inline int find_root(std::vector<int> &parents, int label) {
+    while (parents[label] != label) {
+        parents[label] = parents[parents[label]];
+        label = parents[label];
+    }
+    return label;
+}
+
+// Raster order of the first pixels.
+inline bool precedes(const cv::Point &a, const cv::Point &b) {
+    return a.y < b.y || (a.y == b.y && a.x < b.x);
+}
+
+}
+
+std::vector<cv::Rect> hole_component_boxes(cv::Size size, const MaskRowFunc &mask_row, const MaskRowFunc &global_mask_row) {
+    // Union-find over the runs of the hole. A label is only live while a run of the last row refers to it: at the
+    // end of every row, the components that did not reach it are complete, and their labels are reused with those
+    // that were merged away. The root of a component keeps its first pixel, which orders the result.
+    std::vector<int> parents;
+    std::vector<cv::Rect> boxes;
+    std::vector<cv::Point> firsts;
+    std::vector<bool> in_row;
+    std::vector<int> live, next_live, free_labels;
+    std::vector<std::pair<cv::Point, cv::Rect>> components;
+    std::vector<HoleRun> previous, current;
+
+    auto retire = [&](bool is_last_row) {
+        for (const auto &run : current) in_row[run.label] = true;
+        next_live.clear();
+        for (int label : live) {
+            if (parents[label] != label) {
+                free_labels.push_back(label);
+            } else if (in_row[label] && !is_last_row) {
+                next_live.push_back(label);
+            } else {
+                components.emplace_back(firsts[label], boxes[label]);
+                free_labels.push_back(label);
+            }
+        }
+        for (const auto &run : current) in_row[run.label] = false;
+        std::swap(live, next_live);
+    };
+
+    for (int y = 0; y < size.height; ++y) {
+        const unsigned char *mask = mask_row(y);
+        const unsigned char *global_mask = global_mask_row(y);
+        auto is_hole = [mask, global_mask](int x) { return mask[x] != 0 && (global_mask == nullptr || global_mask[x] == 0); };
+
+        current.clear();
+        size_t k = 0;
+        for (int x = 0; x < size.width; ) {
+            if (!is_hole(x)) {
+                ++x;
+                continue;
+            }
+            HoleRun run = {x, x, -1};
+            while (run.x_end < size.width && is_hole(run.x_end)) ++run.x_end;
+            x = run.x_end;
+
+            // The runs of the previous row that touch this one, diagonals included.
+            while (k < previous.size() && previous[k].x_end < run.x_begin) ++k;
+            for (size_t l = k; l < previous.size() && previous[l].x_begin <= run.x_end; ++l) {
+                const int root = find_root(parents, previous[l].label);
+                if (run.label < 0) {
+                    run.label = root;
+                } else if (root != run.label) {
+                    int a = run.label, b = root;
+                    if (precedes(firsts[b], firsts[a])) std::swap(a, b);
+                    parents[b] = a;
+                    boxes[a] |= boxes[b];
+                    run.label = a;
+                }
+            }
+            if (run.label < 0) {
+                if (free_labels.empty()) {
+                    run.label = static_cast<int>(parents.size());
+                    parents.push_back(run.label);
+                    boxes.push_back(cv::Rect());
+                    firsts.push_back(cv::Point());
+                    in_row.push_back(false);
+                } else {
+                    run.label = free_labels.back();
+                    free_labels.pop_back();
+                    parents[run.label] = run.label;
+                    boxes[run.label] = cv::Rect();
+                }
+                firsts[run.label] = cv::Point(run.x_begin, y);
+                live.push_back(run.label);
+            }
+            boxes[run.label] |= cv::Rect(run.x_begin, y, run.x_end - run.x_begin, 1);
+            current.push_back(run);
+        }
+
+        // From now on the runs only refer to live roots.
+        for (auto &run : current) run.label = find_root(parents, run.label);
+        retire(y + 1 == size.height);
+        std::swap(previous, current);
+    }
+
+    std::sort(components.begin(), components.end(), [](const std::pair<cv::Point, cv::Rect> &a, const std::pair<cv::Point, cv::Rect> &b) {
+        return precedes(a.first, b.first);
+    });
+    std::vector<cv::Rect> result;
+    result.reserve(components.size());
+    for (const auto &component : components) result.push_back(component.second);
+    return result;
+}
+
+std::vector<cv::Rect> component_crops(const std::vector<cv::Rect> &boxes, cv::Size size, int patch_size) {
+    const cv::Rect image_rect(0, 0, size.width, size.height);
+    std::vector<cv::Rect> crops;
+    for (const auto &box : boxes) {
+        const int margin = ComponentInpainting::context_margin(std::max(box.width, box.height), patch_size);
+        crops.push_back(cv::Rect(box.x - margin, box.y - margin, box.width + 2 * margin, box.height + 2 * margin) & image_rect);
+    }
+
+    // Merge the overlapping crops, until none of them overlap: every hole pixel then belongs to exactly one job,
+    // and the jobs write disjoint parts of the result.
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (size_t a = 0; a < crops.size() && !merged; ++a) {
+            for (size_t b = a + 1; b < crops.size(); ++b) {
+                if ((crops[a] & crops[b]).empty()) continue;
+                crops[a] = crops[a] | crops[b];
+                crops.erase(crops.begin() + b);
+                merged = true;
+                break;
+            }
+        }
+    }
+
+    // Largest first, so that a big job does not start last and stall the others.
+    std::stable_sort(crops.begin(), crops.end(), [](const cv::Rect &a, const cv::Rect &b) { return a.area() > b.area(); });
+    return crops;
+}
+
+cv::Mat ComponentInpainting::run(bool verbose, unsigned int random_seed) {
+    cv::Mat result = m_image.clone();
+    const int nr_jobs = static_cast<int>(m_crops.size());
+    if (verbose) std::cerr << "Component inpainting: " << nr_jobs << " job(s)." << std::endl;
+
+    // The jobs share the deadline of the whole run.
+    const auto deadline = Inpainting::Clock::now() + std::chrono::duration_cast<Inpainting::Clock::duration>(std::chrono::duration<double>(m_options.time_budget));
+    std::atomic<bool> cancelled(false);
+
+    // A job that starts after a cancellation still runs: it stops after the first EM iteration of its coarsest level
+    // (see Inpainting::set_cancel_flag), so that its hole gets a coarse fill too.
+    auto run_job = [&](int k) {
+        const cv::Rect &crop = m_crops[k];
+        if (verbose) std::cerr << "  Job " << k << ": " << crop.width << "x" << crop.height << " at (" << crop.x << ", " << crop.y << ")." << std::endl;
+
+        cv::Mat image = m_image(crop).clone(), mask = m_mask(crop).clone(), global_mask;
+        std::unique_ptr<Inpainting> job;
+        if (m_global_mask.empty()) {
+            job.reset(new Inpainting(image, mask, m_distance_metric));
+        } else {
+            global_mask = m_global_mask(crop).clone();
+            job.reset(new Inpainting(image, mask, global_mask, m_distance_metric));
+        }
+        job->set_thread_pool(m_thread_pool);
+        job->set_options(m_options);
+        job->set_cancel_flag(m_cancel_flag);
+        if (m_options.time_budget > 0) job->set_deadline(deadline);
+        cv::Mat job_result = job->run(false, false, random_seed + static_cast<unsigned int>(k) * 2654435761u);
+        if (job->cancelled()) cancelled = true;
+        job.reset();
+
+        // Copy back the pixels the inpainting may change: those whose patch touches the hole.
+        const MaskedImage source = global_mask.empty() ? MaskedImage(image, mask) : MaskedImage(image, mask, global_mask);
+        const ActiveSet changed(source, m_distance_metric->patch_size());
+        for (const auto &span : changed.spans()) {
+            for (int j = span.x_begin; j < span.x_end; ++j) {
+                const unsigned char *from = job_result.ptr<unsigned char>(span.y, j);
+                unsigned char *to = result.ptr<unsigned char>(crop.y + span.y, crop.x + j);
+                to[0] = from[0], to[1] = from[1], to[2] = from[2];
+            }
+        }
+    };
+
+    if (m_thread_pool == nullptr) {
+        for (int k = 0; k < nr_jobs; ++k) run_job(k);
+    } else {
+        m_thread_pool->parallel_for(0, nr_jobs, run_job);
+    }
+
+    m_cancelled = cancelled;
+    return result;
+}
+
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "inpaint.h"
+#include "nnf.h"
+#include "thread_pool.h"
+
+// Returns row y of a CV_8U mask, or nullptr if there is no such mask.
+typedef std::function<const unsigned char *(int y)> MaskRowFunc;
+
+// The bounding boxes of the 8-connected components of the hole (masked and not globally masked pixels), in the
+// raster order of their first pixel. The rows are read once, in order, and only the runs of two consecutive rows are
+// compared, so the masks can be streamed. Labels are reused once their component is complete: besides the result, the
+// memory is proportional to the number of runs in a row.
+std::vector<cv::Rect> hole_component_boxes(cv::Size size, const MaskRowFunc &mask_row, const MaskRowFunc &global_mask_row);
+// The crops of the components (see ComponentInpainting), merged until they are disjoint, largest first.
+std::vector<cv::Rect> component_crops(const std::vector<cv::Rect> &boxes, cv::Size size, int patch_size);
+
+/**
+ * Inpaints every connected component (8-connectivity) of the hole as its own job.
+ * Each component is cropped with a context margin that grows with its size: two patch widths at the coarsest pyramid
+ * level the component needs. Overlapping crops are merged into one job. The jobs run concurrently on the pool,
+ * largest first, and the pixels they may change (the hole and the pixels whose patch touches it) are copied back.
+ * A job only sees its crop, so the patches filling a hole come from its neighborhood instead of the whole image.
+ * That is the trade-off that turns many small, scattered holes into cheap independent problems. The metric must not
+ * depend on absolute pixel positions (e.g. PatchSSDDistanceMetric).
+ */
+class ComponentInpainting {
+public:
+    ComponentInpainting(cv::Mat image, cv::Mat mask, const PatchDistanceMetric *metric);
+    ComponentInpainting(cv::Mat image, cv::Mat mask, cv::Mat global_mask, const PatchDistanceMetric *metric);
+    cv::Mat run(bool verbose = false, unsigned int random_seed = 1212);
+
+    inline void set_thread_pool(ThreadPool *pool) {
+        m_thread_pool = pool;
+    }
+    // The options of every job.
+    inline void set_options(const InpaintingOptions &options) {
+        m_options = options;
+    }
+    // See Inpainting::set_cancel_flag: every job stops before its next EM iteration, and those that did not start
+    // yet after the first one, so that all the holes get at least a coarse fill.
+    inline void set_cancel_flag(const std::atomic<bool> *flag) {
+        m_cancel_flag = flag;
+    }
+    // Whether the last run was cancelled.
+    inline bool cancelled() const {
+        return m_cancelled;
+    }
+    // The crop of every job, largest first.
+    inline const std::vector<cv::Rect> &crops() const {
+        return m_crops;
+    }
+
+    // The context margin around a component whose bounding box spans extent pixels.
+    static int context_margin(int extent, int patch_size);
+
+private:
+    void _initialize_crops();
+
+    cv::Mat m_image;
+    cv::Mat m_mask;
+    cv::Mat m_global_mask;
+    const PatchDistanceMetric *m_distance_metric;
+    ThreadPool *m_thread_pool;
+    InpaintingOptions m_options;
+    const std::atomic<bool> *m_cancel_flag;
+    bool m_cancelled;
+    std::vector<cv::Rect> m_crops;
+};
+
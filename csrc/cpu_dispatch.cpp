@@ -0,0 +1,61 @@
+#include <atomic>
+
+#include "cpu_dispatch.h"
+
+namespace {
+    const KernelTable kKernelTables[] = {
+        {kISAScalar, distance_row_scalar, packed_distance_row_scalar, packed_distance_column_scalar, vote_row_scalar, downsample_row_scalar, gradient_row_scalar},
+#if PM_HAS_X86_KERNELS
+        {kISASSE41, distance_row_sse41, packed_distance_row_sse41, packed_distance_column_sse41, vote_row_sse41, downsample_row_sse41, gradient_row_sse41},
+        {kISAAVX2, distance_row_avx2, packed_distance_row_avx2, packed_distance_column_avx2, vote_row_avx2, downsample_row_avx2, gradient_row_avx2},
+        // There are no AVX-512 specific kernels yet: use the AVX2 ones.
+        {kISAAVX512, distance_row_avx2, packed_distance_row_avx2, packed_distance_column_avx2, vote_row_avx2, downsample_row_avx2, gradient_row_avx2},
+#endif
+    };
+
+    int detect_isa() {
+#if PM_HAS_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return kISAAVX512;
+        if (__builtin_cpu_supports("avx2")) return kISAAVX2;
+        if (__builtin_cpu_supports("sse4.1")) return kISASSE41;
+#endif
+        return kISAScalar;
+    }
+
+    std::atomic<const KernelTable *> &active_table() {
+        static std::atomic<const KernelTable *> table(&kKernelTables[cpu_detected_isa()]);
+        return table;
+    }
+}
+
+int cpu_detected_isa() {
+    static const int isa = detect_isa();
+    return isa;
+}
+
+int cpu_active_isa() {
+    return active_kernels().isa;
+}
+
+int cpu_set_isa(int isa) {
+    const int detected = cpu_detected_isa();
+    if (isa < 0 || isa > detected) isa = detected;
+    active_table().store(&kKernelTables[isa]);
+    return isa;
+}
+
+const char *cpu_isa_name(int isa) {
+    switch (isa) {
+        case kISAScalar: return "scalar";
+        case kISASSE41: return "sse4.1";
+        case kISAAVX2: return "avx2";
+        case kISAAVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+const KernelTable &active_kernels() {
+    return *active_table().load(std::memory_order_relaxed);
+}
+
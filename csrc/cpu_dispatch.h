@@ -0,0 +1,47 @@
+#pragma once
+
+#include "distance_kernels.h"
+#include "image_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PM_HAS_X86_KERNELS 1
+#define PM_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define PM_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define PM_HAS_X86_KERNELS 0
+#endif
+
+/**
+ * Runtime selection of the vectorized kernels.
+ * The library is compiled for the baseline instruction set; the SSE4.1/AVX2 kernels are compiled with function
+ * level target attributes and only picked when the running CPU supports them.
+ */
+
+enum CPUInstructionSet {
+    kISAScalar = 0,
+    kISASSE41 = 1,
+    kISAAVX2 = 2,
+    kISAAVX512 = 3,
+};
+
+struct KernelTable {
+    int isa;
+    DistanceRowKernel distance_row;
+    PackedDistanceRowKernel packed_distance_row;
+    PackedDistanceColumnKernel packed_distance_column;
+    VoteRowKernel vote_row;
+    DownsampleRowKernel downsample_row;
+    GradientRowKernel gradient_row;
+};
+
+// The best instruction set supported by the running CPU.
+int cpu_detected_isa();
+// The instruction set of the kernels currently in use.
+int cpu_active_isa();
+// Forces the kernels of the given instruction set (capped to what the CPU supports); a negative value restores the
+// automatic choice. Returns the instruction set actually selected.
+int cpu_set_isa(int isa);
+const char *cpu_isa_name(int isa);
+
+const KernelTable &active_kernels();
+
@@ -0,0 +1,268 @@
+#include <cstring>
+
+#include "cpu_dispatch.h"
+#include "distance_kernels.h"
+#include "masked_image.h"
+#include "nnf.h"
+
+#if PM_HAS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace {
+
+inline int pow2(int i) {
+    return i * i;
+}
+
+inline bool is_invalid(const DistanceRowPointers &source, const DistanceRowPointers &target, int x) {
+    return source.mask[x] || target.mask[x] || (source.global_mask && source.global_mask[x]) || (target.global_mask && target.global_mask[x]);
+}
+
+// Fills valid[k] with 0xFF if the k-th pixel pair is usable and 0 otherwise; returns the number of invalid pairs.
+inline int gather_valid(const DistanceRowPointers &source, const DistanceRowPointers &target, int x, int n, unsigned char *valid) {
+    int nr_invalid = 0;
+    for (int k = 0; k < n; ++k) {
+        bool invalid = is_invalid(source, target, x + k);
+        valid[k] = invalid ? 0 : 0xFF;
+        nr_invalid += invalid;
+    }
+    return nr_invalid;
+}
+
+inline int packed_pixel_distance(const unsigned char *source, const unsigned char *target) {
+    int ssd = 0;
+    for (int c = 0; c < 9; ++c) {
+        ssd += pow2(static_cast<int>(source[c]) - target[c]);
+    }
+    const bool valid = (source[PackedFeatures::kFlagsOffset] | target[PackedFeatures::kFlagsOffset]) == 0;
+    return valid ? ssd : PatchSSDDistanceMetric::kSSDScale;
+}
+
+}
+
+int64_t distance_row_scalar(const DistanceRowPointers &source, const DistanceRowPointers &target, int n) {
+    int64_t distance = 0;
+    for (int x = 0; x < n; ++x) {
+        if (is_invalid(source, target, x)) {
+            distance += PatchSSDDistanceMetric::kSSDScale;
+            continue;
+        }
+
+        int ssd = 0;
+        for (int c = 0; c < 3; ++c) {
+            ssd += pow2(static_cast<int>(source.image[x * 3 + c]) - target.image[x * 3 + c]);
+            ssd += pow2(static_cast<int>(source.gradx[x * 3 + c]) - target.gradx[x * 3 + c]);
+            ssd += pow2(static_cast<int>(source.grady[x * 3 + c]) - target.grady[x * 3 + c]);
+        }
+        distance += ssd;
+    }
+    return distance;
+}
+
+int64_t packed_distance_row_scalar(const unsigned char *source, const unsigned char *target, int n) {
+    int64_t distance = 0;
+    for (int x = 0; x < n; ++x, source += PackedFeatures::kPixelBytes, target += PackedFeatures::kPixelBytes) {
+        distance += packed_pixel_distance(source, target);
+    }
+    return distance;
+}
+
+int64_t packed_distance_column_scalar(const unsigned char *source, std::ptrdiff_t source_stride, const unsigned char *target, std::ptrdiff_t target_stride, int n) {
+    int64_t distance = 0;
+    for (int y = 0; y < n; ++y, source += source_stride, target += target_stride) {
+        distance += packed_pixel_distance(source, target);
+    }
+    return distance;
+}
+
+#if PM_HAS_X86_KERNELS
+
+namespace {
+
+// Sum of squared differences of the 16 bytes, as four 32-bit lanes.
+PM_TARGET_SSE41 inline __m128i ssd_epu8_sse41(__m128i a, __m128i b) {
+    __m128i dlo = _mm_sub_epi16(_mm_cvtepu8_epi16(a), _mm_cvtepu8_epi16(b));
+    __m128i dhi = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(a, 8)), _mm_cvtepu8_epi16(_mm_srli_si128(b, 8)));
+    return _mm_add_epi32(_mm_madd_epi16(dlo, dlo), _mm_madd_epi16(dhi, dhi));
+}
+
+PM_TARGET_SSE41 inline int32_t hsum_epi32_sse41(__m128i v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+}
+
+// Keeps the 9 feature bytes of a packed pixel (the padding is zero anyway) and drops the flags byte.
+PM_TARGET_SSE41 inline __m128i packed_feature_mask_sse41() {
+    return _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0);
+}
+
+PM_TARGET_SSE41 int64_t packed_distance_row_sse41(const unsigned char *source, const unsigned char *target, int n) {
+    const __m128i feature_mask = packed_feature_mask_sse41();
+    int64_t distance = 0;
+    for (int x = 0; x < n; ++x, source += PackedFeatures::kPixelBytes, target += PackedFeatures::kPixelBytes) {
+        __m128i s = _mm_load_si128(reinterpret_cast<const __m128i *>(source));
+        __m128i t = _mm_load_si128(reinterpret_cast<const __m128i *>(target));
+        const bool valid = _mm_extract_epi8(_mm_or_si128(s, t), PackedFeatures::kFlagsOffset) == 0;
+        const int ssd = hsum_epi32_sse41(ssd_epu8_sse41(_mm_and_si128(s, feature_mask), _mm_and_si128(t, feature_mask)));
+        distance += valid ? ssd : PatchSSDDistanceMetric::kSSDScale;
+    }
+    return distance;
+}
+
+PM_TARGET_SSE41 int64_t packed_distance_column_sse41(const unsigned char *source, std::ptrdiff_t source_stride, const unsigned char *target, std::ptrdiff_t target_stride, int n) {
+    const __m128i feature_mask = packed_feature_mask_sse41();
+    int64_t nr_invalid = 0;
+    __m128i acc = _mm_setzero_si128();
+    for (int y = 0; y < n; ++y, source += source_stride, target += target_stride) {
+        __m128i s = _mm_load_si128(reinterpret_cast<const __m128i *>(source));
+        __m128i t = _mm_load_si128(reinterpret_cast<const __m128i *>(target));
+        if (_mm_extract_epi8(_mm_or_si128(s, t), PackedFeatures::kFlagsOffset) != 0) {
+            ++nr_invalid;
+            continue;
+        }
+        acc = _mm_add_epi32(acc, ssd_epu8_sse41(_mm_and_si128(s, feature_mask), _mm_and_si128(t, feature_mask)));
+    }
+    return hsum_epi32_sse41(acc) + nr_invalid * PatchSSDDistanceMetric::kSSDScale;
+}
+
+PM_TARGET_SSE41 int64_t distance_row_sse41(const DistanceRowPointers &source, const DistanceRowPointers &target, int n) {
+    // Spreads the per-pixel lane mask of 5 pixels over their 15 interleaved channel bytes.
+    const __m128i expand = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, -128);
+
+    int64_t distance = 0;
+    __m128i acc = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 5 <= n; x += 5) {
+        alignas(16) unsigned char valid[16] = {0};
+        distance += static_cast<int64_t>(gather_valid(source, target, x, 5, valid)) * PatchSSDDistanceMetric::kSSDScale;
+        const __m128i lane_mask = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i *>(valid)), expand);
+
+        const unsigned char *planes_s[3] = {source.image, source.gradx, source.grady};
+        const unsigned char *planes_t[3] = {target.image, target.gradx, target.grady};
+        for (int p = 0; p < 3; ++p) {
+            __m128i s = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(planes_s[p] + 3 * x)), lane_mask);
+            __m128i t = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(planes_t[p] + 3 * x)), lane_mask);
+            acc = _mm_add_epi32(acc, ssd_epu8_sse41(s, t));
+        }
+    }
+    distance += hsum_epi32_sse41(acc);
+
+    DistanceRowPointers source_tail = {source.image + 3 * x, source.gradx + 3 * x, source.grady + 3 * x, source.mask + x, source.global_mask ? source.global_mask + x : nullptr};
+    DistanceRowPointers target_tail = {target.image + 3 * x, target.gradx + 3 * x, target.grady + 3 * x, target.mask + x, target.global_mask ? target.global_mask + x : nullptr};
+    return distance + distance_row_scalar(source_tail, target_tail, n - x);
+}
+
+namespace {
+
+PM_TARGET_AVX2 inline __m256i ssd_epu8_avx2(__m256i a, __m256i b) {
+    __m256i dlo = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(a)), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b)));
+    __m256i dhi = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(a, 1)), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b, 1)));
+    return _mm256_add_epi32(_mm256_madd_epi16(dlo, dlo), _mm256_madd_epi16(dhi, dhi));
+}
+
+// Loads 10 interleaved pixels as two 128-bit halves of 5 pixels (15 bytes) each.
+PM_TARGET_AVX2 inline __m256i load_10_pixels(const unsigned char *ptr) {
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr));
+    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 15));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+// Accumulates the SSD of two packed pixel pairs, one per 128-bit half. Invalid pixels are zeroed on both sides (so
+// that they add nothing to the SSD) and counted separately.
+PM_TARGET_AVX2 inline void accumulate_packed_pair_avx2(__m256i s, __m256i t, __m256i &acc, int64_t &nr_invalid) {
+    const __m256i feature_mask = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0
+    );
+    const __m256i flags_mask = _mm256_andnot_si256(feature_mask, _mm256_set1_epi8(-1));
+
+    // All-ones halves for the pixels whose flags are zero.
+    __m256i flags = _mm256_and_si256(_mm256_or_si256(s, t), flags_mask);
+    __m256i valid = _mm256_cmpeq_epi64(_mm256_unpackhi_epi64(flags, flags), _mm256_setzero_si256());
+    nr_invalid += 2 - __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(valid))) / 2;
+
+    __m256i lane_mask = _mm256_and_si256(valid, feature_mask);
+    acc = _mm256_add_epi32(acc, ssd_epu8_avx2(_mm256_and_si256(s, lane_mask), _mm256_and_si256(t, lane_mask)));
+}
+
+PM_TARGET_AVX2 inline int64_t hsum_epi32_avx2(__m256i acc) {
+    __m128i acc128 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(acc128);
+}
+
+}
+
+PM_TARGET_AVX2 int64_t packed_distance_row_avx2(const unsigned char *source, const unsigned char *target, int n) {
+    int64_t nr_invalid = 0;
+    __m256i acc = _mm256_setzero_si256();
+    int x = 0;
+    for (; x + 2 <= n; x += 2) {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(source + x * PackedFeatures::kPixelBytes));
+        __m256i t = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(target + x * PackedFeatures::kPixelBytes));
+        accumulate_packed_pair_avx2(s, t, acc, nr_invalid);
+    }
+    int64_t distance = hsum_epi32_avx2(acc) + nr_invalid * PatchSSDDistanceMetric::kSSDScale;
+
+    return distance + packed_distance_row_scalar(source + x * PackedFeatures::kPixelBytes, target + x * PackedFeatures::kPixelBytes, n - x);
+}
+
+PM_TARGET_AVX2 int64_t packed_distance_column_avx2(const unsigned char *source, std::ptrdiff_t source_stride, const unsigned char *target, std::ptrdiff_t target_stride, int n) {
+    int64_t nr_invalid = 0;
+    __m256i acc = _mm256_setzero_si256();
+    int y = 0;
+    for (; y + 2 <= n; y += 2, source += 2 * source_stride, target += 2 * target_stride) {
+        __m256i s = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(source))),
+            _mm_load_si128(reinterpret_cast<const __m128i *>(source + source_stride)), 1
+        );
+        __m256i t = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(target))),
+            _mm_load_si128(reinterpret_cast<const __m128i *>(target + target_stride)), 1
+        );
+        accumulate_packed_pair_avx2(s, t, acc, nr_invalid);
+    }
+    int64_t distance = hsum_epi32_avx2(acc) + nr_invalid * PatchSSDDistanceMetric::kSSDScale;
+
+    return distance + packed_distance_column_scalar(source, source_stride, target, target_stride, n - y);
+}
+
+PM_TARGET_AVX2 int64_t distance_row_avx2(const DistanceRowPointers &source, const DistanceRowPointers &target, int n) {
+    const __m256i expand = _mm256_setr_epi8(
+        0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, -128,
+        0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, -128
+    );
+
+    int64_t distance = 0;
+    __m256i acc = _mm256_setzero_si256();
+    int x = 0;
+    for (; x + 10 <= n; x += 10) {
+        alignas(16) unsigned char valid[16] = {0};
+        distance += static_cast<int64_t>(gather_valid(source, target, x, 10, valid)) * PatchSSDDistanceMetric::kSSDScale;
+        __m128i valid_lo = _mm_load_si128(reinterpret_cast<const __m128i *>(valid));
+        __m256i valid_both = _mm256_inserti128_si256(_mm256_castsi128_si256(valid_lo), _mm_srli_si128(valid_lo, 5), 1);
+        const __m256i lane_mask = _mm256_shuffle_epi8(valid_both, expand);
+
+        const unsigned char *planes_s[3] = {source.image, source.gradx, source.grady};
+        const unsigned char *planes_t[3] = {target.image, target.gradx, target.grady};
+        for (int p = 0; p < 3; ++p) {
+            __m256i s = _mm256_and_si256(load_10_pixels(planes_s[p] + 3 * x), lane_mask);
+            __m256i t = _mm256_and_si256(load_10_pixels(planes_t[p] + 3 * x), lane_mask);
+            acc = _mm256_add_epi32(acc, ssd_epu8_avx2(s, t));
+        }
+    }
+
+    distance += hsum_epi32_avx2(acc);
+
+    DistanceRowPointers source_tail = {source.image + 3 * x, source.gradx + 3 * x, source.grady + 3 * x, source.mask + x, source.global_mask ? source.global_mask + x : nullptr};
+    DistanceRowPointers target_tail = {target.image + 3 * x, target.gradx + 3 * x, target.grady + 3 * x, target.mask + x, target.global_mask ? target.global_mask + x : nullptr};
+    return distance + distance_row_scalar(source_tail, target_tail, n - x);
+}
+
+#endif
+
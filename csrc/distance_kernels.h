@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Row kernels of the masked patch distance (see distance_masked_images in nnf.cpp).
+ * A kernel sums, over n consecutive pixel pairs, the SSD of the 9 feature channels (image, gradx, grady), or
+ * kSSDScale for every pair where either pixel is masked or globally masked. The accumulation is done on integers,
+ * so all kernels return exactly the same value; distance_row_scalar is the reference implementation. The kernel in
+ * use is picked at runtime (see cpu_dispatch.h).
+ *
+ * The vectorized kernels may read up to one pixel past the end of the segment, so callers must make sure that the
+ * pixel following the last one is still within the image row.
+ */
+
+struct DistanceRowPointers {
+    const unsigned char *image;
+    const unsigned char *gradx;
+    const unsigned char *grady;
+    const unsigned char *mask;
+    const unsigned char *global_mask;  // nullptr if the image has no global mask.
+};
+
+typedef int64_t (*DistanceRowKernel)(const DistanceRowPointers &source, const DistanceRowPointers &target, int n);
+
+// The same sum over n consecutive pixels of the PackedFeatures layout (see masked_image.h); a pixel pair counts
+// as kSSDScale when the flags of either pixel are non-zero. There are no border conditions.
+typedef int64_t (*PackedDistanceRowKernel)(const unsigned char *source, const unsigned char *target, int n);
+
+// The same sum over n vertically consecutive pixels of the PackedFeatures layout; the strides are in bytes.
+typedef int64_t (*PackedDistanceColumnKernel)(const unsigned char *source, std::ptrdiff_t source_stride, const unsigned char *target, std::ptrdiff_t target_stride, int n);
+
+int64_t distance_row_scalar(const DistanceRowPointers &source, const DistanceRowPointers &target, int n);
+int64_t packed_distance_row_scalar(const unsigned char *source, const unsigned char *target, int n);
+int64_t packed_distance_column_scalar(const unsigned char *source, std::ptrdiff_t source_stride, const unsigned char *target, std::ptrdiff_t target_stride, int n);
+#if defined(__x86_64__) || defined(__i386__)
+int64_t distance_row_sse41(const DistanceRowPointers &source, const DistanceRowPointers &target, int n);
+int64_t distance_row_avx2(const DistanceRowPointers &source, const DistanceRowPointers &target, int n);
+int64_t packed_distance_row_sse41(const unsigned char *source, const unsigned char *target, int n);
+int64_t packed_distance_row_avx2(const unsigned char *source, const unsigned char *target, int n);
+int64_t packed_distance_column_sse41(const unsigned char *source, std::ptrdiff_t source_stride, const unsigned char *target, std::ptrdiff_t target_stride, int n);
+int64_t packed_distance_column_avx2(const unsigned char *source, std::ptrdiff_t source_stride, const unsigned char *target, std::ptrdiff_t target_stride, int n);
+#endif
+
@@ -0,0 +1,110 @@
+#include "cpu_dispatch.h"
+#include "image_kernels.h"
+
+#if PM_HAS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+void vote_row_scalar(const unsigned char *image, const unsigned char *mask, const unsigned char *global_mask, double *vote, int n, double weight) {
+    for (int x = 0; x < n; ++x) {
+        if (mask[x] || (global_mask && global_mask[x])) continue;
+        for (int c = 0; c < 3; ++c)
+            vote[4 * x + c] += static_cast<double>(image[3 * x + c]) * weight;
+        vote[4 * x + 3] += weight;
+    }
+}
+
+void downsample_row_scalar(const int *const *rows, const int *weights, int nr_rows, int *out, int n) {
+    for (int i = 0; i < n; ++i) {
+        int sum = 0;
+        for (int k = 0; k < nr_rows; ++k) sum += weights[k] * rows[k][i];
+        out[i] = sum;
+    }
+}
+
+void gradient_row_scalar(const unsigned char *next, const unsigned char *previous, unsigned char *out, int n) {
+    for (int i = 0; i < n; ++i) out[i] = (next[i] / 2 - previous[i] / 2) + 128;
+}
+
+#if PM_HAS_X86_KERNELS
+
+// The vote kernels multiply and add separately (no FMA), exactly like the scalar kernel.
+
+PM_TARGET_SSE41 void vote_row_sse41(const unsigned char *image, const unsigned char *mask, const unsigned char *global_mask, double *vote, int n, double weight) {
+    const __m128d w = _mm_set1_pd(weight);
+    for (int x = 0; x < n; ++x) {
+        if (mask[x] || (global_mask && global_mask[x])) continue;
+        const unsigned char *p = image + 3 * x;
+        __m128d rg = _mm_mul_pd(_mm_setr_pd(p[0], p[1]), w);
+        __m128d bw = _mm_mul_pd(_mm_setr_pd(p[2], 1.0), w);
+        _mm_storeu_pd(vote + 4 * x, _mm_add_pd(_mm_loadu_pd(vote + 4 * x), rg));
+        _mm_storeu_pd(vote + 4 * x + 2, _mm_add_pd(_mm_loadu_pd(vote + 4 * x + 2), bw));
+    }
+}
+
+PM_TARGET_AVX2 void vote_row_avx2(const unsigned char *image, const unsigned char *mask, const unsigned char *global_mask, double *vote, int n, double weight) {
+    const __m256d w = _mm256_set1_pd(weight);
+    for (int x = 0; x < n; ++x) {
+        if (mask[x] || (global_mask && global_mask[x])) continue;
+        const unsigned char *p = image + 3 * x;
+        __m256d contribution = _mm256_mul_pd(_mm256_setr_pd(p[0], p[1], p[2], 1.0), w);
+        _mm256_storeu_pd(vote + 4 * x, _mm256_add_pd(_mm256_loadu_pd(vote + 4 * x), contribution));
+    }
+}
+
+PM_TARGET_SSE41 void downsample_row_sse41(const int *const *rows, const int *weights, int nr_rows, int *out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i sum = _mm_setzero_si128();
+        for (int k = 0; k < nr_rows; ++k) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[k] + i));
+            sum = _mm_add_epi32(sum, _mm_mullo_epi32(v, _mm_set1_epi32(weights[k])));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), sum);
+    }
+    const int *tail_rows[8];
+    for (int k = 0; k < nr_rows; ++k) tail_rows[k] = rows[k] + i;
+    downsample_row_scalar(tail_rows, weights, nr_rows, out + i, n - i);
+}
+
+PM_TARGET_AVX2 void downsample_row_avx2(const int *const *rows, const int *weights, int nr_rows, int *out, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i sum = _mm256_setzero_si256();
+        for (int k = 0; k < nr_rows; ++k) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(rows[k] + i));
+            sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(v, _mm256_set1_epi32(weights[k])));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), sum);
+    }
+    const int *tail_rows[8];
+    for (int k = 0; k < nr_rows; ++k) tail_rows[k] = rows[k] + i;
+    downsample_row_scalar(tail_rows, weights, nr_rows, out + i, n - i);
+}
+
+// next / 2 < 128, so adding 128 is setting the high bit, and subtracting previous / 2 < 128 cannot wrap: the byte
+// arithmetic is exact.
+PM_TARGET_SSE41 void gradient_row_sse41(const unsigned char *next, const unsigned char *previous, unsigned char *out, int n) {
+    const __m128i low_bits = _mm_set1_epi8(0x7f), high_bit = _mm_set1_epi8(static_cast<char>(0x80));
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_and_si128(_mm_srli_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(next + i)), 1), low_bits);
+        __m128i b = _mm_and_si128(_mm_srli_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(previous + i)), 1), low_bits);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_sub_epi8(_mm_or_si128(a, high_bit), b));
+    }
+    gradient_row_scalar(next + i, previous + i, out + i, n - i);
+}
+
+PM_TARGET_AVX2 void gradient_row_avx2(const unsigned char *next, const unsigned char *previous, unsigned char *out, int n) {
+    const __m256i low_bits = _mm256_set1_epi8(0x7f), high_bit = _mm256_set1_epi8(static_cast<char>(0x80));
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_and_si256(_mm256_srli_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(next + i)), 1), low_bits);
+        __m256i b = _mm256_and_si256(_mm256_srli_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(previous + i)), 1), low_bits);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_sub_epi8(_mm256_or_si256(a, high_bit), b));
+    }
+    gradient_row_scalar(next + i, previous + i, out + i, n - i);
+}
+
+#endif
+
@@ -0,0 +1,31 @@
+#pragma once
+
+/**
+ * Row kernels of the voting (see _expectation_step in inpaint.cpp), of the pyramid downsampling
+ * (see MaskedImage::downsample) and of the image gradients (see ImageGradients). All implementations of a kernel
+ * produce bit-identical results.
+ */
+
+// Adds weight * image (and the weight itself as the 4th channel) to n consecutive CV_64FC4 vote pixels, skipping the
+// source pixels that are masked or globally masked (global_mask may be nullptr).
+typedef void (*VoteRowKernel)(const unsigned char *image, const unsigned char *mask, const unsigned char *global_mask, double *vote, int n, double weight);
+
+// Vertical pass of the separable downsampling kernel: out[i] = sum_k weights[k] * rows[k][i], over n int values
+// (nr_rows <= 8).
+typedef void (*DownsampleRowKernel)(const int *const *rows, const int *weights, int nr_rows, int *out, int n);
+
+// The central difference of the gradients: out[i] = next[i] / 2 - previous[i] / 2 + 128, over n bytes.
+typedef void (*GradientRowKernel)(const unsigned char *next, const unsigned char *previous, unsigned char *out, int n);
+
+void vote_row_scalar(const unsigned char *image, const unsigned char *mask, const unsigned char *global_mask, double *vote, int n, double weight);
+void downsample_row_scalar(const int *const *rows, const int *weights, int nr_rows, int *out, int n);
+void gradient_row_scalar(const unsigned char *next, const unsigned char *previous, unsigned char *out, int n);
+#if defined(__x86_64__) || defined(__i386__)
+void vote_row_sse41(const unsigned char *image, const unsigned char *mask, const unsigned char *global_mask, double *vote, int n, double weight);
+void vote_row_avx2(const unsigned char *image, const unsigned char *mask, const unsigned char *global_mask, double *vote, int n, double weight);
+void downsample_row_sse41(const int *const *rows, const int *weights, int nr_rows, int *out, int n);
+void downsample_row_avx2(const int *const *rows, const int *weights, int nr_rows, int *out, int n);
+void gradient_row_sse41(const unsigned char *next, const unsigned char *previous, unsigned char *out, int n);
+void gradient_row_avx2(const unsigned char *next, const unsigned char *previous, unsigned char *out, int n);
+#endif
+
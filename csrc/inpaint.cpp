@@ -1,40 +1,106 @@
 #include <algorithm>
 #include <iostream>
+#include <limits>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
 
+#include "components.h"
+#include "cpu_dispatch.h"
 #include "inpaint.h"
+#include "pyramid.h"
 
 namespace {
-    static std::vector<double> kDistance2Similarity;
-
-    void init_kDistance2Similarity() {
+    std::vector<double> make_distance2similarity(double sharpness = 1.0) {
         double base[11] = {1.0, 0.99, 0.96, 0.83, 0.38, 0.11, 0.02, 0.005, 0.0006, 0.0001, 0};
         int length = (PatchDistanceMetric::kDistanceScale + 1);
-        kDistance2Similarity.resize(length);
+        std::vector<double> table(length);
         for (int i = 0; i < length; ++i) {
-            double t = (double) i / length;
+            double t = std::min(1.0, sharpness * i / length);
             int j = (int) (100 * t);
             int k = j + 1;
             double vj = (j < 11) ? base[j] : 0;
             double vk = (k < 11) ? base[k] : 0;
-            kDistance2Similarity[i] = vj + (100 * t - j) * (vk - vj);
+            table[i] = vj + (100 * t - j) * (vk - vj);
+        }
+        return table;
+    }
+
+    // Built when the library is loaded, before any inpainting can run: reading it needs no synchronization.
+    const std::vector<double> kDistance2Similarity = make_distance2similarity();
+
+    inline int level_limit(int value) {
+        return value < 0 ? std::numeric_limits<int>::max() : value;
+    }
+
+
+    // Whether a CV_32SC3 field holds entries without a match (see NearestNeighborField::kInvalidMatch).
+    bool has_invalid_matches(const cv::Mat &field) {
+        for (int i = 0; i < field.rows; ++i) {
+            const int *row = field.ptr<int>(i);
+            for (int j = 0; j < field.cols; ++j) {
+                if (row[3 * j] == NearestNeighborField::kInvalidMatch) return true;
+            }
         }
+        return false;
     }
 
+    // Splats a run of n consecutive pixels, read from (ys, xs) in source and written to (yt, xt) in the vote buffer.
+    inline void _weighted_copy_run(const MaskedImage &source, int ys, int xs, cv::Mat &vote, int yt, int xt, int n, double weight) {
+        const unsigned char *global_mask = source.global_mask().empty() ? nullptr : source.global_mask().ptr<unsigned char>(ys, xs);
+        active_kernels().vote_row(source.get_image(ys, xs), source.mask().ptr<unsigned char>(ys, xs), global_mask, vote.ptr<double>(yt, xt), n, weight);
+    }
 
-    inline void _weighted_copy(const MaskedImage &source, int ys, int xs, cv::Mat &target, int yt, int xt, double weight) {
-        if (source.is_masked(ys, xs)) return;
-        if (source.is_globally_masked(ys, xs)) return;
+    // Splats the patch of pixel (i, j) into the vote buffer, keeping only the writes to rows [row_begin, row_end).
+    // Within a patch every vote pixel is written at most once, so the patch can be splatted in row runs.
+    void _vote_patch(
+        const NearestNeighborField &nnf, bool source2target, cv::Mat &vote, const MaskedImage &source,
+        const std::vector<double> &distance2similarity, bool upscaled, int patch_size, int i, int j, int row_begin, int row_end
+    ) {
+        auto source_size = nnf.source_size();
+        auto target_size = nnf.target_size();
+        int yp = nnf.at(i, j, 0), xp = nnf.at(i, j, 1), dp = nnf.at(i, j, 2);
+        double w = distance2similarity[dp];
+
+        const bool has_global_mask = !nnf.source().global_mask().empty() || !nnf.target().global_mask().empty();
+        const int dj_begin = std::max(-patch_size, std::max(-j, -xp));
+        const int dj_end = std::min(patch_size + 1, std::min(source_size.width - j, target_size.width - xp));
+
+        for (int di = -patch_size; di <= patch_size; ++di) {
+            int ys = i + di, yt = yp + di;
+            int written = source2target ? yt : ys;
+            if (upscaled ? (2 * written + 1 < row_begin || 2 * written >= row_end) : (written < row_begin || written >= row_end)) continue;
+            if (!(ys >= 0 && ys < source_size.height && yt >= 0 && yt < target_size.height)) continue;
+
+            for (int run_begin = dj_begin; run_begin < dj_end; ) {
+                // Split the row into runs of pixels that are not globally masked on either side.
+                int run_end = run_begin;
+                if (has_global_mask) {
+                    while (run_begin < dj_end && (nnf.source().is_globally_masked(ys, j + run_begin) || nnf.target().is_globally_masked(yt, xp + run_begin))) ++run_begin;
+                    run_end = run_begin;
+                    while (run_end < dj_end && !nnf.source().is_globally_masked(ys, j + run_end) && !nnf.target().is_globally_masked(yt, xp + run_end)) ++run_end;
+                } else {
+                    run_end = dj_end;
+                }
+                if (run_begin >= run_end) break;
 
-        auto source_ptr = source.get_image(ys, xs);
-        auto target_ptr = target.ptr<double>(yt, xt);
+                int read_y = ys, read_x = j + run_begin, write_y = yt, write_x = xp + run_begin;
+                if (!source2target) {
+                    std::swap(read_y, write_y);
+                    std::swap(read_x, write_x);
+                }
 
-#pragma unroll
-        for (int c = 0; c < 3; ++c)
-            target_ptr[c] += static_cast<double>(source_ptr[c]) * weight;
-        target_ptr[3] += weight;
+                if (upscaled) {
+                    for (int uy = 0; uy < 2; ++uy) {
+                        if (2 * write_y + uy < row_begin || 2 * write_y + uy >= row_end) continue;
+                        _weighted_copy_run(source, 2 * read_y + uy, 2 * read_x, vote, 2 * write_y + uy, 2 * write_x, 2 * (run_end - run_begin), w);
+                    }
+                } else {
+                    _weighted_copy_run(source, read_y, read_x, vote, write_y, write_x, run_end - run_begin, w);
+                }
+                run_begin = run_end;
+            }
+        }
     }
 }
 
@@ -42,49 +108,176 @@ namespace {
  * This algorithme uses a version proposed by Xavier Philippeau.
  */
 
+const int Inpainting::kVoteBandsPerThread = 4;
+
+InpaintingOptions InpaintingOptions::fast() {
+    InpaintingOptions options;
+    options.max_retry = 5;
+    options.em_iterations_per_level = 1;
+    options.nnf_passes_per_level = 0;
+    options.nnf_tolerance = 0.01;
+    options.em_tolerance = 0.5;
+    options.warm_em_iterations = 1;
+    options.warm_nnf_passes = 1;
+    return options;
+}
+
+InpaintingOptions InpaintingOptions::balanced() {
+    return InpaintingOptions();
+}
+
+InpaintingOptions InpaintingOptions::quality() {
+    InpaintingOptions options;
+    options.em_iterations_base = 2;
+    options.nnf_passes_base = 2;
+    options.max_nnf_passes = 10;
+    options.nnf_tolerance = 0;
+    options.em_tolerance = 0;
+    options.hole_aware_pyramid = false;
+    options.warm_em_iterations = 3;
+    options.warm_nnf_passes = 4;
+    options.warm_search_radius = 16;
+    return options;
+}
+
+bool InpaintingOptions::preset(const std::string &name, InpaintingOptions &options) {
+    if (name == "fast") options = fast();
+    else if (name == "balanced") options = balanced();
+    else if (name == "quality") options = quality();
+    else return false;
+    return true;
+}
+
 Inpainting::Inpainting(cv::Mat image, cv::Mat mask, const PatchDistanceMetric *metric)
-    : m_initial(image, mask), m_distance_metric(metric), m_pyramid(), m_source2target(), m_target2source() {
-    _initialize_pyramid();
+    : m_initial(image, mask), m_distance_metric(metric), m_pyramid(), m_prebuilt_pyramid(), m_active_set(), m_source2target(), m_target2source(), m_thread_pool(&ThreadPool::global()), m_packed_features(true), m_minimize(nullptr), m_random_seed(0),
+      m_options(), m_distance2similarity(&kDistance2Similarity), m_custom_distance2similarity(),
+      m_progress_callback(), m_level_sink(), m_level_sink_full_size(false), m_cancel_flag(nullptr), m_cancelled(false), m_has_deadline(false), m_deadline(), m_run_has_deadline(false), m_run_deadline(),
+      m_hurry(false), m_seconds_per_pixel(-1), m_work_done(0),
+      m_keep_fields(false), m_fields(), m_warm_start(), m_warm_motion(), m_stats_enabled(false), m_stats(), m_level_stats(nullptr) {
+    // pass
 }
 
 Inpainting::Inpainting(cv::Mat image, cv::Mat mask, cv::Mat global_mask, const PatchDistanceMetric *metric)
-    : m_initial(image, mask, global_mask), m_distance_metric(metric), m_pyramid(), m_source2target(), m_target2source() {
-    _initialize_pyramid();
+    : m_initial(image, mask, global_mask), m_distance_metric(metric), m_pyramid(), m_prebuilt_pyramid(), m_active_set(), m_source2target(), m_target2source(), m_thread_pool(&ThreadPool::global()), m_packed_features(true), m_minimize(nullptr), m_random_seed(0),
+      m_options(), m_distance2similarity(&kDistance2Similarity), m_custom_distance2similarity(),
+      m_progress_callback(), m_level_sink(), m_level_sink_full_size(false), m_cancel_flag(nullptr), m_cancelled(false), m_has_deadline(false), m_deadline(), m_run_has_deadline(false), m_run_deadline(),
+      m_hurry(false), m_seconds_per_pixel(-1), m_work_done(0),
+      m_keep_fields(false), m_fields(), m_warm_start(), m_warm_motion(), m_stats_enabled(false), m_stats(), m_level_stats(nullptr) {
+    // pass
+}
+
+int Inpainting::nr_hole_levels(int extent, int patch_size) {
+    int nr_levels = 0;
+    while ((extent >> nr_levels) > patch_size) ++nr_levels;
+    return nr_levels;
 }
 
 void Inpainting::_initialize_pyramid() {
-    auto source = m_initial;
-    m_pyramid.push_back(source);
-    while (source.size().height > m_distance_metric->patch_size() && source.size().width > m_distance_metric->patch_size()) {
-        source = source.downsample();
-        m_pyramid.push_back(source);
+    // Once the largest hole is no wider than a patch radius, every patch centered in it reaches known pixels: the
+    // coarser levels only blur away the context the hole is filled from, and cost EM iterations.
+    int max_level = level_limit(m_options.max_pyramid_levels);
+    if (m_options.hole_aware_pyramid) {
+        auto mask_row = [this](int y) { return m_initial.mask().ptr<unsigned char>(y); };
+        auto global_mask_row = [this](int y) { return m_initial.global_mask().empty() ? nullptr : m_initial.global_mask().ptr<unsigned char>(y); };
+        int extent = 0;
+        for (const auto &box : hole_component_boxes(m_initial.size(), mask_row, global_mask_row)) {
+            extent = std::max(extent, std::max(box.width, box.height));
+        }
+        max_level = std::min(max_level, nr_hole_levels(extent, m_distance_metric->patch_size()));
     }
 
-    if (kDistance2Similarity.size() == 0) {
-        init_kDistance2Similarity();
+    if (!m_prebuilt_pyramid.empty()) {
+        const size_t nr_levels = std::min(m_prebuilt_pyramid.size(), static_cast<size_t>(max_level) + 1);
+        m_pyramid.assign(m_prebuilt_pyramid.begin(), m_prebuilt_pyramid.begin() + nr_levels);
+        return;
     }
+
+    // The levels come with their gradients and, when used, their packed features (see _prepare_features).
+    const PyramidBuilder builder(m_thread_pool, m_packed_features ? m_distance_metric->patch_size() + 1 : 0);
+    m_pyramid = builder.build(m_initial, max_level, m_distance_metric->patch_size());
+}
+
+void Inpainting::_prepare_features(MaskedImage &image) {
+    // One extra pixel of padding covers the propagation candidates that are shifted just outside the image.
+    if (m_packed_features) image.compute_packed_features(m_distance_metric->patch_size() + 1);
 }
 
 cv::Mat Inpainting::run(bool verbose, bool verbose_visualize, unsigned int random_seed) {
-    srand(random_seed);
+    const auto run_start = Clock::now();
+    auto seconds_since = [](Clock::time_point start) { return std::chrono::duration<double>(Clock::now() - start).count(); };
+    m_random_seed = random_seed;
+    m_cancelled = false;
+    m_run_has_deadline = m_has_deadline || m_options.time_budget > 0;
+    m_run_deadline = m_has_deadline ? m_deadline : Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(m_options.time_budget));
+    m_hurry = false;
+    m_seconds_per_pixel = -1;
+    m_work_done = 0;
+    m_level_stats = nullptr;
+    _initialize_pyramid();
+    if (m_stats_enabled) {
+        m_stats = InpaintingStats();
+        m_stats.pyramid_seconds = seconds_since(run_start);
+        m_stats.levels.reserve(m_pyramid.size());
+    }
+    if (m_keep_fields) {
+        m_fields.source2target.assign(m_pyramid.size(), cv::Mat());
+        m_fields.target2source.assign(m_pyramid.size(), cv::Mat());
+    }
+    if (m_options.similarity_sharpness == 1.0) {
+        m_distance2similarity = &kDistance2Similarity;
+    } else {
+        m_custom_distance2similarity = make_distance2similarity(m_options.similarity_sharpness);
+        m_distance2similarity = &m_custom_distance2similarity;
+    }
     const int nr_levels = m_pyramid.size();
+    m_minimize = NearestNeighborField::select_minimize(m_distance_metric);
 
     MaskedImage source, target;
     for (int level = nr_levels - 1; level >= 0; --level) {
         if (verbose) std::cerr << "Inpainting level: " << level << std::endl;
+        const auto level_start = Clock::now();
 
+        _prepare_features(m_pyramid[level]);
         source = m_pyramid[level];
+        m_active_set = std::make_shared<ActiveSet>(source, m_distance_metric->patch_size());
 
+        const bool warm = _is_warm(level);
         if (level == nr_levels - 1) {
             target = source.clone();
             target.clear_mask();
-            m_source2target = NearestNeighborField(source, target, m_distance_metric);
-            m_target2source = NearestNeighborField(target, source, m_distance_metric);
+        }
+        _prepare_features(target);
+        if (warm) {
+            // The invalid entries of the warm fields start from the coarser level, and then need the whole search.
+            const cv::Mat motion = _level_motion(level);
+            const cv::Mat &warm_source2target = m_warm_start.source2target[level], &warm_target2source = m_warm_start.target2source[level];
+            const cv::Mat coarser_source2target = level == nr_levels - 1 ? cv::Mat() : m_source2target.field();
+            const cv::Mat coarser_target2source = level == nr_levels - 1 ? cv::Mat() : m_target2source.field();
+            m_source2target = NearestNeighborField(source, target, m_distance_metric, m_active_set, _nnf_seed(level, 0), warm_source2target, motion, coarser_source2target, m_options.max_retry);
+            m_target2source = NearestNeighborField(target, source, m_distance_metric, m_active_set, _nnf_seed(level, 1), warm_target2source, motion, coarser_target2source, m_options.max_retry);
+            if (!has_invalid_matches(warm_source2target) && !has_invalid_matches(warm_target2source)) {
+                m_source2target.set_search_radius(m_options.warm_search_radius);
+                m_target2source.set_search_radius(m_options.warm_search_radius);
+            }
+        } else if (level == nr_levels - 1) {
+            m_source2target = NearestNeighborField(source, target, m_distance_metric, m_active_set, _nnf_seed(level, 0), m_options.max_retry);
+            m_target2source = NearestNeighborField(target, source, m_distance_metric, m_active_set, _nnf_seed(level, 1), m_options.max_retry);
         } else {
-            m_source2target = NearestNeighborField(source, target, m_distance_metric, m_source2target);
-            m_target2source = NearestNeighborField(target, source, m_distance_metric, m_target2source);
+            m_source2target = NearestNeighborField(source, target, m_distance_metric, m_active_set, _nnf_seed(level, 0), m_source2target, m_options.max_retry);
+            m_target2source = NearestNeighborField(target, source, m_distance_metric, m_active_set, _nnf_seed(level, 1), m_target2source, m_options.max_retry);
         }
 
+        if (m_stats_enabled) {
+            m_stats.levels.emplace_back();
+            m_level_stats = &m_stats.levels.back();
+            m_level_stats->level = level;
+            m_level_stats->size = source.size();
+            m_level_stats->active_pixels = m_active_set->nr_pixels();
+            m_level_stats->warm_started = warm;
+            m_level_stats->init_seconds = seconds_since(level_start);
+            m_source2target.set_stats(&m_level_stats->source2target);
+            m_target2source.set_stats(&m_level_stats->target2source);
+        }
         if (verbose) std::cerr << "Initialization done." << std::endl;
 
         if (verbose_visualize) {
@@ -98,43 +291,133 @@ cv::Mat Inpainting::run(bool verbose, bool verbose_visualize, unsigned int rando
             cv::waitKey(0);
         }
 
-        target = _expectation_maximization(source, target, level, verbose);
+        target = _expectation_maximization(target, level, verbose);
+        if (m_level_stats != nullptr) {
+            m_level_stats->seconds = seconds_since(level_start);
+            m_stats.seconds = seconds_since(run_start);
+        }
+        if (m_cancelled) {
+            if (verbose) std::cerr << "Cancelled at level " << level << "." << std::endl;
+            return _full_size(target);
+        }
+        if (m_keep_fields) {
+            m_fields.source2target[level] = m_source2target.field();
+            m_fields.target2source[level] = m_target2source.field();
+        }
+        if (m_level_sink) m_level_sink(level, level > 0 && m_level_sink_full_size ? _full_size(target) : target.image());
     }
 
     return target.image();
 }
 
+bool Inpainting::_is_warm(int level) const {
+    const auto &source2target = m_warm_start.source2target, &target2source = m_warm_start.target2source;
+    if (level >= static_cast<int>(source2target.size()) || level >= static_cast<int>(target2source.size())) return false;
+    const cv::Size size = m_pyramid[level].size();
+    return !source2target[level].empty() && source2target[level].size() == size && target2source[level].size() == size;
+}
+
+cv::Mat Inpainting::_level_motion(int level) const {
+    const cv::Size full_size = m_initial.size(), size = m_pyramid[level].size();
+    if (m_warm_motion.empty() || size == full_size) return m_warm_motion;
+
+    // Nearest neighbor, as MaskedImage::upsample; the offsets shrink with the level.
+    const float scale_x = static_cast<float>(size.width) / full_size.width, scale_y = static_cast<float>(size.height) / full_size.height;
+    cv::Mat motion(size, CV_32FC2);
+    for (int i = 0; i < size.height; ++i) {
+        const int ii = i * full_size.height / size.height;
+        float *to = motion.ptr<float>(i);
+        for (int j = 0; j < size.width; ++j) {
+            const float *from = m_warm_motion.ptr<float>(ii, j * full_size.width / size.width);
+            to[2 * j] = from[0] * scale_x, to[2 * j + 1] = from[1] * scale_y;
+        }
+    }
+    return motion;
+}
+
+int Inpainting::_nr_iters_em(int level) const {
+    int nr_iters = std::max(1, m_options.em_iterations_base + m_options.em_iterations_per_level * level);
+    if (m_options.warm_em_iterations > 0 && _is_warm(level)) nr_iters = std::min(nr_iters, m_options.warm_em_iterations);
+    return nr_iters;
+}
+
+int Inpainting::_nr_iters_nnf(int level) const {
+    int nr_iters = std::max(1, std::min(m_options.max_nnf_passes, m_options.nnf_passes_base + m_options.nnf_passes_per_level * level));
+    if (m_options.warm_nnf_passes > 0 && _is_warm(level)) nr_iters = std::min(nr_iters, m_options.warm_nnf_passes);
+    return nr_iters;
+}
+
+double Inpainting::_planned_work(int level, int first_iteration) const {
+    double work = 0;
+    for (int l = level; l >= 0; --l) {
+        const int nr_iters_em = _nr_iters_em(l);
+        const int first = l == level ? first_iteration : 0;
+        // The last iteration of a level votes at the size of the next one.
+        if (first < nr_iters_em) work += m_pyramid[std::max(0, l - 1)].size().area();
+        if (!m_hurry && first < nr_iters_em - 1) work += static_cast<double>(nr_iters_em - 1 - first) * m_pyramid[l].size().area();
+    }
+    return work;
+}
+
+bool Inpainting::_must_hurry(int level) {
+    if (!m_run_has_deadline || m_seconds_per_pixel < 0) return m_hurry;
+    if (!m_hurry) {
+        // This iteration, then only the last iteration of every remaining level.
+        double needed = m_pyramid[level].size().area();
+        for (int l = level; l >= 0; --l) needed += m_pyramid[std::max(0, l - 1)].size().area();
+        const auto remaining = std::chrono::duration<double>(m_run_deadline - Clock::now()).count();
+        m_hurry = needed * m_seconds_per_pixel > remaining;
+    }
+    return m_hurry;
+}
+
+cv::Mat Inpainting::_full_size(const MaskedImage &target) const {
+    const auto size = m_initial.size();
+    const MaskedImage upsampled = target.size() == size ? target : target.upsample(size.width, size.height);
+    cv::Mat result = m_initial.image().clone();
+    for (int i = 0; i < size.height; ++i) {
+        for (int j = 0; j < size.width; ++j) {
+            if (!m_initial.is_masked(i, j) || m_initial.is_globally_masked(i, j)) continue;
+            const unsigned char *from = upsampled.get_image(i, j);
+            unsigned char *to = result.ptr<unsigned char>(i, j);
+            to[0] = from[0], to[1] = from[1], to[2] = from[2];
+        }
+    }
+    return result;
+}
+
 // EM-Like algorithm (see "PatchMatch" - page 6).
 // Returns a double sized target image (unless level = 0).
-MaskedImage Inpainting::_expectation_maximization(MaskedImage source, MaskedImage target, int level, bool verbose) {
-    const int nr_iters_em = 1 + 2 * level;
-    const int nr_iters_nnf = static_cast<int>(std::min(7, 1 + level));
-    const int patch_size = m_distance_metric->patch_size();
+MaskedImage Inpainting::_expectation_maximization(MaskedImage target, int level, bool verbose) {
+    const int nr_iters_em = _nr_iters_em(level);
 
     MaskedImage new_source, new_target;
 
     for (int iter_em = 0; iter_em < nr_iters_em; ++iter_em) {
         if (iter_em != 0) {
+            _prepare_features(new_target);
             m_source2target.set_target(new_target);
             m_target2source.set_source(new_target);
             target = new_target;
         }
 
+        const bool is_first = level == static_cast<int>(m_pyramid.size()) - 1 && iter_em == 0;
+        if (!is_first && m_cancel_flag != nullptr && m_cancel_flag->load()) {
+            m_cancelled = true;
+            return target;
+        }
+        if (iter_em < nr_iters_em - 1 && _must_hurry(level)) {
+            if (verbose) std::cerr << "  Deadline: skipping " << nr_iters_em - 1 - iter_em << " iteration(s)." << std::endl;
+            iter_em = nr_iters_em - 1;
+        }
+        const int iteration = iter_em;
+        const int nr_iters_nnf = m_hurry ? 1 : _nr_iters_nnf(level);
+        const auto iteration_start = Clock::now();
+
         if (verbose) std::cerr << "EM Iteration: " << iter_em << std::endl;
 
-        auto size = source.size();
-        for (int i = 0; i < size.height; ++i) {
-            for (int j = 0; j < size.width; ++j) {
-                if (!source.contains_mask(i, j, patch_size)) {
-                    m_source2target.set_identity(i, j);
-                    m_target2source.set_identity(i, j);
-                }
-            }
-        }
-        if (verbose) std::cerr << "  NNF minimization started." << std::endl;
-        m_source2target.minimize(nr_iters_nnf);
-        m_target2source.minimize(nr_iters_nnf);
-        if (verbose) std::cerr << "  NNF minimization finished." << std::endl;
+        // The pixels whose patch does not touch the hole (outside of the active set) were set to identity when the
+        // fields were created, and the minimization never changes them.
 
         // Instead of upsizing the final target, we build the last target from the next level source image.
         // Thus, the final target is less blurry (see "Space-Time Video Completion" - page 5).
@@ -148,64 +431,189 @@ MaskedImage Inpainting::_expectation_maximization(MaskedImage source, MaskedImag
             new_target = target.clone();
         }
 
+        // The two directions are independent until their votes are merged: each one gets its own vote buffer, and
+        // the buffers are summed afterwards so that the result does not depend on the scheduling.
         auto vote = cv::Mat(new_target.size(), CV_64FC4);
         vote.setTo(cv::Scalar::all(0));
+        auto vote_t2s = cv::Mat(new_target.size(), CV_64FC4);
+        vote_t2s.setTo(cv::Scalar::all(0));
 
         // Votes for best patch from NNF Source->Target (completeness) and Target->Source (coherence).
-        _expectation_step(m_source2target, 1, vote, new_source, upscaled);
-        if (verbose) std::cerr << "  Expectation source to target finished." << std::endl;
-        _expectation_step(m_target2source, 0, vote, new_source, upscaled);
-        if (verbose) std::cerr << "  Expectation target to source finished." << std::endl;
+        TaskGraph graph;
+        // Each task times itself into its own slot: minimization and expectation, in both directions.
+        double task_seconds[4] = {0, 0, 0, 0};
+        int minimize_s2t = graph.add_task([&]() { _timed(task_seconds[0], [&]() { m_minimize(m_source2target, nr_iters_nnf, m_thread_pool, m_options.nnf_tolerance); }); });
+        int minimize_t2s = graph.add_task([&]() { _timed(task_seconds[1], [&]() { m_minimize(m_target2source, nr_iters_nnf, m_thread_pool, m_options.nnf_tolerance); }); });
+        int expectation_s2t = graph.add_task([&]() { _timed(task_seconds[2], [&]() { _expectation_step(m_source2target, 1, vote, new_source, upscaled); }); }, {minimize_s2t});
+        int expectation_t2s = graph.add_task([&]() { _timed(task_seconds[3], [&]() { _expectation_step(m_target2source, 0, vote_t2s, new_source, upscaled); }); }, {minimize_t2s});
+        graph.add_task([&]() { _timed(task_seconds[3], [&]() { _merge_votes(vote, vote_t2s); }); }, {expectation_s2t, expectation_t2s});
+
+        if (verbose) std::cerr << "  NNF minimization and expectation started." << std::endl;
+        graph.run(m_thread_pool);
+        if (verbose) std::cerr << "  NNF minimization and expectation finished." << std::endl;
 
         // Compile votes and update pixel values.
-        _maximization_step(new_target, vote);
+        double maximization_seconds = 0;
+        _timed(maximization_seconds, [&]() { _maximization_step(new_target, vote); });
+        if (m_level_stats != nullptr) {
+            m_level_stats->em_iterations += 1;
+            m_level_stats->minimize_seconds += task_seconds[0] + task_seconds[1];
+            m_level_stats->expectation_seconds += task_seconds[2] + task_seconds[3];
+            m_level_stats->maximization_seconds += maximization_seconds;
+        }
         if (verbose) std::cerr << "  Minimization step finished." << std::endl;
+
+        // Once an iteration barely changes the target, the remaining ones would not either: go straight to the last
+        // one (which builds the next level), or stop at level 0.
+        if (!upscaled && m_options.em_tolerance > 0 && _mean_change(target, new_target) < m_options.em_tolerance) {
+            const int last = level >= 1 ? nr_iters_em - 2 : nr_iters_em - 1;
+            if (verbose && iter_em < last) std::cerr << "  Converged, skipping " << last - iter_em << " iteration(s)." << std::endl;
+            iter_em = std::max(iter_em, last);
+        }
+
+        const double work = new_target.size().area();
+        m_seconds_per_pixel = std::chrono::duration<double>(Clock::now() - iteration_start).count() / work;
+        m_work_done += work;
+        if (m_progress_callback) {
+            m_progress_callback(level, iteration, m_work_done / (m_work_done + _planned_work(level, iter_em + 1)));
+        }
     }
 
     return new_target;
 }
 
 // Expectation step: vote for best estimations of each pixel.
+// The identity pixels are accounted for in a single pass (see _vote_identity); only the active ones splat patches.
+// The parallel version partitions the vote buffer into row bands. Every band replays, in raster order, the source
+// pixels whose patch votes land in the band and only keeps the writes that fall inside it. Each vote pixel thus
+// receives exactly the same sequence of additions as in the serial loop, and the output is bit-identical.
 void Inpainting::_expectation_step(
     const NearestNeighborField &nnf, bool source2target,
     cv::Mat &vote, const MaskedImage &source, bool upscaled
 ) {
-    auto source_size = nnf.source_size();
-    auto target_size = nnf.target_size();
+    _vote_identity(nnf, vote, source, upscaled);
+
+    const auto &spans = m_active_set->spans();
     const int patch_size = m_distance_metric->patch_size();
+    const int vote_height = vote.size().height;
 
-    for (int i = 0; i < source_size.height; ++i) {
-        for (int j = 0; j < source_size.width; ++j) {
-            if (nnf.source().is_globally_masked(i, j)) continue;
-            int yp = nnf.at(i, j, 0), xp = nnf.at(i, j, 1), dp = nnf.at(i, j, 2);
-            double w = kDistance2Similarity[dp];
-
-            for (int di = -patch_size; di <= patch_size; ++di) {
-                for (int dj = -patch_size; dj <= patch_size; ++dj) {
-                    int ys = i + di, xs = j + dj, yt = yp + di, xt = xp + dj;
-                    if (!(ys >= 0 && ys < source_size.height && xs >= 0 && xs < source_size.width)) continue;
-                    if (nnf.source().is_globally_masked(ys, xs)) continue;
-                    if (!(yt >= 0 && yt < target_size.height && xt >= 0 && xt < target_size.width)) continue;
-                    if (nnf.target().is_globally_masked(yt, xt)) continue;
-
-                    if (!source2target) {
-                        std::swap(ys, yt);
-                        std::swap(xs, xt);
-                    }
+    if (m_thread_pool == nullptr || m_thread_pool->nr_threads() <= 1) {
+        for (const auto &span : spans) {
+            for (int j = span.x_begin; j < span.x_end; ++j) {
+                if (nnf.source().is_globally_masked(span.y, j)) continue;
+                _vote_patch(nnf, source2target, vote, source, *m_distance2similarity, upscaled, patch_size, span.y, j, 0, vote_height);
+            }
+        }
+        return;
+    }
 
-                    if (upscaled) {
-                        for (int uy = 0; uy < 2; ++uy) {
-                            for (int ux = 0; ux < 2; ++ux) {
-                                _weighted_copy(source, 2 * ys + uy, 2 * xs + ux, vote, 2 * yt + uy, 2 * xt + ux, w);
-                            }
-                        }
-                    } else {
-                        _weighted_copy(source, ys, xs, vote, yt, xt, w);
-                    }
+    const int nr_threads = m_thread_pool->nr_threads();
+    const int nr_bands = std::max(1, std::min(vote_height, kVoteBandsPerThread * nr_threads));
+    const int band_height = (vote_height + nr_bands - 1) / nr_bands;
+    const int scale = upscaled ? 2 : 1;
+    const int width = nnf.source_size().width;
+
+    // Bucket the active pixels by the bands they write to. Chunks of spans are bucketed in parallel and replayed in
+    // chunk order, which preserves the raster order within each band.
+    const int nr_spans = static_cast<int>(spans.size());
+    const int nr_chunks = std::max(1, std::min(nr_spans, nr_threads));
+    const int chunk_length = (nr_spans + nr_chunks - 1) / nr_chunks;
+    std::vector<std::vector<std::vector<int>>> buckets(nr_chunks, std::vector<std::vector<int>>(nr_bands));
+    m_thread_pool->parallel_for(0, nr_chunks, [&](int chunk) {
+        auto &chunk_buckets = buckets[chunk];
+        const int k_end = std::min(nr_spans, (chunk + 1) * chunk_length);
+        for (int k = chunk * chunk_length; k < k_end; ++k) {
+            const int i = spans[k].y;
+            for (int j = spans[k].x_begin; j < spans[k].x_end; ++j) {
+                if (nnf.source().is_globally_masked(i, j)) continue;
+                // The votes are written around the matched position (source to target) or around the pixel itself.
+                const int center = source2target ? nnf.at(i, j, 0) : i;
+                const int written_begin = std::max(0, scale * (center - patch_size));
+                const int written_end = std::min(vote_height, scale * (center + patch_size + 1));
+                if (written_begin >= written_end) continue;
+                for (int band = written_begin / band_height; band <= (written_end - 1) / band_height; ++band) {
+                    chunk_buckets[band].push_back(i * width + j);
                 }
             }
         }
+    });
+
+    m_thread_pool->parallel_for(0, nr_bands, [&](int band) {
+        const int row_begin = band * band_height;
+        const int row_end = std::min(vote_height, row_begin + band_height);
+        for (int chunk = 0; chunk < nr_chunks; ++chunk) {
+            for (int index : buckets[chunk][band]) {
+                _vote_patch(nnf, source2target, vote, source, *m_distance2similarity, upscaled, patch_size,
+                            index / width, index % width, row_begin, row_end);
+            }
+        }
+    });
+}
+
+// The votes of the identity pixels. Every one of them splats its own patch with weight 1 (distance 0), so a vote
+// pixel receives its own source value once for each identity patch covering it: the count is precomputed by the
+// active set and the patches are never visited.
+void Inpainting::_vote_identity(const NearestNeighborField &nnf, cv::Mat &vote, const MaskedImage &source, bool upscaled) {
+    const auto source_size = nnf.source_size();
+    const int scale = upscaled ? 2 : 1;
+    const int vote_height = std::min(vote.size().height, scale * source_size.height);
+    const int vote_width = std::min(vote.size().width, scale * source_size.width);
+    const double weight = (*m_distance2similarity)[0];
+
+    auto vote_row = [&](int y) {
+        const int i = y / scale;
+        double *vote_ptr = vote.ptr<double>(y, 0);
+        for (int x = 0; x < vote_width; ++x) {
+            const int j = x / scale;
+            const int count = m_active_set->identity_count(i, j);
+            if (count == 0) continue;
+            // Same skips as in _vote_patch: globally masked pairs, then masked or globally masked source pixels.
+            if (nnf.source().is_globally_masked(i, j) || nnf.target().is_globally_masked(i, j)) continue;
+            if (source.is_masked(y, x) || source.is_globally_masked(y, x)) continue;
+
+            const unsigned char *pixel = source.get_image(y, x);
+            for (int c = 0; c < 3; ++c) vote_ptr[4 * x + c] += count * (static_cast<double>(pixel[c]) * weight);
+            vote_ptr[4 * x + 3] += count * weight;
+        }
+    };
+
+    if (m_thread_pool == nullptr) {
+        for (int y = 0; y < vote_height; ++y) vote_row(y);
+    } else {
+        m_thread_pool->parallel_for(0, vote_height, vote_row);
+    }
+}
+
+// Sums the votes of the two NNF directions into the first buffer.
+void Inpainting::_merge_votes(cv::Mat &vote, const cv::Mat &other) {
+    const int height = vote.size().height;
+    const int row_length = vote.size().width * 4;
+    auto merge_row = [&vote, &other, row_length](int i) {
+        double *vote_ptr = vote.ptr<double>(i, 0);
+        const double *other_ptr = other.ptr<double>(i, 0);
+        for (int j = 0; j < row_length; ++j) vote_ptr[j] += other_ptr[j];
+    };
+
+    if (m_thread_pool == nullptr) {
+        for (int i = 0; i < height; ++i) merge_row(i);
+    } else {
+        m_thread_pool->parallel_for(0, height, merge_row);
+    }
+}
+
+// The mean absolute difference between two targets of the same level, over the active pixels that are not globally
+// masked (the other pixels never change).
+double Inpainting::_mean_change(const MaskedImage &before, const MaskedImage &after) const {
+    int64_t total = 0, count = 0;
+    for (const auto &span : m_active_set->spans()) {
+        for (int j = span.x_begin; j < span.x_end; ++j) {
+            if (after.is_globally_masked(span.y, j)) continue;
+            const unsigned char *a = before.get_image(span.y, j), *b = after.get_image(span.y, j);
+            total += std::abs(a[0] - b[0]) + std::abs(a[1] - b[1]) + std::abs(a[2] - b[2]);
+            count += 3;
+        }
     }
+    return count == 0 ? 0 : static_cast<double>(total) / count;
 }
 
 // Maximization Step: maximum likelihood of target pixel.
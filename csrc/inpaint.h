@@ -1,27 +1,260 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 
+#include "active_set.h"
 #include "masked_image.h"
 #include "nnf.h"
+#include "random.h"
+#include "thread_pool.h"
+
+// The tuning knobs of Inpainting. The default values are the "balanced" preset.
+struct InpaintingOptions {
+    // The random draws of an NNF pixel at initialization, until one is not globally masked.
+    int max_retry = 20;
+    // Level l runs at most em_iterations_base + em_iterations_per_level * l EM iterations, each with at most
+    // min(max_nnf_passes, nnf_passes_base + nnf_passes_per_level * l) NNF passes.
+    int em_iterations_base = 1;
+    int em_iterations_per_level = 2;
+    int nnf_passes_base = 1;
+    int nnf_passes_per_level = 1;
+    int max_nnf_passes = 7;
+    // The NNF passes stop once a pass lowers the total patch distance by less than this fraction, and the EM
+    // iterations of a level skip to the last one (which upsamples) once an iteration changes the active pixels by
+    // less than this mean absolute difference, in intensity levels. 0 always runs the maximum.
+    double nnf_tolerance = 0.003;
+    double em_tolerance = 0.1;
+    // Whether the pyramid stops at the level where the largest hole fits in a patch radius (see
+    // Inpainting::nr_hole_levels), instead of going on until the image is smaller than a patch.
+    bool hole_aware_pyramid = true;
+    // At most this many downsamplings; negative for no limit.
+    int max_pyramid_levels = -1;
+    // Scales the distance axis of the curve mapping a patch distance to its vote weight: above 1, only closer
+    // matches vote (sharper, noisier fills); below 1, farther ones too (smoother, blurrier fills).
+    double similarity_sharpness = 1.0;
+    // A time budget for run(), in seconds; 0 for none. Once the remaining levels would not finish in time at the
+    // speed measured so far, every level only runs its last EM iteration, with a single NNF pass. That is the floor:
+    // a budget too small even for it is exceeded. ComponentInpainting shares one deadline between its jobs.
+    double time_budget = 0;
+    // Caps on the EM iterations and NNF passes of a level whose fields start from a previous run (see
+    // Inpainting::set_warm_start): such fields are already close to converged. 0 for no cap.
+    int warm_em_iterations = 2;
+    int warm_nnf_passes = 2;
+    // The radius, in pixels of the level, of the random search of such fields around their matches; 0 for the whole
+    // image.
+    int warm_search_radius = 8;
+
+    static InpaintingOptions fast();
+    static InpaintingOptions balanced();
+    static InpaintingOptions quality();
+    // Sets options to the preset of the given name ("fast", "balanced" or "quality"); false if there is none.
+    static bool preset(const std::string &name, InpaintingOptions &options);
+};
+
+// What a run did, level by level (see Inpainting::set_stats_enabled). The times are wall times, in seconds.
+struct InpaintingStats {
+    struct Level {
+        int level = 0;
+        cv::Size size;
+        int active_pixels = 0;
+        int em_iterations = 0;
+        bool warm_started = false;  // Whether the fields started from a previous run.
+        // init covers the active set, the features and the initialization of the fields. The two directions are
+        // minimized and voted concurrently: minimize and expectation add up both, and can exceed the time of the level.
+        double init_seconds = 0;
+        double minimize_seconds = 0;
+        double expectation_seconds = 0;
+        double maximization_seconds = 0;
+        double seconds = 0;
+        NNFStats source2target;
+        NNFStats target2source;
+    };
+
+    double pyramid_seconds = 0;
+    double seconds = 0;
+    std::vector<Level> levels;  // Coarsest first.
+};
+
+// The fields of every pyramid level at the end of a run (see Inpainting::set_keep_fields), indexed by level: the
+// CV_32SC3 fields of NearestNeighborField. The levels a cancelled run did not reach are empty.
+struct InpaintingFields {
+    std::vector<cv::Mat> source2target;
+    std::vector<cv::Mat> target2source;
+};
 
 class Inpainting {
 public:
+    typedef std::chrono::steady_clock Clock;
+    // Called by run() after every EM iteration, on its thread, with the fraction of the planned work done so far.
+    typedef std::function<void(int level, int iteration, double fraction)> ProgressCallback;
+    // Called by run() once a level is done, on its thread, with the fill of that level. The image is only valid during
+    // the call (clone it to keep it).
+    typedef std::function<void(int level, const cv::Mat &image)> LevelSink;
+
     Inpainting(cv::Mat image, cv::Mat mask, const PatchDistanceMetric *metric);
     Inpainting(cv::Mat image, cv::Mat mask, cv::Mat global_mask, const PatchDistanceMetric *metric);
     cv::Mat run(bool verbose = false, bool verbose_visualize = false, unsigned int random_seed = 1212);
 
+    // The pool used by the NNF minimization and the EM task graph; nullptr runs everything on the calling thread.
+    inline void set_thread_pool(ThreadPool *pool) {
+        m_thread_pool = pool;
+    }
+    // Whether the NNF search works on the packed, border-padded feature layout (see PackedFeatures). On by default;
+    // the results are identical, the layout only trades memory for speed.
+    inline void set_packed_features(bool value) {
+        m_packed_features = value;
+    }
+    // Read by run(), which also builds the pyramid.
+    inline void set_options(const InpaintingOptions &options) {
+        m_options = options;
+    }
+    inline const InpaintingOptions &options() const {
+        return m_options;
+    }
+    inline void set_progress_callback(ProgressCallback callback) {
+        m_progress_callback = std::move(callback);
+    }
+    // The sink receives the result of every level, coarsest first; the last one is the result of run(). Level l > 0
+    // ends by building the target of level l - 1, so its image has that size, unless full_size upsamples it to the
+    // size of the input (nearest neighbor) and puts back the known pixels of the input.
+    inline void set_level_sink(LevelSink sink, bool full_size = false) {
+        m_level_sink = std::move(sink);
+        m_level_sink_full_size = full_size;
+    }
+    // Once *flag is set (from any thread), run() stops before its next EM iteration and returns the fill reached so
+    // far, upsampled to the full size. The first iteration of the coarsest level always runs, so that the hole has a
+    // fill even if the flag is set from the start. The flag must outlive the run.
+    inline void set_cancel_flag(const std::atomic<bool> *flag) {
+        m_cancel_flag = flag;
+    }
+    // A deadline for run(), instead of the one the time budget of the options would set when it starts.
+    inline void set_deadline(Clock::time_point deadline) {
+        m_deadline = deadline;
+        m_has_deadline = true;
+    }
+    // Whether run() fills stats(). Off by default: without stats, the only cost is a test per EM iteration.
+    inline void set_stats_enabled(bool value) {
+        m_stats_enabled = value;
+    }
+    // Of the last run with stats enabled.
+    inline const InpaintingStats &stats() const {
+        return m_stats;
+    }
+    // Whether the last run was cancelled.
+    inline bool cancelled() const {
+        return m_cancelled;
+    }
+    // Whether run() keeps the fields of every level in fields(). Off by default.
+    inline void set_keep_fields(bool value) {
+        m_keep_fields = value;
+    }
+    // Of the last run with keep_fields.
+    inline const InpaintingFields &fields() const {
+        return m_fields;
+    }
+    // The fields of the levels that have the size of a level of fields then start from them, instead of from random
+    // or from the coarser level, and run the shorter schedule of InpaintingOptions::warm_em_iterations,
+    // warm_nnf_passes and warm_search_radius; their entries with no match (see NearestNeighborField::kInvalidMatch)
+    // start from the coarser level instead. motion is empty, or a CV_32FC2 map of the size of the image giving, for every pixel, the offset
+    // (dx, dy) to the same content in the image of the fields (see NearestNeighborField); it is scaled to each level.
+    inline void set_warm_start(const InpaintingFields &fields, const cv::Mat &motion = cv::Mat()) {
+        m_warm_start = fields;
+        m_warm_motion = motion;
+    }
+    // The pyramid of the image and masks of this inpainting, built beforehand by PyramidBuilder::build with the patch
+    // size as min_size and enough levels for the options (see InpaintingSession); run() takes the levels it needs from
+    // it instead of building them. Empty (the default) builds the pyramid.
+    inline void set_pyramid(std::vector<MaskedImage> levels) {
+        m_prebuilt_pyramid = std::move(levels);
+    }
+
+    // The number of downsamplings after which a hole spanning extent pixels is at most patch_size pixels wide.
+    static int nr_hole_levels(int extent, int patch_size);
+
+    static const int kVoteBandsPerThread;
+
 private:
+    friend class InpaintingBench;  // bench/bench.cpp times the EM steps on their own.
+
     void _initialize_pyramid(void);
-    MaskedImage _expectation_maximization(MaskedImage source, MaskedImage target, int level, bool verbose);
+    void _prepare_features(MaskedImage &image);
+    // The seed of the field of a level, in one direction (0: source to target, 1: target to source).
+    inline uint64_t _nnf_seed(int level, int direction) const {
+        return random_key(random_key(m_random_seed, level), direction);
+    }
+    // Whether the fields of the level start from the warm start fields.
+    bool _is_warm(int level) const;
+    // The warm start motion, at the size of the level.
+    cv::Mat _level_motion(int level) const;
+    int _nr_iters_em(int level) const;
+    int _nr_iters_nnf(int level) const;
+    // The pixels voted by the iterations [first_iteration, ...) of the level and all the iterations of the finer
+    // levels; those that are skipped once the schedule is cut for the deadline are not counted.
+    double _planned_work(int level, int first_iteration) const;
+    // Whether the deadline leaves no time for the iterations of the level before its last one.
+    bool _must_hurry(int level);
+    // The target of a level, upsampled to the full size, with the known pixels of the input.
+    cv::Mat _full_size(const MaskedImage &target) const;
+    MaskedImage _expectation_maximization(MaskedImage target, int level, bool verbose);
     void _expectation_step(const NearestNeighborField &nnf, bool source2target, cv::Mat &vote, const MaskedImage &source, bool upscaled);
+    void _vote_identity(const NearestNeighborField &nnf, cv::Mat &vote, const MaskedImage &source, bool upscaled);
+    void _merge_votes(cv::Mat &vote, const cv::Mat &other);
     void _maximization_step(MaskedImage &target, const cv::Mat &vote);
+    double _mean_change(const MaskedImage &before, const MaskedImage &after) const;
+    // Runs func, adding its time to seconds if stats are collected.
+    template <typename Func>
+    inline void _timed(double &seconds, Func func) const {
+        if (m_level_stats == nullptr) {
+            func();
+            return;
+        }
+        const auto start = Clock::now();
+        func();
+        seconds += std::chrono::duration<double>(Clock::now() - start).count();
+    }
 
     MaskedImage m_initial;
     std::vector<MaskedImage> m_pyramid;
+    std::vector<MaskedImage> m_prebuilt_pyramid;  // See set_pyramid.
+    std::shared_ptr<const ActiveSet> m_active_set;  // Of the current level.
 
     NearestNeighborField m_source2target;
     NearestNeighborField m_target2source;
     const PatchDistanceMetric *m_distance_metric;
+    ThreadPool *m_thread_pool;
+    bool m_packed_features;
+    NearestNeighborField::MinimizeFunc m_minimize;  // Selected once per run (see NearestNeighborField::select_minimize).
+    unsigned int m_random_seed;  // Keys all the random draws of the run; the global rand() state is not touched.
+    InpaintingOptions m_options;
+    const std::vector<double> *m_distance2similarity;  // The vote weight of each distance, for the current run.
+    std::vector<double> m_custom_distance2similarity;  // Its storage, when the options sharpen the default curve.
+
+    ProgressCallback m_progress_callback;
+    LevelSink m_level_sink;
+    bool m_level_sink_full_size;
+    const std::atomic<bool> *m_cancel_flag;
+    bool m_cancelled;
+    bool m_has_deadline;  // Set by set_deadline.
+    Clock::time_point m_deadline;
+    // The schedule of the current run under a deadline.
+    bool m_run_has_deadline;
+    Clock::time_point m_run_deadline;
+    bool m_hurry;  // Only the last EM iteration of every remaining level runs.
+    double m_seconds_per_pixel;  // Of the last EM iteration, per voted pixel; negative before the first.
+    double m_work_done;  // The pixels voted so far.
+
+    bool m_keep_fields;
+    InpaintingFields m_fields;
+    InpaintingFields m_warm_start;
+    cv::Mat m_warm_motion;
+
+    bool m_stats_enabled;
+    InpaintingStats m_stats;
+    InpaintingStats::Level *m_level_stats;  // Of the current level, if stats are collected.
 };
 
@@ -0,0 +1,67 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapped_file.h"
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::open(const std::string &path, size_t size, bool writable) {
+    close();
+    int fd = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info;
+    bool ok = fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= size && _map(fd, size, writable);
+    ::close(fd);
+    return ok;
+}
+
+bool MappedFile::create(const std::string &path, size_t size) {
+    close();
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    bool ok = ftruncate(fd, static_cast<off_t>(size)) == 0 && _map(fd, size, true);
+    ::close(fd);
+    return ok;
+}
+
+bool MappedFile::_map(int fd, size_t size, bool writable) {
+    if (size == 0) return false;
+    void *data = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) return false;
+
+    m_data = static_cast<unsigned char *>(data);
+    m_size = size;
+    m_writable = writable;
+    return true;
+}
+
+void MappedFile::close() {
+    if (m_data == nullptr) return;
+    if (m_writable) msync(m_data, m_size, MS_SYNC);
+    munmap(m_data, m_size);
+    m_data = nullptr;
+    m_size = 0;
+    m_writable = false;
+}
+
+void MappedFile::release(size_t offset, size_t length) {
+    if (m_data == nullptr || offset >= m_size) return;
+
+    // madvise works on whole pages; the neighbors of the range are dropped too, which only costs a reload.
+    const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t begin = offset / page_size * page_size;
+    const size_t end = std::min(m_size, offset + length);
+    // The dirty pages of a shared mapping stay in the page cache and are written back, nothing is lost.
+    madvise(m_data + begin, end - begin, MADV_DONTNEED);
+}
+
+bool MappedFile::sync() {
+    return m_data == nullptr || msync(m_data, m_size, MS_SYNC) == 0;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/**
+ * A file mapped into memory (POSIX mmap). The pages are loaded on first access and, being backed by the file, can be
+ * dropped at any time; release() hints that a range will not be needed soon, so that the process only keeps the
+ * pages of the region it is working on resident. Writes to a created mapping go to the file.
+ */
+class MappedFile {
+public:
+    MappedFile() : m_data(nullptr), m_size(0), m_writable(false) {
+        // pass
+    }
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator =(const MappedFile &) = delete;
+
+    // Maps the first size bytes of an existing file. Returns false if it cannot be opened or is too short.
+    bool open(const std::string &path, size_t size, bool writable = false);
+    // Creates (or truncates) the file, resizes it to size bytes and maps it for writing.
+    bool create(const std::string &path, size_t size);
+    void close();
+
+    inline bool is_open() const {
+        return m_data != nullptr;
+    }
+    inline unsigned char *data() const {
+        return m_data;
+    }
+    inline size_t size() const {
+        return m_size;
+    }
+
+    // Drops the resident pages of [offset, offset + length); they are reloaded from the file on the next access.
+    void release(size_t offset, size_t length);
+    // Writes the modified pages back to the file.
+    bool sync();
+
+private:
+    bool _map(int fd, size_t size, bool writable);
+
+    unsigned char *m_data;
+    size_t m_size;
+    bool m_writable;
+};
+
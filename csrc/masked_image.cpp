@@ -1,11 +1,78 @@
 #include "masked_image.h"
+#include "cpu_dispatch.h"
+#include "pyramid.h"
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <vector>
 
 const cv::Size MaskedImage::kDownsampleKernelSize = cv::Size(6, 6);
 const int MaskedImage::kDownsampleKernel[6] = {1, 5, 10, 10, 5, 1};
 
+PackedFeatures::PackedFeatures(int width, int height, int border)
+    : m_width(width), m_height(height), m_border(border), m_buffer(), m_origin(nullptr) {
+    m_stride = static_cast<std::ptrdiff_t>(width + 2 * border) * kPixelBytes;
+    m_stride = (m_stride + kAlignment - 1) / kAlignment * kAlignment;
+    // Not value-initialized: the image rows are first touched by pack_row, possibly from several threads.
+    m_buffer.reset(new unsigned char[m_stride * (height + 2 * border) + kAlignment]);
+
+    auto base = reinterpret_cast<std::uintptr_t>(m_buffer.get());
+    auto aligned = (base + kAlignment - 1) / kAlignment * kAlignment;
+    unsigned char *first_row = m_buffer.get() + (aligned - base);
+    m_origin = first_row + border * m_stride + border * kPixelBytes;
+
+    // The padding rows entirely, and on the image rows the left border and the right border up to the stride.
+    const std::ptrdiff_t row_padding = m_stride - static_cast<std::ptrdiff_t>(width + border) * kPixelBytes;
+    for (int y = -border; y < height + border; ++y) {
+        unsigned char *row = mutable_ptr(y, -border);
+        if (y < 0 || y >= height) {
+            std::memset(row, 0, m_stride);
+            for (int x = -border; x < width + border; ++x) mutable_ptr(y, x)[kFlagsOffset] = kOutside;
+        } else {
+            std::memset(row, 0, border * kPixelBytes);
+            std::memset(mutable_ptr(y, width), 0, row_padding);
+            for (int x = -border; x < 0; ++x) mutable_ptr(y, x)[kFlagsOffset] = kOutside;
+            for (int x = width; x < width + border; ++x) mutable_ptr(y, x)[kFlagsOffset] = kOutside;
+        }
+    }
+}
+
+PackedFeatures::PackedFeatures(const PackedFeatures &other) : PackedFeatures(other.m_width, other.m_height, other.m_border) {
+    for (int y = 0; y < m_height; ++y) std::memcpy(mutable_ptr(y, 0), other.ptr(y, 0), static_cast<size_t>(m_width) * kPixelBytes);
+}
+
+void PackedFeatures::pack_row(int y, const unsigned char *image, const unsigned char *gradx, const unsigned char *grady,
+                              const unsigned char *mask, const unsigned char *global_mask) {
+    const bool is_edge_row = y == 0 || y == m_height - 1;
+    unsigned char *packed_ptr = mutable_ptr(y, 0);
+    for (int j = 0; j < m_width; ++j, packed_ptr += kPixelBytes) {
+        for (int c = 0; c < 3; ++c) {
+            packed_ptr[c] = image[j * 3 + c];
+            packed_ptr[3 + c] = gradx[j * 3 + c];
+            packed_ptr[6 + c] = grady[j * 3 + c];
+        }
+        for (int c = 9; c < kFlagsOffset; ++c) packed_ptr[c] = 0;
+        unsigned char flags = 0;
+        if (mask[j]) flags |= kMasked;
+        if (global_mask && global_mask[j]) flags |= kGloballyMasked;
+        if (is_edge_row || j == 0 || j == m_width - 1) flags |= kImageEdge;
+        packed_ptr[kFlagsOffset] = flags;
+    }
+}
+
 bool MaskedImage::contains_mask(int y, int x, int patch_size) const {
+    if (has_packed_features(patch_size)) {
+        // The padding is flagged as outside only, so no bounds checks are needed.
+        for (int dy = -patch_size; dy <= patch_size; ++dy) {
+            const unsigned char *ptr = m_packed->ptr(y + dy, x - patch_size) + PackedFeatures::kFlagsOffset;
+            for (int dx = 0; dx <= 2 * patch_size; ++dx, ptr += PackedFeatures::kPixelBytes) {
+                if ((*ptr & (PackedFeatures::kMasked | PackedFeatures::kGloballyMasked)) == PackedFeatures::kMasked) return true;
+            }
+        }
+        return false;
+    }
+
     auto mask_size = size();
     for (int dy = -patch_size; dy <= patch_size; ++dy) {
         for (int dx = -patch_size; dx <= patch_size; ++dx) {
@@ -19,120 +86,103 @@ bool MaskedImage::contains_mask(int y, int x, int patch_size) const {
 }
 
 MaskedImage MaskedImage::downsample() const {
-    const auto &kernel_size = MaskedImage::kDownsampleKernelSize;
-    const auto &kernel = MaskedImage::kDownsampleKernel;
-
-    const auto size = this->size();
-    const auto new_size = cv::Size(size.width / 2, size.height / 2);
-
-    auto ret = MaskedImage(new_size.width, new_size.height);
-    if (!m_global_mask.empty()) ret.init_global_mask_mat();
-    for (int y = 0; y < size.height - 1; y += 2) {
-        for (int x = 0; x < size.width - 1; x += 2) {
-            int r = 0, g = 0, b = 0, ksum = 0;
-            bool is_gmasked = true;
-
-            for (int dy = -kernel_size.height / 2 + 1; dy <= kernel_size.height / 2; ++dy) {
-                for (int dx = -kernel_size.width / 2 + 1; dx <= kernel_size.width / 2; ++dx) {
-                    int yy = y + dy, xx = x + dx;
-                    if (yy >= 0 && yy < size.height && xx >= 0 && xx < size.width) {
-                        if (!is_globally_masked(yy, xx)) {
-                            is_gmasked = false;
-                        }
-                        if (!is_masked(yy, xx)) {
-                            auto source_ptr = get_image(yy, xx);
-                            int k = kernel[kernel_size.height / 2 - 1 + dy] * kernel[kernel_size.width / 2 - 1 + dx];
-                            r += source_ptr[0] * k, g += source_ptr[1] * k, b += source_ptr[2] * k;
-                            ksum += k;
-                        }
-                    }
-                }
-            }
-
-            if (ksum > 0) r /= ksum, g /= ksum, b /= ksum;
-
-            if (!m_global_mask.empty()) {
-                ret.set_global_mask(y / 2, x / 2, is_gmasked);
-            }
-            if (ksum > 0) {
-                auto target_ptr = ret.get_mutable_image(y / 2, x / 2);
-                target_ptr[0] = r, target_ptr[1] = g, target_ptr[2] = b;
-                ret.set_mask(y / 2, x / 2, 0);
-            } else {
-                ret.set_mask(y / 2, x / 2, 1);
-            }
-        }
-    }
-
-    return ret;
+    // The builder computes the gradients along, and the packed features iff this image has them.
+    return PyramidBuilder(nullptr, m_packed ? m_packed->border() : 0).downsample(*this);
 }
 
 MaskedImage MaskedImage::upsample(int new_w, int new_h) const {
     const auto size = this->size();
     auto ret = MaskedImage(new_w, new_h);
     if (!m_global_mask.empty()) ret.init_global_mask_mat();
+
+    // Nearest neighbour: the source column of every target column is the same on all rows.
+    std::vector<int> source_x(new_w);
+    for (int x = 0; x < new_w; ++x) source_x[x] = x * size.width / new_w;
+
     for (int y = 0; y < new_h; ++y) {
-        for (int x = 0; x < new_w; ++x) {
-            int yy = y * size.height / new_h;
-            int xx = x * size.width / new_w;
+        const int yy = y * size.height / new_h;
+        const auto *image_ptr = m_image.ptr<unsigned char>(yy);
+        const auto *mask_ptr = m_mask.ptr<unsigned char>(yy);
+        const auto *global_mask_ptr = m_global_mask.empty() ? nullptr : m_global_mask.ptr<unsigned char>(yy);
+        auto *target_image = ret.m_image.ptr<unsigned char>(y);
+        auto *target_mask = ret.m_mask.ptr<unsigned char>(y);
+        auto *target_global_mask = global_mask_ptr ? ret.m_global_mask.ptr<unsigned char>(y) : nullptr;
 
-            if (is_globally_masked(yy, xx)) {
-                ret.set_global_mask(y, x, 1);
-                ret.set_mask(y, x, 1);
+        for (int x = 0; x < new_w; ++x) {
+            const int xx = source_x[x];
+            if (global_mask_ptr && global_mask_ptr[xx]) {
+                target_global_mask[x] = 1;
+                target_mask[x] = 1;
+            } else if (mask_ptr[xx]) {
+                target_mask[x] = 1;
             } else {
-                if (!m_global_mask.empty()) ret.set_global_mask(y, x, 0);
-
-                if (is_masked(yy, xx)) {
-                    ret.set_mask(y, x, 1);
-                } else {
-                    auto source_ptr = get_image(yy, xx);
-                    auto target_ptr = ret.get_mutable_image(y, x);
-                    for (int c = 0; c < 3; ++c)
-                        target_ptr[c] = source_ptr[c];
-                    ret.set_mask(y, x, 0);
-                }
+                for (int c = 0; c < 3; ++c) target_image[x * 3 + c] = image_ptr[xx * 3 + c];
+                target_mask[x] = 0;
             }
         }
     }
 
+    if (m_packed) ret.compute_packed_features(m_packed->border());
     return ret;
 }
 
 MaskedImage MaskedImage::upsample(int new_w, int new_h, const cv::Mat &new_global_mask) const {
     auto ret = upsample(new_w, new_h);
     ret.set_global_mask_mat(new_global_mask);
+    if (m_packed) ret.compute_packed_features(m_packed->border());
     return ret;
 }
 
-void MaskedImage::compute_image_gradients() {
-    if (m_image_grad_computed) {
+void ImageGradients::compute(const cv::Mat &image) {
+    if (is_computed()) {
         return;
     }
 
-    const auto size = m_image.size();
-    m_image_grady = cv::Mat(size, CV_8UC3);
-    m_image_gradx = cv::Mat(size, CV_8UC3);
-    m_image_grady = cv::Scalar::all(0);
-    m_image_gradx = cv::Scalar::all(0);
-
-    for (int i = 1; i < size.height - 1; ++i) {
-        const auto *ptr = m_image.ptr<unsigned char>(i, 0);
-        const auto *ptry1 = m_image.ptr<unsigned char>(i + 1, 0);
-        const auto *ptry2 = m_image.ptr<unsigned char>(i - 1, 0);
-        const auto *ptrx1 = m_image.ptr<unsigned char>(i, 0) + 3;
-        const auto *ptrx2 = m_image.ptr<unsigned char>(i, 0) - 3;
-        auto *mptry = m_image_grady.ptr<unsigned char>(i, 0);
-        auto *mptrx = m_image_gradx.ptr<unsigned char>(i, 0);
-        for (int j = 3; j < size.width * 3 - 3; ++j) {
-            mptry[j] = (ptry1[j] / 2 - ptry2[j] / 2) + 128;
-            mptrx[j] = (ptrx1[j] / 2 - ptrx2[j] / 2) + 128;
+    std::call_once(m_once, [this, &image]() {
+        const auto size = image.size();
+        m_grady = cv::Mat(size, CV_8UC3);
+        m_gradx = cv::Mat(size, CV_8UC3);
+        m_grady = cv::Scalar::all(0);
+        m_gradx = cv::Scalar::all(0);
+
+        for (int i = 1; i < size.height - 1; ++i) {
+            compute_row(image.ptr<unsigned char>(i - 1), image.ptr<unsigned char>(i), image.ptr<unsigned char>(i + 1), size.width,
+                        m_grady.ptr<unsigned char>(i), m_gradx.ptr<unsigned char>(i));
         }
+
+        m_computed.store(true, std::memory_order_release);
+    });
+}
+
+void ImageGradients::compute_row(const unsigned char *previous, const unsigned char *row, const unsigned char *next, int width,
+                                 unsigned char *grady, unsigned char *gradx) {
+    const GradientRowKernel gradient_row = active_kernels().gradient_row;
+    const int n = width * 3 - 6;
+    for (int j = 0; j < 3 && j < width * 3; ++j) grady[j] = gradx[j] = 0;
+    for (int j = std::max(3, width * 3 - 3); j < width * 3; ++j) grady[j] = gradx[j] = 0;
+    if (n <= 0) return;
+    gradient_row(next + 3, previous + 3, grady + 3, n);
+    gradient_row(row + 6, row, gradx + 3, n);
+}
+
+void MaskedImage::compute_packed_features(int border) {
+    if (has_packed_features(border)) {
+        return;
+    }
+    compute_image_gradients();
+
+    const auto size = m_image.size();
+    auto packed = std::make_shared<PackedFeatures>(size.width, size.height, border);
+    for (int i = 0; i < size.height; ++i) {
+        packed->pack_row(i, m_image.ptr<unsigned char>(i), m_gradients->gradx().ptr<unsigned char>(i), m_gradients->grady().ptr<unsigned char>(i),
+                         m_mask.ptr<unsigned char>(i), m_global_mask.empty() ? nullptr : m_global_mask.ptr<unsigned char>(i));
     }
 
-    m_image_grad_computed = true;
+    m_packed = packed;
 }
 
-void MaskedImage::compute_image_gradients() const {
-    const_cast<MaskedImage *>(this)->compute_image_gradients();
+PackedFeatures *MaskedImage::mutable_packed_features() {
+    if (m_packed && m_packed.use_count() > 1) m_packed = std::make_shared<PackedFeatures>(*m_packed);
+    return m_packed.get();
 }
 
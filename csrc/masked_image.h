@@ -1,35 +1,130 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
 #include <opencv2/core.hpp>
 
+/**
+ * An interleaved, border-padded copy of the features used by the patch distance.
+ * Every pixel takes kPixelBytes bytes: image (3), gradx (3), grady (3), zero padding and a flags byte. The image is
+ * surrounded by `border` pixels flagged as outside, so that whole patch rows can be read without bounds checks; a
+ * pixel takes part in the patch distance iff its flags are zero.
+ */
+class PackedFeatures {
+public:
+    enum Flags {
+        kMasked = 1,
+        kGloballyMasked = 2,
+        kImageEdge = 4,  // The first/last row and column, where the gradients are not defined.
+        kOutside = 8,
+    };
+    static const int kPixelBytes = 16;
+    static const int kFlagsOffset = 15;
+    static const int kAlignment = 64;
+
+    // Only the padding is initialized: every row of the image must then be written with pack_row.
+    PackedFeatures(int width, int height, int border);
+    // A deep copy.
+    PackedFeatures(const PackedFeatures &other);
+
+    inline cv::Size size() const {
+        return cv::Size(m_width, m_height);
+    }
+    inline int border() const {
+        return m_border;
+    }
+    inline std::ptrdiff_t stride() const {
+        return m_stride;
+    }
+    inline const unsigned char *ptr(int y, int x) const {
+        return m_origin + static_cast<std::ptrdiff_t>(y) * m_stride + static_cast<std::ptrdiff_t>(x) * kPixelBytes;
+    }
+    inline unsigned char *mutable_ptr(int y, int x) {
+        return m_origin + static_cast<std::ptrdiff_t>(y) * m_stride + static_cast<std::ptrdiff_t>(x) * kPixelBytes;
+    }
+    inline unsigned char flags(int y, int x) const {
+        return ptr(y, x)[kFlagsOffset];
+    }
+    // Packs row y from its CV_8UC3 image and gradient rows and its CV_8U mask rows (global_mask may be nullptr).
+    void pack_row(int y, const unsigned char *image, const unsigned char *gradx, const unsigned char *grady,
+                  const unsigned char *mask, const unsigned char *global_mask);
+    // Whether the patch of the given radius around (y, x) lies within the padded buffer.
+    inline bool contains_patch(int y, int x, int patch_size) const {
+        return y - patch_size >= -m_border && y + patch_size < m_height + m_border &&
+               x - patch_size >= -m_border && x + patch_size < m_width + m_border;
+    }
+
+private:
+    int m_width, m_height, m_border;
+    std::ptrdiff_t m_stride;
+    std::unique_ptr<unsigned char[]> m_buffer;
+    unsigned char *m_origin;  // Pixel (0, 0).
+};
+
+/**
+ * The gradients of an image, computed on first use. The copies of a MaskedImage share them, and the first call to
+ * compute() does the work while concurrent callers wait, so const images can be read from several threads.
+ */
+class ImageGradients {
+public:
+    ImageGradients() : m_once(), m_computed(false), m_grady(), m_gradx() {
+        // pass
+    }
+    ImageGradients(cv::Mat grady, cv::Mat gradx) : m_once(), m_computed(true), m_grady(grady), m_gradx(gradx) {
+        // pass
+    }
+
+    void compute(const cv::Mat &image);
+    // The gradients of an interior row (neither the first nor the last) of a CV_8UC3 image of the given width, from
+    // the rows above and below it. The first and last columns are zero, as is every border row.
+    static void compute_row(const unsigned char *previous, const unsigned char *row, const unsigned char *next, int width,
+                            unsigned char *grady, unsigned char *gradx);
+    inline bool is_computed() const {
+        return m_computed.load(std::memory_order_acquire);
+    }
+    inline const cv::Mat &grady() const {
+        return m_grady;
+    }
+    inline const cv::Mat &gradx() const {
+        return m_gradx;
+    }
+
+private:
+    std::once_flag m_once;
+    std::atomic<bool> m_computed;
+    cv::Mat m_grady;
+    cv::Mat m_gradx;
+};
+
 class MaskedImage {
 public:
-    MaskedImage() : m_image(), m_mask(), m_global_mask(), m_image_grady(), m_image_gradx(), m_image_grad_computed(false) {
+    MaskedImage() : m_image(), m_mask(), m_global_mask(), m_gradients(std::make_shared<ImageGradients>()), m_packed() {
         // pass
     }
-    MaskedImage(cv::Mat image, cv::Mat mask) : m_image(image), m_mask(mask), m_image_grad_computed(false) {
+    MaskedImage(cv::Mat image, cv::Mat mask) : m_image(image), m_mask(mask), m_global_mask(), m_gradients(std::make_shared<ImageGradients>()), m_packed() {
         // pass
     }
-    MaskedImage(cv::Mat image, cv::Mat mask, cv::Mat global_mask) : m_image(image), m_mask(mask), m_global_mask(global_mask), m_image_grad_computed(false) {
+    MaskedImage(cv::Mat image, cv::Mat mask, cv::Mat global_mask) : m_image(image), m_mask(mask), m_global_mask(global_mask), m_gradients(std::make_shared<ImageGradients>()), m_packed() {
         // pass
     }
-    MaskedImage(cv::Mat image, cv::Mat mask, cv::Mat global_mask, cv::Mat grady, cv::Mat gradx, bool grad_computed) :
-        m_image(image), m_mask(mask), m_global_mask(global_mask),
-        m_image_grady(grady), m_image_gradx(gradx), m_image_grad_computed(grad_computed) {
+    MaskedImage(cv::Mat image, cv::Mat mask, cv::Mat global_mask, std::shared_ptr<ImageGradients> gradients) :
+        m_image(image), m_mask(mask), m_global_mask(global_mask), m_gradients(gradients), m_packed() {
         // pass
     }
-    MaskedImage(int width, int height) : m_global_mask(), m_image_grady(), m_image_gradx() {
+    MaskedImage(int width, int height) : m_global_mask(), m_gradients(std::make_shared<ImageGradients>()), m_packed() {
         m_image = cv::Mat(cv::Size(width, height), CV_8UC3);
         m_image = cv::Scalar::all(0);
 
         m_mask = cv::Mat(cv::Size(width, height), CV_8U);
         m_mask = cv::Scalar::all(0);
     }
-    inline MaskedImage clone() {
-        return MaskedImage(
-            m_image.clone(), m_mask.clone(), m_global_mask.clone(),
-            m_image_grady.clone(), m_image_gradx.clone(), m_image_grad_computed
-        );
+    inline MaskedImage clone() const {
+        auto gradients = m_gradients->is_computed() ?
+            std::make_shared<ImageGradients>(m_gradients->grady().clone(), m_gradients->gradx().clone()) :
+            std::make_shared<ImageGradients>();
+        return MaskedImage(m_image.clone(), m_mask.clone(), m_global_mask.clone(), gradients);
     }
 
     inline cv::Size size() const {
@@ -44,20 +139,42 @@ public:
     inline const cv::Mat &global_mask() const {
         return m_global_mask;
     }
+    inline bool has_image_gradients() const {
+        return m_gradients->is_computed();
+    }
     inline const cv::Mat &grady() const {
-        assert(m_image_grad_computed);
-        return m_image_grady;
+        assert(m_gradients->is_computed());
+        return m_gradients->grady();
     }
     inline const cv::Mat &gradx() const {
-        assert(m_image_grad_computed);
-        return m_image_gradx;
+        assert(m_gradients->is_computed());
+        return m_gradients->gradx();
     }
 
+    // The packed features are a cache of the image, gradients and masks; they are dropped by every mutator (and the
+    // gradients by every write access to the image).
+    inline const PackedFeatures *packed_features() const {
+        return m_packed.get();
+    }
+    inline bool has_packed_features(int border) const {
+        return m_packed && m_packed->border() >= border;
+    }
+    void compute_packed_features(int border);
+    // Attaches packed features computed elsewhere (see PyramidBuilder); they must match the image, gradients and masks.
+    inline void set_packed_features(std::shared_ptr<PackedFeatures> packed) {
+        m_packed = packed;
+    }
+    // The packed features, to rewrite some of their rows after the image or masks changed there (see
+    // PyramidBuilder::update); copied first if other images share them. nullptr if there are none.
+    PackedFeatures *mutable_packed_features();
+
     inline void init_global_mask_mat() {
+        m_packed.reset();
         m_global_mask = cv::Mat(m_mask.size(), CV_8U);
         m_global_mask.setTo(cv::Scalar(0));
     }
     inline void set_global_mask_mat(const cv::Mat &other) {
+        m_packed.reset();
         m_global_mask = other;
     }
 
@@ -68,12 +185,15 @@ public:
         return !m_global_mask.empty() && static_cast<bool>(m_global_mask.at<unsigned char>(y, x));
     }
     inline void set_mask(int y, int x, bool value) {
+        if (m_packed) m_packed.reset();
         m_mask.at<unsigned char>(y, x) = static_cast<unsigned char>(value);
     }
     inline void set_global_mask(int y, int x, bool value) {
+        if (m_packed) m_packed.reset();
         m_global_mask.at<unsigned char>(y, x) = static_cast<unsigned char>(value);
     }
     inline void clear_mask() {
+        m_packed.reset();
         m_mask.setTo(cv::Scalar(0));
     }
 
@@ -81,6 +201,9 @@ public:
         return m_image.ptr<unsigned char>(y, x);
     }
     inline unsigned char *get_mutable_image(int y, int x) {
+        if (m_packed) m_packed.reset();
+        // The copies sharing the gradients keep them; this image starts a new cache.
+        if (m_gradients->is_computed()) m_gradients = std::make_shared<ImageGradients>();
         return m_image.ptr<unsigned char>(y, x);
     }
 
@@ -95,8 +218,10 @@ public:
     MaskedImage downsample() const;
     MaskedImage upsample(int new_w, int new_h) const;
     MaskedImage upsample(int new_w, int new_h, const cv::Mat &new_global_mask) const;
-    void compute_image_gradients();
-    void compute_image_gradients() const;
+    // Thread-safe: the gradients are computed once and shared by the copies of this image.
+    inline void compute_image_gradients() const {
+        m_gradients->compute(m_image);
+    }
 
     static const cv::Size kDownsampleKernelSize;
     static const int kDownsampleKernel[6];
@@ -105,8 +230,7 @@ private:
 	cv::Mat m_image;
 	cv::Mat m_mask;
     cv::Mat m_global_mask;
-    cv::Mat m_image_grady;
-    cv::Mat m_image_gradx;
-    bool m_image_grad_computed = false;
+    std::shared_ptr<ImageGradients> m_gradients;
+    std::shared_ptr<PackedFeatures> m_packed;
 };
 
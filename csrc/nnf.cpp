@@ -1,9 +1,13 @@
 #include <algorithm>
 #include <iostream>
 #include <cmath>
+#include <mutex>
+#include <typeinfo>
 
+#include "cpu_dispatch.h"
 #include "masked_image.h"
 #include "nnf.h"
+#include "thread_pool.h"
 
 /**
 * Nearest-Neighbor Field (see PatchMatch algorithm).
@@ -16,117 +20,111 @@ T clamp(T value, T min_value, T max_value) {
     return std::min(std::max(value, min_value), max_value);
 }
 
-void NearestNeighborField::_randomize_field(int max_retry, bool reset) {
+template <typename Func>
+void NearestNeighborField::_for_each_pixel(Func func) const {
+    if (m_active) {
+        for (const auto &span : m_active->spans())
+            for (int j = span.x_begin; j < span.x_end; ++j) func(span.y, j);
+        return;
+    }
+
     auto this_size = source_size();
-    for (int i = 0; i < this_size.height; ++i) {
-        for (int j = 0; j < this_size.width; ++j) {
-            if (m_source.is_globally_masked(i, j)) continue;
+    for (int i = 0; i < this_size.height; ++i)
+        for (int j = 0; j < this_size.width; ++j) func(i, j);
+}
 
-            auto this_ptr = mutable_ptr(i, j);
-            int distance = reset ? PatchDistanceMetric::kDistanceScale : this_ptr[2];
-            if (distance < PatchDistanceMetric::kDistanceScale) {
-                continue;
-            }
+void NearestNeighborField::_set_inactive_identity() {
+    if (!m_active) return;
 
-            int i_target = 0, j_target = 0;
-            for (int t = 0; t < max_retry; ++t) {
-                i_target = rand() % this_size.height;
-                j_target = rand() % this_size.width;
-                if (m_target.is_globally_masked(i_target, j_target)) continue;
+    auto this_size = source_size();
+    for (int i = 0; i < this_size.height; ++i) {
+        int j = 0;
+        for (int k = m_active->row_begin(i); k < m_active->row_end(i); ++k) {
+            const auto &span = m_active->spans()[k];
+            for (; j < span.x_begin; ++j) set_identity(i, j);
+            j = span.x_end;
+        }
+        for (; j < this_size.width; ++j) set_identity(i, j);
+    }
+}
 
-                distance = _distance(i, j, i_target, j_target);
-                if (distance < PatchDistanceMetric::kDistanceScale)
-                    break;
-            }
+void NearestNeighborField::_randomize_field(int max_retry, bool reset) {
+    auto this_size = source_size();
+    // Stream 0 of the seed initializes; stream k > 0 is the k-th call to minimize.
+    const uint64_t initialization_key = random_key(m_seed, 0);
+    _for_each_pixel([this, this_size, max_retry, reset, initialization_key](int i, int j) {
+        if (m_source.is_globally_masked(i, j)) return;
+
+        auto this_ptr = mutable_ptr(i, j);
+        int distance = reset ? PatchDistanceMetric::kDistanceScale : this_ptr[2];
+        if (distance < PatchDistanceMetric::kDistanceScale) {
+            return;
+        }
+
+        int i_target = 0, j_target = 0;
+        CounterRandom random(random_key(initialization_key, static_cast<uint64_t>(i) * this_size.width + j));
+        for (int t = 0; t < max_retry; ++t) {
+            i_target = random() % this_size.height;
+            j_target = random() % this_size.width;
+            if (m_target.is_globally_masked(i_target, j_target)) continue;
 
-            this_ptr[0] = i_target, this_ptr[1] = j_target, this_ptr[2] = distance;
+            distance = _distance(i, j, i_target, j_target);
+            if (distance < PatchDistanceMetric::kDistanceScale)
+                break;
         }
-    }
+
+        this_ptr[0] = i_target, this_ptr[1] = j_target, this_ptr[2] = distance;
+    });
 }
 
-void NearestNeighborField::_initialize_field_from(const NearestNeighborField &other, int max_retry) {
+void NearestNeighborField::_initialize_field_from(const cv::Mat &other, int max_retry, const cv::Mat &motion, const cv::Mat &fallback) {
     const auto &this_size = source_size();
-    const auto &other_size = other.source_size();
+    const auto &other_size = other.size();
     double fi = static_cast<double>(this_size.height) / other_size.height;
     double fj = static_cast<double>(this_size.width) / other_size.width;
+    const auto &fallback_size = fallback.size();
+    const double fallback_fi = fallback.empty() ? 0 : static_cast<double>(this_size.height) / fallback_size.height;
+    const double fallback_fj = fallback.empty() ? 0 : static_cast<double>(this_size.width) / fallback_size.width;
+    const auto target_size = this->target_size();
 
-    for (int i = 0; i < this_size.height; ++i) {
-        for (int j = 0; j < this_size.width; ++j) {
-            if (m_source.is_globally_masked(i, j)) continue;
+    _for_each_pixel([this, &other, &motion, &fallback, other_size, fallback_size, target_size, fi, fj, fallback_fi, fallback_fj](int i, int j) {
+        if (m_source.is_globally_masked(i, j)) return;
 
+        auto this_value = mutable_ptr(i, j);
+        if (motion.empty()) {
             int ilow = static_cast<int>(std::min(i / fi, static_cast<double>(other_size.height - 1)));
             int jlow = static_cast<int>(std::min(j / fj, static_cast<double>(other_size.width - 1)));
-            auto this_value = mutable_ptr(i, j);
-            auto other_value = other.ptr(ilow, jlow);
+            auto other_value = other.ptr<int>(ilow, jlow);
 
-            this_value[0] = static_cast<int>(other_value[0] * fi);
+            this_value[0] = other_value[0] < 0 ? kInvalidMatch : static_cast<int>(other_value[0] * fi);
             this_value[1] = static_cast<int>(other_value[1] * fj);
-            this_value[2] = _distance(i, j, this_value[0], this_value[1]);
+        } else {
+            const float *offset = motion.ptr<float>(i, j);
+            int ilow = clamp(static_cast<int>(std::floor((i + offset[1]) / fi + 0.5)), 0, other_size.height - 1);
+            int jlow = clamp(static_cast<int>(std::floor((j + offset[0]) / fj + 0.5)), 0, other_size.width - 1);
+            auto other_value = other.ptr<int>(ilow, jlow);
+
+            this_value[0] = other_value[0] < 0 ? kInvalidMatch : clamp(static_cast<int>(std::floor(other_value[0] * fi - offset[1] + 0.5)), 0, target_size.height - 1);
+            this_value[1] = clamp(static_cast<int>(std::floor(other_value[1] * fj - offset[0] + 0.5)), 0, target_size.width - 1);
         }
-    }
-
-    _randomize_field(max_retry, false);
-}
 
-void NearestNeighborField::minimize(int nr_pass) {
-    const auto &this_size = source_size();
-    while (nr_pass--) {
-        for (int i = 0; i < this_size.height; ++i)
-            for (int j = 0; j < this_size.width; ++j) {
-                if (m_source.is_globally_masked(i, j)) continue;
-                if (at(i, j, 2) > 0) _minimize_link(i, j, +1);
-            }
-        for (int i = this_size.height - 1; i >= 0; --i)
-            for (int j = this_size.width - 1; j >= 0; --j) {
-                if (m_source.is_globally_masked(i, j)) continue;
-                if (at(i, j, 2) > 0) _minimize_link(i, j, -1);
+        if (this_value[0] == kInvalidMatch) {
+            if (fallback.empty()) {
+                // Left to the random draws below.
+                this_value[0] = std::min(i, target_size.height - 1), this_value[1] = std::min(j, target_size.width - 1);
+                this_value[2] = PatchDistanceMetric::kDistanceScale;
+                return;
             }
-    }
-}
-
-void NearestNeighborField::_minimize_link(int y, int x, int direction) {
-    const auto &this_size = source_size();
-    const auto &this_target_size = target_size();
-    auto this_ptr = mutable_ptr(y, x);
-
-    // propagation along the y direction.
-    if (y - direction >= 0 && y - direction < this_size.height && !m_source.is_globally_masked(y - direction, x)) {
-        int yp = at(y - direction, x, 0) + direction;
-        int xp = at(y - direction, x, 1);
-        int dp = _distance(y, x, yp, xp);
-        if (dp < at(y, x, 2)) {
-            this_ptr[0] = yp, this_ptr[1] = xp, this_ptr[2] = dp;
-        }
-    }
-
-    // propagation along the x direction.
-    if (x - direction >= 0 && x - direction < this_size.width && !m_source.is_globally_masked(y, x - direction)) {
-        int yp = at(y, x - direction, 0);
-        int xp = at(y, x - direction, 1) + direction;
-        int dp = _distance(y, x, yp, xp);
-        if (dp < at(y, x, 2)) {
-            this_ptr[0] = yp, this_ptr[1] = xp, this_ptr[2] = dp;
-        }
-    }
-
-    // random search with a progressive step size.
-    int random_scale = (std::min(this_target_size.height, this_target_size.width) - 1) / 2;
-    while (random_scale > 0) {
-        int yp = this_ptr[0] + (rand() % (2 * random_scale + 1) - random_scale);
-        int xp = this_ptr[1] + (rand() % (2 * random_scale + 1) - random_scale);
-        yp = clamp(yp, 0, target_size().height - 1);
-        xp = clamp(xp, 0, target_size().width - 1);
-
-        if (m_target.is_globally_masked(yp, xp)) {
-            random_scale /= 2;
+            int ilow = static_cast<int>(std::min(i / fallback_fi, static_cast<double>(fallback_size.height - 1)));
+            int jlow = static_cast<int>(std::min(j / fallback_fj, static_cast<double>(fallback_size.width - 1)));
+            auto fallback_value = fallback.ptr<int>(ilow, jlow);
+            this_value[0] = static_cast<int>(fallback_value[0] * fallback_fi);
+            this_value[1] = static_cast<int>(fallback_value[1] * fallback_fj);
         }
+        this_value[2] = _distance(i, j, this_value[0], this_value[1]);
+    });
 
-        int dp = _distance(y, x, yp, xp);
-        if (dp < at(y, x, 2)) {
-            this_ptr[0] = yp, this_ptr[1] = xp, this_ptr[2] = dp;
-        }
-        random_scale /= 2;
-    }
+    _randomize_field(max_retry, false);
 }
 
 const int PatchDistanceMetric::kDistanceScale = 65535;
@@ -134,86 +132,120 @@ const int PatchSSDDistanceMetric::kSSDScale = 9 * 255 * 255;
 
 namespace {
 
-inline int pow2(int i) {
-    return i * i;
+// Converts the exact sum of a patch into the scaled distance.
+inline int scale_patch_distance(int64_t distance, int patch_width) {
+    long double wsum = static_cast<long double>(patch_width) * patch_width;
+    long double scaled_distance = static_cast<long double>(distance) / (long double)(PatchSSDDistanceMetric::kSSDScale);
+
+    int res = int(PatchDistanceMetric::kDistanceScale * scaled_distance / wsum);
+    if (res < 0 || res > PatchDistanceMetric::kDistanceScale) return PatchDistanceMetric::kDistanceScale;
+    return res;
+}
+
+// The smallest exact sum whose scaled distance reaches bound (scale_patch_distance is non-decreasing), so that the
+// accumulation loops can stop with a single integer comparison per row.
+inline int64_t patch_distance_threshold(int bound, int patch_width) {
+    if (bound > PatchDistanceMetric::kDistanceScale) return INT64_MAX;
+    if (bound <= 0) return 0;
+
+    const long double wsum = static_cast<long double>(patch_width) * patch_width;
+    int64_t threshold = static_cast<int64_t>(
+        static_cast<long double>(bound) * PatchSSDDistanceMetric::kSSDScale * wsum / PatchDistanceMetric::kDistanceScale
+    );
+    while (threshold > 0 && scale_patch_distance(threshold - 1, patch_width) >= bound) --threshold;
+    while (scale_patch_distance(threshold, patch_width) < bound) ++threshold;
+    return threshold;
+}
+
+// Branch-free path over the packed layout. Returns false (and leaves distance untouched) if the patches leave the
+// padded buffers, or if the two images do not have the same width (where the packed edge flags would differ from
+// the reference semantics below).
+inline bool packed_distance_masked_images(
+    const MaskedImage &source, int ys, int xs,
+    const MaskedImage &target, int yt, int xt,
+    int patch_size, int64_t threshold, int64_t &distance
+) {
+    const PackedFeatures *source_packed = source.packed_features();
+    const PackedFeatures *target_packed = target.packed_features();
+    if (source_packed == nullptr || target_packed == nullptr) return false;
+    if (source_packed->size().width != target_packed->size().width) return false;
+    if (!source_packed->contains_patch(ys, xs, patch_size) || !target_packed->contains_patch(yt, xt, patch_size)) return false;
+
+    const PackedDistanceRowKernel packed_distance_row = active_kernels().packed_distance_row;
+    const int patch_width = 2 * patch_size + 1;
+    distance = 0;
+    for (int dy = -patch_size; dy <= patch_size; ++dy) {
+        distance += packed_distance_row(source_packed->ptr(ys + dy, xs - patch_size), target_packed->ptr(yt + dy, xt - patch_size), patch_width);
+        if (distance >= threshold) break;
+    }
+    return true;
 }
 
+// Returns the exact scaled distance if it is smaller than bound; otherwise, the rows are accumulated only until the
+// partial sum reaches bound and some value >= bound is returned.
 int distance_masked_images(
     const MaskedImage &source, int ys, int xs,
     const MaskedImage &target, int yt, int xt,
-    int patch_size
+    int patch_size, int bound = PatchDistanceMetric::kDistanceScale + 1
 ) {
-    long double distance = 0;
-    long double wsum = 0;
+    // All the terms are integers: accumulate them exactly and only scale at the end.
+    int64_t distance = 0;
+    const int patch_width = 2 * patch_size + 1;
+    const int64_t threshold = patch_distance_threshold(bound, patch_width);
+
+    if (packed_distance_masked_images(source, ys, xs, target, yt, xt, patch_size, threshold, distance)) {
+        return scale_patch_distance(distance, patch_width);
+    }
 
     source.compute_image_gradients();
     target.compute_image_gradients();
 
     auto source_size = source.size();
     auto target_size = target.size();
+    const bool has_global_mask = !source.global_mask().empty();
+    const DistanceRowKernel distance_row = active_kernels().distance_row;
 
-    for (int dy = -patch_size; dy <= patch_size; ++dy) {
+    // Pixels on (or beyond) the image border count as fully dissimilar. The range of valid dx only depends on the
+    // patch centers, so the row kernels can run over a contiguous, border-free segment.
+    const int max_x = std::min(source_size.width, target_size.width) - 2;
+    const int dx_begin = std::max(-patch_size, std::max(1 - xs, 1 - xt));
+    const int dx_end = std::min(patch_size, std::min(max_x - xs, max_x - xt)) + 1;
+    const int nr_inside = std::max(0, dx_end - dx_begin);
+
+    for (int dy = -patch_size; dy <= patch_size && distance < threshold; ++dy) {
         const int yys = ys + dy, yyt = yt + dy;
 
         if (yys <= 0 || yys >= source_size.height - 1 || yyt <= 0 || yyt >= target_size.height - 1) {
-            distance += (long double)(PatchSSDDistanceMetric::kSSDScale) * (2 * patch_size + 1);
-            wsum += 2 * patch_size + 1;
+            distance += static_cast<int64_t>(PatchSSDDistanceMetric::kSSDScale) * patch_width;
             continue;
         }
 
-        const auto *p_si = source.image().ptr<unsigned char>(yys, 0);
-        const auto *p_ti = target.image().ptr<unsigned char>(yyt, 0);
-        const auto *p_sm = source.mask().ptr<unsigned char>(yys, 0);
-        const auto *p_tm = target.mask().ptr<unsigned char>(yyt, 0);
-
-        const unsigned char *p_sgm = nullptr;
-        const unsigned char *p_tgm = nullptr;
-        if (!source.global_mask().empty()) {
-            p_sgm = source.global_mask().ptr<unsigned char>(yys, 0);
-            p_tgm = target.global_mask().ptr<unsigned char>(yyt, 0);
-        }
-
-        const auto *p_sgy = source.grady().ptr<unsigned char>(yys, 0);
-        const auto *p_tgy = target.grady().ptr<unsigned char>(yyt, 0);
-        const auto *p_sgx = source.gradx().ptr<unsigned char>(yys, 0);
-        const auto *p_tgx = target.gradx().ptr<unsigned char>(yyt, 0);
-
-        for (int dx = -patch_size; dx <= patch_size; ++dx) {
-            int xxs = xs + dx, xxt = xt + dx;
-            wsum += 1;
-
-            if (xxs <= 0 || xxs >= source_size.width - 1 || xxt <= 0 || xxt >= source_size.width - 1) {
-                distance += PatchSSDDistanceMetric::kSSDScale;
-                continue;
-            }
-
-            if (p_sm[xxs] || p_tm[xxt] || (p_sgm && p_sgm[xxs]) || (p_tgm && p_tgm[xxt]) ) {
-                distance += PatchSSDDistanceMetric::kSSDScale;
-                continue;
-            }
-
-            int ssd = 0;
-            for (int c = 0; c < 3; ++c) {
-                int s_value = p_si[xxs * 3 + c];
-                int t_value = p_ti[xxt * 3 + c];
-                int s_gy = p_sgy[xxs * 3 + c];
-                int t_gy = p_tgy[xxt * 3 + c];
-                int s_gx = p_sgx[xxs * 3 + c];
-                int t_gx = p_tgx[xxt * 3 + c];
-
-                ssd += pow2(static_cast<int>(s_value) - t_value);
-                ssd += pow2(static_cast<int>(s_gx) - t_gx);
-                ssd += pow2(static_cast<int>(s_gy) - t_gy);
-            }
-            distance += ssd;
-        }
+        distance += static_cast<int64_t>(PatchSSDDistanceMetric::kSSDScale) * (patch_width - nr_inside);
+        if (nr_inside == 0) continue;
+
+        const int xxs = xs + dx_begin, xxt = xt + dx_begin;
+        DistanceRowPointers source_row = {
+            source.image().ptr<unsigned char>(yys, xxs), source.gradx().ptr<unsigned char>(yys, xxs),
+            source.grady().ptr<unsigned char>(yys, xxs), source.mask().ptr<unsigned char>(yys, xxs),
+            has_global_mask ? source.global_mask().ptr<unsigned char>(yys, xxs) : nullptr
+        };
+        DistanceRowPointers target_row = {
+            target.image().ptr<unsigned char>(yyt, xxt), target.gradx().ptr<unsigned char>(yyt, xxt),
+            target.grady().ptr<unsigned char>(yyt, xxt), target.mask().ptr<unsigned char>(yyt, xxt),
+            has_global_mask ? target.global_mask().ptr<unsigned char>(yyt, xxt) : nullptr
+        };
+        distance += distance_row(source_row, target_row, nr_inside);
     }
 
-    distance /= (long double)(PatchSSDDistanceMetric::kSSDScale);
+    return scale_patch_distance(distance, patch_width);
+}
 
-    int res = int(PatchDistanceMetric::kDistanceScale * distance / wsum);
-    if (res < 0 || res > PatchDistanceMetric::kDistanceScale) return PatchDistanceMetric::kDistanceScale;
-    return res;
+// The bound on the patch distance score2 implied by a bound on the combined score; the extra unit absorbs the
+// rounding of the final conversion, so that score2 >= the returned value guarantees a combined score >= bound.
+inline int regularity_distance_bound(double bound) {
+    if (bound > PatchDistanceMetric::kDistanceScale) return PatchDistanceMetric::kDistanceScale + 1;
+    if (bound < 0) return 0;
+    return static_cast<int>(std::ceil(bound)) + 1;
 }
 
 }
@@ -222,28 +254,41 @@ int PatchSSDDistanceMetric::operator ()(const MaskedImage &source, int source_y,
     return distance_masked_images(source, source_y, source_x, target, target_y, target_x, m_patch_size);
 }
 
+int PatchSSDDistanceMetric::bounded(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x, int bound) const {
+    return distance_masked_images(source, source_y, source_x, target, target_y, target_x, m_patch_size, bound);
+}
+
 int DebugPatchSSDDistanceMetric::operator ()(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x) const {
     fprintf(stderr, "DebugPatchSSDDistanceMetric: %d %d %d %d\n", source.size().width, source.size().height, m_width, m_height);
     return distance_masked_images(source, source_y, source_x, target, target_y, target_x, m_patch_size);
 }
 
-int RegularityGuidedPatchDistanceMetricV1::operator ()(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x) const {
+double RegularityGuidedPatchDistanceMetricV1::_regularity_score(const MaskedImage &source, int source_y, int source_x, int target_y, int target_x) const {
     double dx = remainder(double(source_x - target_x) / source.size().width, m_dx1);
     double dy = remainder(double(source_y - target_y) / source.size().height, m_dy2);
 
     double score1 = sqrt(dx * dx + dy *dy) / m_scale;
     if (score1 < 0 || score1 > 1) score1 = 1;
-    score1 *= PatchDistanceMetric::kDistanceScale;
+    return score1 * PatchDistanceMetric::kDistanceScale;
+}
 
+int RegularityGuidedPatchDistanceMetricV1::operator ()(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x) const {
+    double score1 = _regularity_score(source, source_y, source_x, target_y, target_x);
     double score2 = distance_masked_images(source, source_y, source_x, target, target_y, target_x, m_patch_size);
     double score = score1 * m_weight + score2 / (1 + m_weight);
     return static_cast<int>(score / (1 + m_weight));
 }
 
-int RegularityGuidedPatchDistanceMetricV2::operator ()(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x) const {
-    if (target_y < 0 || target_y >= target.size().height || target_x < 0 || target_x >= target.size().width)
-        return PatchDistanceMetric::kDistanceScale;
+int RegularityGuidedPatchDistanceMetricV1::bounded(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x, int bound) const {
+    double score1 = _regularity_score(source, source_y, source_x, target_y, target_x);
+    // score >= bound as soon as score2 >= (bound * (1 + w) - score1 * w) * (1 + w).
+    int bound2 = regularity_distance_bound((bound * (1 + m_weight) - score1 * m_weight) * (1 + m_weight));
+    double score2 = distance_masked_images(source, source_y, source_x, target, target_y, target_x, m_patch_size, bound2);
+    double score = score1 * m_weight + score2 / (1 + m_weight);
+    return static_cast<int>(score / (1 + m_weight));
+}
 
+double RegularityGuidedPatchDistanceMetricV2::_regularity_score(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x) const {
     int source_scale = m_ijmap.size().height / source.size().height;
     int target_scale = m_ijmap.size().height / target.size().height;
 
@@ -260,9 +305,390 @@ int RegularityGuidedPatchDistanceMetricV2::operator ()(const MaskedImage &source
         if (score1 < 0 || score1 > 1) score1 = 1;
         score1 *= PatchDistanceMetric::kDistanceScale;
     }
+    return score1;
+}
 
+int RegularityGuidedPatchDistanceMetricV2::operator ()(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x) const {
+    if (target_y < 0 || target_y >= target.size().height || target_x < 0 || target_x >= target.size().width)
+        return PatchDistanceMetric::kDistanceScale;
+
+    double score1 = _regularity_score(source, source_y, source_x, target, target_y, target_x);
     double score2 = distance_masked_images(source, source_y, source_x, target, target_y, target_x, m_patch_size);
     double score = score1 * m_weight + score2;
     return int(score / (1 + m_weight));
 }
 
+int RegularityGuidedPatchDistanceMetricV2::bounded(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x, int bound) const {
+    if (target_y < 0 || target_y >= target.size().height || target_x < 0 || target_x >= target.size().width)
+        return PatchDistanceMetric::kDistanceScale;
+
+    double score1 = _regularity_score(source, source_y, source_x, target, target_y, target_x);
+    // score >= bound as soon as score2 >= bound * (1 + w) - score1 * w.
+    int bound2 = regularity_distance_bound(bound * (1 + m_weight) - score1 * m_weight);
+    double score2 = distance_masked_images(source, source_y, source_x, target, target_y, target_x, m_patch_size, bound2);
+    double score = score1 * m_weight + score2;
+    return int(score / (1 + m_weight));
+}
+
+namespace {
+
+// Goes through the virtual metric interface; used by every metric and patch size without a specialized engine.
+struct MetricDistance {
+    MetricDistance(const PatchDistanceMetric *metric, const MaskedImage &source, const MaskedImage &target)
+        : metric(metric), source(source), target(target) {}
+    inline int operator ()(int ys, int xs, int yt, int xt, int bound) {
+        return metric->bounded(source, ys, xs, target, yt, xt, bound);
+    }
+    inline int shifted(int ys, int xs, int yt, int xt, int bound) {
+        return metric->bounded(source, ys, xs, target, yt, xt, bound);
+    }
+
+    const PatchDistanceMetric *metric;
+    const MaskedImage &source;
+    const MaskedImage &target;
+};
+
+// PatchSSDDistanceMetric with a compile-time patch size. The packed buffers and the row kernel are resolved once per
+// minimize, the early termination threshold is only recomputed when the bound changes, and the row loop has a fixed
+// trip count. Patches leaving the packed buffers fall back to distance_masked_images, so the values are identical.
+//
+// The propagation candidate along x is the pair of the horizontal neighbor shifted by one column. shifted() keeps
+// the column sums of the last such window in a line buffer: when the candidate continues the buffered window, only
+// the entering column is evaluated. Any other candidate rebuilds the buffer column by column. The functor is copied
+// per tile, so every tile has its own line buffer.
+template <int PatchSize>
+struct SSDDistance {
+    static const int kPatchWidth = 2 * PatchSize + 1;
+
+    SSDDistance(const PatchDistanceMetric * /* metric */, const MaskedImage &source, const MaskedImage &target)
+        : source(source), target(target), source_packed(source.packed_features()), target_packed(target.packed_features()),
+          packed_distance_row(active_kernels().packed_distance_row), packed_distance_column(active_kernels().packed_distance_column),
+          last_bound(-1), last_threshold(0), window_valid(false), window_y(0), window_x(0), window_dy(0), window_dx(0),
+          window_head(0), window_sum(0) {
+        if (source_packed == nullptr || target_packed == nullptr || source_packed->size().width != target_packed->size().width) {
+            source_packed = target_packed = nullptr;
+        }
+    }
+
+    inline bool packed(int ys, int xs, int yt, int xt) const {
+        return source_packed != nullptr && source_packed->contains_patch(ys, xs, PatchSize) && target_packed->contains_patch(yt, xt, PatchSize);
+    }
+
+    inline int operator ()(int ys, int xs, int yt, int xt, int bound) {
+        if (!packed(ys, xs, yt, xt)) {
+            return distance_masked_images(source, ys, xs, target, yt, xt, PatchSize, bound);
+        }
+        if (bound != last_bound) {
+            last_threshold = patch_distance_threshold(bound, kPatchWidth);
+            last_bound = bound;
+        }
+
+        const unsigned char *source_row = source_packed->ptr(ys - PatchSize, xs - PatchSize);
+        const unsigned char *target_row = target_packed->ptr(yt - PatchSize, xt - PatchSize);
+        int64_t distance = 0;
+        for (int dy = 0; dy < kPatchWidth; ++dy) {
+            distance += packed_distance_row(source_row, target_row, kPatchWidth);
+            if (distance >= last_threshold) break;
+            source_row += source_packed->stride(), target_row += target_packed->stride();
+        }
+        return scale_patch_distance(distance, kPatchWidth);
+    }
+
+    // Always exact, which also satisfies the contract of the bounded evaluation.
+    inline int shifted(int ys, int xs, int yt, int xt, int /* bound */) {
+        if (!packed(ys, xs, yt, xt)) {
+            window_valid = false;
+            return distance_masked_images(source, ys, xs, target, yt, xt, PatchSize);
+        }
+
+        const int step = xs - window_x;
+        if (window_valid && ys == window_y && (step == 1 || step == -1) && yt - ys == window_dy && xt - xs == window_dx) {
+            // The leaving column is replaced by the entering one in the ring buffer.
+            const int slot = step > 0 ? window_head : (window_head + kPatchWidth - 1) % kPatchWidth;
+            const int entering = step * PatchSize;
+            window_sum -= columns[slot];
+            columns[slot] = _column(ys, xs + entering, yt, xt + entering);
+            window_sum += columns[slot];
+            window_head = step > 0 ? (window_head + 1) % kPatchWidth : slot;
+        } else {
+            window_sum = 0;
+            for (int dx = -PatchSize; dx <= PatchSize; ++dx) {
+                columns[dx + PatchSize] = _column(ys, xs + dx, yt, xt + dx);
+                window_sum += columns[dx + PatchSize];
+            }
+            window_head = 0;
+            window_valid = true;
+            window_y = ys, window_dy = yt - ys, window_dx = xt - xs;
+        }
+        window_x = xs;
+        return scale_patch_distance(window_sum, kPatchWidth);
+    }
+
+    inline int64_t _column(int ys, int xs, int yt, int xt) const {
+        return packed_distance_column(
+            source_packed->ptr(ys - PatchSize, xs), source_packed->stride(),
+            target_packed->ptr(yt - PatchSize, xt), target_packed->stride(), kPatchWidth
+        );
+    }
+
+    const MaskedImage &source;
+    const MaskedImage &target;
+    const PackedFeatures *source_packed;
+    const PackedFeatures *target_packed;
+    PackedDistanceRowKernel packed_distance_row;
+    PackedDistanceColumnKernel packed_distance_column;
+    int last_bound;
+    int64_t last_threshold;
+
+    // The line buffer: column sums of the window centered at (window_y, window_x), matched with the same window
+    // moved by (window_dy, window_dx). columns[window_head] is the leftmost column.
+    bool window_valid;
+    int window_y, window_x, window_dy, window_dx;
+    int window_head;
+    int64_t window_sum;
+    int64_t columns[kPatchWidth];
+};
+
+// The counting hooks of the minimization. NoProbe compiles to nothing, so that the minimization without stats is the
+// same code as if there were no hooks.
+struct NoProbe {
+    static const bool kCounting = false;
+    inline void propagation(bool /* accepted */) {}
+    inline void random_search(bool /* accepted */) {}
+    inline void add(const NoProbe & /* other */) {}
+    inline void add_to(NNFStats * /* stats */) const {}
+};
+
+struct CountingProbe {
+    static const bool kCounting = true;
+    inline void propagation(bool accepted) {
+        ++propagation_tries;
+        propagation_accepts += accepted;
+    }
+    inline void random_search(bool accepted) {
+        ++random_search_tries;
+        random_search_accepts += accepted;
+    }
+    inline void add(const CountingProbe &other) {
+        propagation_tries += other.propagation_tries, propagation_accepts += other.propagation_accepts;
+        random_search_tries += other.random_search_tries, random_search_accepts += other.random_search_accepts;
+    }
+    inline void add_to(NNFStats *stats) const {
+        stats->distance_evaluations += propagation_tries + random_search_tries;
+        stats->propagation_tries += propagation_tries, stats->propagation_accepts += propagation_accepts;
+        stats->random_search_tries += random_search_tries, stats->random_search_accepts += random_search_accepts;
+    }
+
+    int64_t propagation_tries = 0, propagation_accepts = 0;
+    int64_t random_search_tries = 0, random_search_accepts = 0;
+};
+
+}
+
+const int NearestNeighborField::kTileSize = 64;
+const int NearestNeighborField::kInvalidMatch = -1;
+
+int NearestNeighborField::minimize(int nr_pass, ThreadPool *pool, double tolerance) {
+    return select_minimize(m_distance_metric)(*this, nr_pass, pool, tolerance);
+}
+
+NearestNeighborField::MinimizeFunc NearestNeighborField::select_minimize(const PatchDistanceMetric *metric) {
+    if (metric != nullptr && typeid(*metric) == typeid(PatchSSDDistanceMetric)) {
+        switch (metric->patch_size()) {
+            case 3: return &NearestNeighborField::_minimize_with<SSDDistance<3>>;
+            case 5: return &NearestNeighborField::_minimize_with<SSDDistance<5>>;
+            case 7: return &NearestNeighborField::_minimize_with<SSDDistance<7>>;
+            case 9: return &NearestNeighborField::_minimize_with<SSDDistance<9>>;
+            case 15: return &NearestNeighborField::_minimize_with<SSDDistance<15>>;
+            default: break;
+        }
+    }
+    return &NearestNeighborField::_minimize_with<MetricDistance>;
+}
+
+template <typename Distance>
+int NearestNeighborField::_minimize_with(NearestNeighborField &nnf, int nr_pass, ThreadPool *pool, double tolerance) {
+    if (nnf.m_stats != nullptr) return nnf._minimize<Distance, CountingProbe>(nr_pass, pool, tolerance);
+    return nnf._minimize<Distance, NoProbe>(nr_pass, pool, tolerance);
+}
+
+int64_t NearestNeighborField::total_distance() const {
+    int64_t total = 0;
+    _for_each_pixel([this, &total](int i, int j) {
+        if (!m_source.is_globally_masked(i, j)) total += at(i, j, 2);
+    });
+    return total;
+}
+
+template <typename Distance, typename Probe>
+int NearestNeighborField::_minimize(int nr_pass, ThreadPool *pool, double tolerance) {
+    const auto &this_size = source_size();
+    // Only the rectangle around the active pixels needs to be scanned.
+    const cv::Rect area = m_active ? m_active->bounding_box() : cv::Rect(0, 0, this_size.width, this_size.height);
+    if (area.empty()) return 0;
+
+    // The pass p in direction d draws from the sub-stream 2 p + (d < 0) of this call.
+    const uint64_t call_key = random_key(m_seed, ++m_nr_minimizations);
+    auto pass_key = [call_key](int pass, int direction) { return random_key(call_key, 2 * pass + (direction < 0)); };
+
+    int64_t nr_pixels = 0;
+    if (Probe::kCounting) {
+        _for_each_pixel([this, &nr_pixels](int i, int j) { nr_pixels += !m_source.is_globally_masked(i, j); });
+    }
+
+    // Whether the pass that was just run lowered the total distance by less than the tolerance (relative). The field
+    // after each pass does not depend on the pool, so neither does the number of passes.
+    int64_t last_total = tolerance > 0 ? total_distance() : 0;
+    auto converged = [this, tolerance, nr_pixels, &last_total]() {
+        if (tolerance <= 0 && !Probe::kCounting) return false;
+        const int64_t total = total_distance();
+        if (Probe::kCounting) m_stats->mean_distance.push_back(nr_pixels > 0 ? static_cast<double>(total) / nr_pixels : 0);
+        const bool result = tolerance > 0 && static_cast<double>(last_total - total) <= tolerance * static_cast<double>(last_total);
+        last_total = total;
+        return result;
+    };
+
+    Probe probe;
+    int nr_passes_run = nr_pass;
+    if (pool == nullptr || pool->nr_threads() <= 1) {
+        Distance distance(m_distance_metric, m_source, m_target);
+        for (int pass = 0; pass < nr_pass; ++pass) {
+            _minimize_rect(area, +1, distance, pass_key(pass, +1), probe);
+            _minimize_rect(area, -1, distance, pass_key(pass, -1), probe);
+            if (converged()) {
+                nr_passes_run = pass + 1;
+                break;
+            }
+        }
+        probe.add_to(m_stats);
+        return nr_passes_run;
+    }
+
+    // The gradients are lazily computed inside the distance function; do it once here before the workers start.
+    m_source.compute_image_gradients();
+    m_target.compute_image_gradients();
+
+    // Use smaller tiles on small areas so that every diagonal still has some parallelism.
+    const int tile_size = clamp(std::min(area.height, area.width) / (2 * pool->nr_threads()), 16, kTileSize);
+    const int nr_tiles_y = (area.height + tile_size - 1) / tile_size;
+    const int nr_tiles_x = (area.width + tile_size - 1) / tile_size;
+    const int nr_diagonals = nr_tiles_y + nr_tiles_x - 1;
+    const Distance distance(m_distance_metric, m_source, m_target);
+    std::mutex probe_mutex;
+
+    for (int pass = 0; pass < nr_pass; ++pass) {
+        for (int direction = +1; direction >= -1; direction -= 2) {
+            const uint64_t key = pass_key(pass, direction);
+            for (int k = 0; k < nr_diagonals; ++k) {
+                const int diagonal = direction > 0 ? k : nr_diagonals - 1 - k;
+                const int tile_y_begin = std::max(0, diagonal - nr_tiles_x + 1);
+                const int tile_y_end = std::min(nr_tiles_y, diagonal + 1);
+                pool->parallel_for(tile_y_begin, tile_y_end, [&](int tile_y) {
+                    const int tile_x = diagonal - tile_y;
+                    const cv::Rect tile = cv::Rect(area.x + tile_x * tile_size, area.y + tile_y * tile_size, tile_size, tile_size) & area;
+                    Distance tile_distance = distance;
+                    Probe tile_probe;
+                    _minimize_rect(tile, direction, tile_distance, key, tile_probe);
+                    if (Probe::kCounting) {
+                        std::lock_guard<std::mutex> lock(probe_mutex);
+                        probe.add(tile_probe);
+                    }
+                });
+            }
+        }
+        if (converged()) {
+            nr_passes_run = pass + 1;
+            break;
+        }
+    }
+    probe.add_to(m_stats);
+    return nr_passes_run;
+}
+
+// Scans the pixels of rect (the active ones only, if there is an active set) in the given direction. Every pixel
+// draws from its own sub-stream of pass_key.
+template <typename Distance, typename Probe>
+void NearestNeighborField::_minimize_rect(const cv::Rect &rect, int direction, Distance &distance, uint64_t pass_key, Probe &probe) {
+    const int y_begin = rect.y, y_end = rect.y + rect.height;
+    const int x_begin = rect.x, x_end = rect.x + rect.width;
+    const uint64_t width = source_size().width;
+
+    auto minimize_pixel = [&](int i, int j) {
+        if (m_source.is_globally_masked(i, j) || at(i, j, 2) <= 0) return;
+        CounterRandom random(random_key(pass_key, i * width + j));
+        _minimize_link(i, j, direction, distance, random, probe);
+    };
+    auto scan_row = [&](int i, int j_begin, int j_end) {
+        if (direction > 0) {
+            for (int j = j_begin; j < j_end; ++j) minimize_pixel(i, j);
+        } else {
+            for (int j = j_end - 1; j >= j_begin; --j) minimize_pixel(i, j);
+        }
+    };
+
+    for (int k = 0; k < y_end - y_begin; ++k) {
+        const int i = direction > 0 ? y_begin + k : y_end - 1 - k;
+        if (!m_active) {
+            scan_row(i, x_begin, x_end);
+            continue;
+        }
+
+        const int span_begin = m_active->row_begin(i), span_end = m_active->row_end(i);
+        for (int l = 0; l < span_end - span_begin; ++l) {
+            const auto &span = m_active->spans()[direction > 0 ? span_begin + l : span_end - 1 - l];
+            const int j_begin = std::max(span.x_begin, x_begin), j_end = std::min(span.x_end, x_end);
+            if (j_begin < j_end) scan_row(i, j_begin, j_end);
+        }
+    }
+}
+
+template <typename Distance, typename Probe>
+void NearestNeighborField::_minimize_link(int y, int x, int direction, Distance &distance, CounterRandom &random, Probe &probe) {
+    const auto &this_size = source_size();
+    const auto &this_target_size = target_size();
+    auto this_ptr = mutable_ptr(y, x);
+
+    // propagation along the y direction.
+    if (y - direction >= 0 && y - direction < this_size.height && !m_source.is_globally_masked(y - direction, x)) {
+        int yp = at(y - direction, x, 0) + direction;
+        int xp = at(y - direction, x, 1);
+        int dp = distance(y, x, yp, xp, at(y, x, 2));
+        probe.propagation(dp < at(y, x, 2));
+        if (dp < at(y, x, 2)) {
+            this_ptr[0] = yp, this_ptr[1] = xp, this_ptr[2] = dp;
+        }
+    }
+
+    // propagation along the x direction.
+    if (x - direction >= 0 && x - direction < this_size.width && !m_source.is_globally_masked(y, x - direction)) {
+        int yp = at(y, x - direction, 0);
+        int xp = at(y, x - direction, 1) + direction;
+        int dp = distance.shifted(y, x, yp, xp, at(y, x, 2));
+        probe.propagation(dp < at(y, x, 2));
+        if (dp < at(y, x, 2)) {
+            this_ptr[0] = yp, this_ptr[1] = xp, this_ptr[2] = dp;
+        }
+    }
+
+    // random search with a progressive step size.
+    int random_scale = (std::min(this_target_size.height, this_target_size.width) - 1) / 2;
+    if (m_search_radius > 0) random_scale = std::min(random_scale, m_search_radius);
+    while (random_scale > 0) {
+        int yp = this_ptr[0] + (random() % (2 * random_scale + 1) - random_scale);
+        int xp = this_ptr[1] + (random() % (2 * random_scale + 1) - random_scale);
+        yp = clamp(yp, 0, target_size().height - 1);
+        xp = clamp(xp, 0, target_size().width - 1);
+
+        if (m_target.is_globally_masked(yp, xp)) {
+            random_scale /= 2;
+        }
+
+        int dp = distance(y, x, yp, xp, at(y, x, 2));
+        probe.random_search(dp < at(y, x, 2));
+        if (dp < at(y, x, 2)) {
+            this_ptr[0] = yp, this_ptr[1] = xp, this_ptr[2] = dp;
+        }
+        random_scale /= 2;
+    }
+}
+
@@ -1,7 +1,14 @@
 #pragma once
 
+#include <cstdint>
+#include <memory>
+#include <vector>
 #include <opencv2/core.hpp>
+#include "active_set.h"
 #include "masked_image.h"
+#include "random.h"
+
+class ThreadPool;
 
 class PatchDistanceMetric {
 public:
@@ -10,26 +17,68 @@ public:
 
     inline int patch_size() const { return m_patch_size; }
     virtual int operator()(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x) const = 0;
+    // Same as operator(), but the evaluation may stop as soon as the distance is known to reach bound: returns the
+    // exact distance if it is smaller than bound, and otherwise any value >= bound.
+    virtual int bounded(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x, int /* bound */) const {
+        return (*this)(source, source_y, source_x, target, target_y, target_x);
+    }
     static const int kDistanceScale;
 
 protected:
     int m_patch_size;
 };
 
+// What the minimizations of a field did (see NearestNeighborField::set_stats). A try is one distance evaluation; it
+// is accepted when it improves the match of the pixel.
+struct NNFStats {
+    int64_t distance_evaluations = 0;
+    int64_t propagation_tries = 0;
+    int64_t propagation_accepts = 0;
+    int64_t random_search_tries = 0;
+    int64_t random_search_accepts = 0;
+    // The mean distance of the minimized pixels after every pass (a forward and a backward scan), in order.
+    std::vector<double> mean_distance;
+};
+
 class NearestNeighborField {
 public:
-    NearestNeighborField() : m_source(), m_target(), m_field(), m_distance_metric(nullptr) {
+    NearestNeighborField() : m_source(), m_target(), m_field(), m_distance_metric(nullptr), m_active(), m_seed(0), m_nr_minimizations(0), m_stats(nullptr), m_search_radius(0) {
         // pass
     }
     NearestNeighborField(const MaskedImage &source, const MaskedImage &target, const PatchDistanceMetric *metric, int max_retry = 20)
-        : m_source(source), m_target(target), m_distance_metric(metric) {
+        : NearestNeighborField(source, target, metric, nullptr, _draw_seed(), max_retry) {
+        // pass
+    }
+    NearestNeighborField(const MaskedImage &source, const MaskedImage &target, const PatchDistanceMetric *metric, const NearestNeighborField &other, int max_retry = 20)
+        : NearestNeighborField(source, target, metric, nullptr, _draw_seed(), other, max_retry) {
+        // pass
+    }
+    // With an active set, the pixels outside of it are set to identity, and only the active pixels are initialized
+    // and minimized. All the random draws of the field are keyed on seed (see random.h), instead of coming from
+    // rand(), so that fields built by concurrent jobs do not depend on each other.
+    NearestNeighborField(const MaskedImage &source, const MaskedImage &target, const PatchDistanceMetric *metric, std::shared_ptr<const ActiveSet> active, uint64_t seed, int max_retry = 20)
+        : m_source(source), m_target(target), m_distance_metric(metric), m_active(std::move(active)), m_seed(seed), m_nr_minimizations(0), m_stats(nullptr), m_search_radius(0) {
         m_field = cv::Mat(m_source.size(), CV_32SC3);
+        _set_inactive_identity();
         _randomize_field(max_retry);
     }
-    NearestNeighborField(const MaskedImage &source, const MaskedImage &target, const PatchDistanceMetric *metric, const NearestNeighborField &other, int max_retry = 20)
-            : m_source(source), m_target(target), m_distance_metric(metric) {
+    NearestNeighborField(const MaskedImage &source, const MaskedImage &target, const PatchDistanceMetric *metric, std::shared_ptr<const ActiveSet> active, uint64_t seed, const NearestNeighborField &other, int max_retry = 20)
+            : m_source(source), m_target(target), m_distance_metric(metric), m_active(std::move(active)), m_seed(seed), m_nr_minimizations(0), m_stats(nullptr), m_search_radius(0) {
+        m_field = cv::Mat(m_source.size(), CV_32SC3);
+        _set_inactive_identity();
+        _initialize_field_from(other.m_field, max_retry);
+    }
+    // Starts from the field of another pair of images of the same size, e.g. the previous frame of a video. Every
+    // pixel takes the match of the pixel at its position, moved by motion if it is not empty: a CV_32FC2 map of the
+    // source size, holding for every pixel the offset (dx, dy) from it to the same content in the other images. The
+    // match itself is moved back by the offset of its source pixel (exact for a translation). The pixels whose entry
+    // is invalid (a negative y, see kInvalidMatch) start from coarser as in the upscaling constructor if it is not
+    // empty, and from random draws otherwise.
+    NearestNeighborField(const MaskedImage &source, const MaskedImage &target, const PatchDistanceMetric *metric, std::shared_ptr<const ActiveSet> active, uint64_t seed, const cv::Mat &field, const cv::Mat &motion, const cv::Mat &coarser, int max_retry = 20)
+            : m_source(source), m_target(target), m_distance_metric(metric), m_active(std::move(active)), m_seed(seed), m_nr_minimizations(0), m_stats(nullptr), m_search_radius(0) {
         m_field = cv::Mat(m_source.size(), CV_32SC3);
-        _initialize_field_from(other, max_retry);
+        _set_inactive_identity();
+        _initialize_field_from(field, max_retry, motion, coarser);
     }
 
     const MaskedImage &source() const {
@@ -50,6 +99,13 @@ public:
     inline void set_target(const MaskedImage &target) {
         m_target = target;
     }
+    inline const ActiveSet *active_set() const {
+        return m_active.get();
+    }
+    // The CV_32SC3 field: { y_target, x_target, distance_scaled } per source pixel.
+    inline const cv::Mat &field() const {
+        return m_field;
+    }
 
     inline int *mutable_ptr(int y, int x) {
         return m_field.ptr<int>(y, x);
@@ -69,21 +125,72 @@ public:
         ptr[0] = y, ptr[1] = x, ptr[2] = 0;
     }
 
-    void minimize(int nr_pass);
+    // Adds what the following minimizations do to *stats; nullptr (the default) stops counting. The minimization
+    // without stats is compiled separately, without any of the counting code.
+    inline void set_stats(NNFStats *stats) {
+        m_stats = stats;
+    }
+    // Caps the radius of the random search around the current matches, e.g. for a field that starts close to
+    // converged and only needs refining; 0 (the default) searches the whole target.
+    inline void set_search_radius(int radius) {
+        m_search_radius = radius;
+    }
+
+    // Runs nr_pass forward/backward propagation passes. With a multi-threaded pool, each scan pass is split into
+    // tiles that are processed in wavefront (anti-diagonal) order, so that every pixel still sees its already
+    // updated upper and left (resp. lower and right) neighbors, exactly as in a serial scan. The random draws of a
+    // pixel are keyed on (seed, minimize call, pass, pixel), so the result does not depend on the pool either.
+    // With a positive tolerance, the passes stop as soon as one of them lowers total_distance() by less than that
+    // fraction. Returns the number of passes run.
+    int minimize(int nr_pass, ThreadPool *pool = nullptr, double tolerance = 0);
+
+    typedef int (*MinimizeFunc)(NearestNeighborField &nnf, int nr_pass, ThreadPool *pool, double tolerance);
+    // The minimize engine for the given metric: PatchSSDDistanceMetric with a patch size of 3, 5, 7, 9 or 15 gets an
+    // engine compiled for that size; everything else goes through the virtual metric interface. Both give the same
+    // results. minimize() looks it up on every call; callers running many passes can select it once instead.
+    static MinimizeFunc select_minimize(const PatchDistanceMetric *metric);
+
+    // The sum of the distances of the pixels that are minimized (the active ones, or all of them), globally masked
+    // pixels excluded.
+    int64_t total_distance() const;
+
+    static const int kTileSize;
+    // The y of a field entry that holds no match.
+    static const int kInvalidMatch;
 
 private:
     inline int _distance(int source_y, int source_x, int target_y, int target_x) {
         return (*m_distance_metric)(m_source, source_y, source_x, m_target, target_y, target_x);
     }
 
+    static inline unsigned int _draw_seed() {
+        return static_cast<unsigned int>(rand());
+    }
+
+    // Calls func(y, x) for the pixels to initialize and minimize (the active ones, or all of them), in raster order.
+    template <typename Func>
+    void _for_each_pixel(Func func) const;
+    void _set_inactive_identity();
     void _randomize_field(int max_retry = 20, bool reset = true);
-    void _initialize_field_from(const NearestNeighborField &other, int max_retry);
-    void _minimize_link(int y, int x, int direction);
+    void _initialize_field_from(const cv::Mat &other, int max_retry, const cv::Mat &motion = cv::Mat(), const cv::Mat &fallback = cv::Mat());
+    template <typename Distance>
+    static int _minimize_with(NearestNeighborField &nnf, int nr_pass, ThreadPool *pool, double tolerance);
+    template <typename Distance, typename Probe>
+    int _minimize(int nr_pass, ThreadPool *pool, double tolerance);
+    template <typename Distance, typename Probe>
+    void _minimize_rect(const cv::Rect &rect, int direction, Distance &distance, uint64_t pass_key, Probe &probe);
+    template <typename Distance, typename Probe>
+    void _minimize_link(int y, int x, int direction, Distance &distance, CounterRandom &random, Probe &probe);
 
     MaskedImage m_source;
     MaskedImage m_target;
     cv::Mat m_field;  // { y_target, x_target, distance_scaled }
     const PatchDistanceMetric *m_distance_metric;
+    std::shared_ptr<const ActiveSet> m_active;
+    uint64_t m_seed;
+    int m_nr_minimizations;  // The calls to minimize so far.
+    NNFStats *m_stats;
+    int m_search_radius;  // 0 for the whole target.
 };
 
 
@@ -91,6 +198,7 @@ class PatchSSDDistanceMetric : public PatchDistanceMetric {
 public:
     using PatchDistanceMetric::PatchDistanceMetric;
     virtual int operator ()(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x) const;
+    virtual int bounded(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x, int bound) const;
     static const int kSSDScale;
 };
 
@@ -112,8 +220,11 @@ public:
         m_scale = sqrt(m_dx1 * m_dx1 + m_dy2 * m_dy2) / 4;
     }
     virtual int operator ()(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x) const;
+    virtual int bounded(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x, int bound) const;
 
 protected:
+    double _regularity_score(const MaskedImage &source, int source_y, int source_x, int target_y, int target_x) const;
+
     double m_dx1, m_dy1, m_dx2, m_dy2;
     double m_scale, m_weight;
 };
@@ -125,8 +236,11 @@ public:
 
     }
     virtual int operator ()(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x) const;
+    virtual int bounded(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x, int bound) const;
 
 protected:
+    double _regularity_score(const MaskedImage &source, int source_y, int source_x, const MaskedImage &target, int target_y, int target_x) const;
+
     cv::Mat m_ijmap;
     double m_width, m_height, m_weight;
 };
@@ -1,13 +1,69 @@
 #include "pyinterface.h"
+#include "batch.h"
+#include "components.h"
+#include "cpu_dispatch.h"
 #include "inpaint.h"
+#include "session.h"
+#include "tiled.h"
+#include "video.h"
 
-static unsigned int PM_seed = 1212;
-static bool PM_verbose = false;
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// The options of the global functions. Atomic, so that concurrent calls can read them while another thread sets them.
+static std::atomic<unsigned int> PM_seed(1212);
+static std::atomic<bool> PM_verbose(false);
 
 int _dtype_py_to_cv(int dtype_py);
 int _dtype_cv_to_py(int dtype_cv);
 cv::Mat _py_to_cv2(PM_mat_t pymat);
 PM_mat_t _cv2_to_py(cv::Mat cvmat);
+PM_mat_t _cv2_view_py(const cv::Mat &cvmat);
+bool _matches(PM_mat_t pymat, PM_mat_t other);
+int _cv2_into_py(cv::Mat cvmat, PM_mat_t pymat);
+InpaintingOptions _options_from_py(const PM_options_t *options_py);
+PM_options_t _options_to_py(const InpaintingOptions &options);
+int _inpaint_into(PM_mat_t source_py, PM_mat_t mask_py, PM_mat_t global_mask_py, int patch_size, bool split_components,
+                  const InpaintingOptions &options, ThreadPool *pool, bool verbose, unsigned int seed, PM_mat_t result_py,
+                  const Inpainting::ProgressCallback &progress = Inpainting::ProgressCallback(), const std::atomic<bool> *cancel_flag = nullptr,
+                  const Inpainting::LevelSink &sink = Inpainting::LevelSink(), bool sink_full_size = false, InpaintingStats *stats = nullptr);
+
+struct PM_context {
+    unsigned int seed = 1212;
+    bool verbose = false;
+    bool split_components = false;
+    InpaintingOptions options;
+    PM_progress_func_t progress_callback = nullptr;
+    void *progress_user_data = nullptr;
+    PM_level_sink_t level_sink = nullptr;
+    bool level_sink_full_size = false;
+    void *level_sink_user_data = nullptr;
+    std::atomic<bool> cancel_flag{false};
+    bool stats_enabled = false;
+    bool has_stats = false;  // Whether the last call collected stats.
+    InpaintingStats stats;
+    std::vector<PM_level_stats_t> level_stats;  // The levels returned by PM_get_last_stats.
+    std::unique_ptr<ThreadPool> pool;
+    std::unique_ptr<PatchSSDDistanceMetric> video_metric;
+    std::unique_ptr<VideoInpainting> video;  // The frames of PM_context_inpaint_frame, with video_metric.
+
+    inline ThreadPool *thread_pool() {
+        return pool ? pool.get() : &ThreadPool::global();
+    }
+    inline Inpainting::ProgressCallback progress() {
+        if (progress_callback == nullptr) return Inpainting::ProgressCallback();
+        PM_progress_func_t callback = progress_callback;
+        void *user_data = progress_user_data;
+        return [callback, user_data](int level, int iteration, double fraction) { callback(level, iteration, fraction, user_data); };
+    }
+    inline Inpainting::LevelSink sink() {
+        if (level_sink == nullptr) return Inpainting::LevelSink();
+        PM_level_sink_t callback = level_sink;
+        void *user_data = level_sink_user_data;
+        return [callback, user_data](int level, const cv::Mat &image) { callback(level, _cv2_view_py(image), user_data); };
+    }
+};
 
 void PM_set_random_seed(unsigned int seed) {
     PM_seed = seed;
@@ -17,6 +73,267 @@ void PM_set_verbose(int value) {
     PM_verbose = static_cast<bool>(value);
 }
 
+void PM_set_nr_threads(int nr_threads) {
+    ThreadPool::set_global_nr_threads(nr_threads);
+}
+
+int PM_get_nr_threads(void) {
+    return ThreadPool::global().nr_threads();
+}
+
+int PM_get_isa(void) {
+    return cpu_active_isa();
+}
+
+int PM_get_detected_isa(void) {
+    return cpu_detected_isa();
+}
+
+int PM_set_isa(int isa) {
+    return cpu_set_isa(isa);
+}
+
+const char *PM_get_isa_name(int isa) {
+    return cpu_isa_name(isa);
+}
+
+int PM_options_preset(const char *name, PM_options_t *options_py) {
+    InpaintingOptions options;
+    if (!InpaintingOptions::preset(name, options)) return -1;
+    *options_py = _options_to_py(options);
+    return 0;
+}
+
+PM_context_t *PM_context_create(void) {
+    return new PM_context();
+}
+
+void PM_context_destroy(PM_context_t *context) {
+    delete context;
+}
+
+void PM_context_set_random_seed(PM_context_t *context, unsigned int seed) {
+    context->seed = seed;
+}
+
+void PM_context_set_verbose(PM_context_t *context, int value) {
+    context->verbose = static_cast<bool>(value);
+}
+
+void PM_context_set_nr_threads(PM_context_t *context, int nr_threads) {
+    if (nr_threads <= 0) context->pool.reset();
+    else if (context->pool) context->pool->resize(nr_threads);
+    else context->pool.reset(new ThreadPool(nr_threads));
+}
+
+void PM_context_set_split_components(PM_context_t *context, int value) {
+    context->split_components = static_cast<bool>(value);
+}
+
+void PM_context_set_options(PM_context_t *context, const PM_options_t *options) {
+    context->options = _options_from_py(options);
+}
+
+void PM_context_set_progress_callback(PM_context_t *context, PM_progress_func_t callback, void *user_data) {
+    context->progress_callback = callback;
+    context->progress_user_data = user_data;
+}
+
+void PM_context_set_level_sink(PM_context_t *context, PM_level_sink_t sink, int full_size, void *user_data) {
+    context->level_sink = sink;
+    context->level_sink_full_size = static_cast<bool>(full_size);
+    context->level_sink_user_data = user_data;
+}
+
+void PM_context_set_stats_enabled(PM_context_t *context, int value) {
+    context->stats_enabled = static_cast<bool>(value);
+}
+
+int PM_get_last_stats(PM_context_t *context, PM_stats_t *stats_py) {
+    if (!context->has_stats) return -1;
+    const InpaintingStats &stats = context->stats;
+    context->level_stats.clear();
+    for (const auto &level : stats.levels) {
+        PM_level_stats_t level_py;
+        level_py.level = level.level;
+        level_py.width = level.size.width, level_py.height = level.size.height;
+        level_py.active_pixels = level.active_pixels;
+        level_py.em_iterations = level.em_iterations;
+        level_py.warm_started = level.warm_started;
+        level_py.init_seconds = level.init_seconds;
+        level_py.minimize_seconds = level.minimize_seconds;
+        level_py.expectation_seconds = level.expectation_seconds;
+        level_py.maximization_seconds = level.maximization_seconds;
+        level_py.seconds = level.seconds;
+        const NNFStats *fields[2] = {&level.source2target, &level.target2source};
+        for (int d = 0; d < 2; ++d) {
+            level_py.distance_evaluations[d] = fields[d]->distance_evaluations;
+            level_py.propagation_tries[d] = fields[d]->propagation_tries;
+            level_py.propagation_accepts[d] = fields[d]->propagation_accepts;
+            level_py.random_search_tries[d] = fields[d]->random_search_tries;
+            level_py.random_search_accepts[d] = fields[d]->random_search_accepts;
+            level_py.nr_passes[d] = static_cast<int>(fields[d]->mean_distance.size());
+            level_py.mean_distance[d] = fields[d]->mean_distance.data();
+        }
+        context->level_stats.push_back(level_py);
+    }
+    stats_py->pyramid_seconds = stats.pyramid_seconds;
+    stats_py->seconds = stats.seconds;
+    stats_py->nr_levels = static_cast<int>(context->level_stats.size());
+    stats_py->levels = context->level_stats.data();
+    return 0;
+}
+
+void PM_context_cancel(PM_context_t *context) {
+    context->cancel_flag = true;
+}
+
+namespace {
+
+// Clears the cancellation of the context when a call returns, so that a cancel() arriving before the call reached
+// the library still stops it.
+struct CancelConsumer {
+    explicit CancelConsumer(std::atomic<bool> &flag) : flag(flag) {
+        // pass
+    }
+    ~CancelConsumer() {
+        flag = false;
+    }
+    std::atomic<bool> &flag;
+};
+
+}
+
+int PM_context_inpaint(PM_context_t *context, PM_mat_t source_py, PM_mat_t mask_py, PM_mat_t global_mask_py, int patch_size, PM_mat_t result_py) {
+    const CancelConsumer consume_cancel(context->cancel_flag);
+    const bool collect_stats = context->stats_enabled && !context->split_components;
+    const int ret = _inpaint_into(source_py, mask_py, global_mask_py, patch_size, context->split_components, context->options,
+                                  context->thread_pool(), context->verbose, context->seed, result_py, context->progress(), &context->cancel_flag,
+                                  context->sink(), context->level_sink_full_size, collect_stats ? &context->stats : nullptr);
+    context->has_stats = collect_stats && ret >= 0;
+    return ret;
+}
+
+int PM_context_inpaint_regularity(PM_context_t *context, PM_mat_t source_py, PM_mat_t mask_py, PM_mat_t global_mask_py, PM_mat_t ijmap_py, int patch_size, float guide_weight, PM_mat_t result_py) {
+    const CancelConsumer consume_cancel(context->cancel_flag);
+    context->has_stats = false;
+    if (!_matches(result_py, source_py)) return -1;
+    cv::Mat source = _py_to_cv2(source_py);
+    cv::Mat mask = _py_to_cv2(mask_py);
+    cv::Mat global_mask = global_mask_py.data_ptr == nullptr ? cv::Mat() : _py_to_cv2(global_mask_py);
+    cv::Mat ijmap = _py_to_cv2(ijmap_py);
+
+    auto metric = RegularityGuidedPatchDistanceMetricV2(patch_size, ijmap, guide_weight);
+    auto inpainting = global_mask.empty() ? Inpainting(source, mask, &metric) : Inpainting(source, mask, global_mask, &metric);
+    inpainting.set_thread_pool(context->thread_pool());
+    inpainting.set_options(context->options);
+    inpainting.set_progress_callback(context->progress());
+    inpainting.set_cancel_flag(&context->cancel_flag);
+    inpainting.set_level_sink(context->sink(), context->level_sink_full_size);
+    inpainting.set_stats_enabled(context->stats_enabled);
+    cv::Mat result = inpainting.run(context->verbose, false, context->seed);
+    if (context->stats_enabled) {
+        context->stats = inpainting.stats();
+        context->has_stats = true;
+    }
+    if (_cv2_into_py(result, result_py) != 0) return -1;
+    return inpainting.cancelled() ? 1 : 0;
+}
+
+int PM_context_inpaint_frame(PM_context_t *context, PM_mat_t source_py, PM_mat_t mask_py, PM_mat_t global_mask_py, PM_mat_t motion_py, int patch_size, PM_mat_t result_py) {
+    const CancelConsumer consume_cancel(context->cancel_flag);
+    context->has_stats = false;
+    if (!_matches(result_py, source_py)) return -1;
+    if (motion_py.data_ptr != nullptr && (motion_py.dtype != PM_FLOAT32 || motion_py.shape.channels != 2 ||
+                                          motion_py.shape.width != source_py.shape.width || motion_py.shape.height != source_py.shape.height)) {
+        return -1;
+    }
+    cv::Mat source = _py_to_cv2(source_py);
+    cv::Mat mask = _py_to_cv2(mask_py);
+    cv::Mat global_mask = global_mask_py.data_ptr == nullptr ? cv::Mat() : _py_to_cv2(global_mask_py);
+    cv::Mat motion = motion_py.data_ptr == nullptr ? cv::Mat() : _py_to_cv2(motion_py);
+
+    if (!context->video || context->video_metric->patch_size() != patch_size) {
+        context->video_metric.reset(new PatchSSDDistanceMetric(patch_size));
+        context->video.reset(new VideoInpainting(context->video_metric.get()));
+    }
+    VideoInpainting &video = *context->video;
+    video.set_thread_pool(context->thread_pool());
+    video.set_options(context->options);
+    video.set_progress_callback(context->progress());
+    video.set_cancel_flag(&context->cancel_flag);
+    video.set_level_sink(context->sink(), context->level_sink_full_size);
+    video.set_stats_enabled(context->stats_enabled);
+    cv::Mat result = video.next_frame(source, mask, global_mask, motion, context->verbose, context->seed);
+    if (context->stats_enabled) {
+        context->stats = video.stats();
+        context->has_stats = true;
+    }
+    if (_cv2_into_py(result, result_py) != 0) return -1;
+    return video.cancelled() ? 1 : 0;
+}
+
+void PM_context_reset_frames(PM_context_t *context) {
+    if (context->video) context->video->reset();
+}
+
+struct PM_session {
+    PM_context_t *context;
+    cv::Mat source;
+    cv::Mat global_mask;
+    std::unique_ptr<PatchSSDDistanceMetric> metric;
+    std::unique_ptr<InpaintingSession> session;
+};
+
+PM_session_t *PM_context_create_session(PM_context_t *context, PM_mat_t source_py, PM_mat_t global_mask_py, int patch_size) {
+    if (source_py.data_ptr == nullptr || source_py.dtype != PM_UINT8 || source_py.shape.channels != 3) return nullptr;
+    if (source_py.shape.width <= 0 || source_py.shape.height <= 0 || patch_size <= 0) return nullptr;
+    if (global_mask_py.data_ptr != nullptr && (global_mask_py.dtype != PM_UINT8 || global_mask_py.shape.channels != 1 ||
+                                               global_mask_py.shape.width != source_py.shape.width || global_mask_py.shape.height != source_py.shape.height)) {
+        return nullptr;
+    }
+    auto session = new PM_session();
+    session->context = context;
+    session->source = _py_to_cv2(source_py).clone();
+    if (global_mask_py.data_ptr != nullptr) session->global_mask = _py_to_cv2(global_mask_py).clone();
+    session->metric.reset(new PatchSSDDistanceMetric(patch_size));
+    session->session.reset(new InpaintingSession(session->source, session->global_mask, session->metric.get()));
+    return session;
+}
+
+void PM_session_destroy(PM_session_t *session) {
+    delete session;
+}
+
+int PM_session_inpaint(PM_session_t *session_py, PM_mat_t mask_py, PM_mat_t result_py) {
+    PM_context_t *context = session_py->context;
+    const CancelConsumer consume_cancel(context->cancel_flag);
+    context->has_stats = false;
+    const cv::Mat &source = session_py->source;
+    if (mask_py.dtype != PM_UINT8 || mask_py.shape.channels != 1 || mask_py.shape.width != source.cols || mask_py.shape.height != source.rows) return -1;
+    if (!_matches(result_py, _cv2_view_py(source))) return -1;
+    cv::Mat mask = _py_to_cv2(mask_py);
+
+    InpaintingSession &session = *session_py->session;
+    session.set_thread_pool(context->thread_pool());
+    session.set_options(context->options);
+    session.set_progress_callback(context->progress());
+    session.set_cancel_flag(&context->cancel_flag);
+    session.set_level_sink(context->sink(), context->level_sink_full_size);
+    session.set_stats_enabled(context->stats_enabled);
+    cv::Mat result = session.inpaint(mask, context->verbose, context->seed);
+    if (context->stats_enabled) {
+        context->stats = session.stats();
+        context->has_stats = true;
+    }
+    if (_cv2_into_py(result, result_py) != 0) return -1;
+    return session.cancelled() ? 1 : 0;
+}
+
+void PM_session_reset(PM_session_t *session) {
+    session->session->reset();
+}
+
 void PM_free_pymat(PM_mat_t pymat) {
     free(pymat.data_ptr);
 }
@@ -60,6 +377,187 @@ PM_mat_t PM_inpaint2_regularity(PM_mat_t source_py, PM_mat_t mask_py, PM_mat_t g
     return _cv2_to_py(result);
 }
 
+PM_mat_t PM_inpaint_components(PM_mat_t source_py, PM_mat_t mask_py, int patch_size) {
+    cv::Mat source = _py_to_cv2(source_py);
+    cv::Mat mask = _py_to_cv2(mask_py);
+    auto metric = PatchSSDDistanceMetric(patch_size);
+    cv::Mat result = ComponentInpainting(source, mask, &metric).run(PM_verbose, PM_seed);
+    return _cv2_to_py(result);
+}
+
+PM_mat_t PM_inpaint2_components(PM_mat_t source_py, PM_mat_t mask_py, PM_mat_t global_mask_py, int patch_size) {
+    cv::Mat source = _py_to_cv2(source_py);
+    cv::Mat mask = _py_to_cv2(mask_py);
+    cv::Mat global_mask = _py_to_cv2(global_mask_py);
+
+    auto metric = PatchSSDDistanceMetric(patch_size);
+    cv::Mat result = ComponentInpainting(source, mask, global_mask, &metric).run(PM_verbose, PM_seed);
+    return _cv2_to_py(result);
+}
+
+int PM_inpaint_into(PM_mat_t source_py, PM_mat_t mask_py, int patch_size, PM_mat_t result_py) {
+    if (!_matches(result_py, source_py)) return -1;
+    cv::Mat source = _py_to_cv2(source_py);
+    cv::Mat mask = _py_to_cv2(mask_py);
+    auto metric = PatchSSDDistanceMetric(patch_size);
+    return _cv2_into_py(Inpainting(source, mask, &metric).run(PM_verbose, false, PM_seed), result_py);
+}
+
+int PM_inpaint_regularity_into(PM_mat_t source_py, PM_mat_t mask_py, PM_mat_t ijmap_py, int patch_size, float guide_weight, PM_mat_t result_py) {
+    if (!_matches(result_py, source_py)) return -1;
+    cv::Mat source = _py_to_cv2(source_py);
+    cv::Mat mask = _py_to_cv2(mask_py);
+    cv::Mat ijmap = _py_to_cv2(ijmap_py);
+
+    auto metric = RegularityGuidedPatchDistanceMetricV2(patch_size, ijmap, guide_weight);
+    return _cv2_into_py(Inpainting(source, mask, &metric).run(PM_verbose, false, PM_seed), result_py);
+}
+
+int PM_inpaint2_into(PM_mat_t source_py, PM_mat_t mask_py, PM_mat_t global_mask_py, int patch_size, PM_mat_t result_py) {
+    if (!_matches(result_py, source_py)) return -1;
+    cv::Mat source = _py_to_cv2(source_py);
+    cv::Mat mask = _py_to_cv2(mask_py);
+    cv::Mat global_mask = _py_to_cv2(global_mask_py);
+
+    auto metric = PatchSSDDistanceMetric(patch_size);
+    return _cv2_into_py(Inpainting(source, mask, global_mask, &metric).run(PM_verbose, false, PM_seed), result_py);
+}
+
+int PM_inpaint2_regularity_into(PM_mat_t source_py, PM_mat_t mask_py, PM_mat_t global_mask_py, PM_mat_t ijmap_py, int patch_size, float guide_weight, PM_mat_t result_py) {
+    if (!_matches(result_py, source_py)) return -1;
+    cv::Mat source = _py_to_cv2(source_py);
+    cv::Mat mask = _py_to_cv2(mask_py);
+    cv::Mat global_mask = _py_to_cv2(global_mask_py);
+    cv::Mat ijmap = _py_to_cv2(ijmap_py);
+
+    auto metric = RegularityGuidedPatchDistanceMetricV2(patch_size, ijmap, guide_weight);
+    return _cv2_into_py(Inpainting(source, mask, global_mask, &metric).run(PM_verbose, false, PM_seed), result_py);
+}
+
+int PM_inpaint_components_into(PM_mat_t source_py, PM_mat_t mask_py, int patch_size, PM_mat_t result_py) {
+    if (!_matches(result_py, source_py)) return -1;
+    cv::Mat source = _py_to_cv2(source_py);
+    cv::Mat mask = _py_to_cv2(mask_py);
+    auto metric = PatchSSDDistanceMetric(patch_size);
+    return _cv2_into_py(ComponentInpainting(source, mask, &metric).run(PM_verbose, PM_seed), result_py);
+}
+
+int PM_inpaint2_components_into(PM_mat_t source_py, PM_mat_t mask_py, PM_mat_t global_mask_py, int patch_size, PM_mat_t result_py) {
+    if (!_matches(result_py, source_py)) return -1;
+    cv::Mat source = _py_to_cv2(source_py);
+    cv::Mat mask = _py_to_cv2(mask_py);
+    cv::Mat global_mask = _py_to_cv2(global_mask_py);
+
+    auto metric = PatchSSDDistanceMetric(patch_size);
+    return _cv2_into_py(ComponentInpainting(source, mask, global_mask, &metric).run(PM_verbose, PM_seed), result_py);
+}
+
+int PM_inpaint_options_into(PM_mat_t source_py, PM_mat_t mask_py, PM_mat_t global_mask_py, int patch_size, int split_components,
+                            const PM_options_t *options, PM_mat_t result_py) {
+    return _inpaint_into(source_py, mask_py, global_mask_py, patch_size, split_components != 0, _options_from_py(options),
+                         &ThreadPool::global(), PM_verbose, PM_seed, result_py);
+}
+
+void PM_inpaint_batch(int nr_images, const PM_mat_t *images_py, const PM_mat_t *masks_py, const PM_mat_t *global_masks_py, int patch_size, PM_mat_t *results_py) {
+    auto metric = PatchSSDDistanceMetric(patch_size);
+    BatchInpainting batch(&metric);
+    for (int k = 0; k < nr_images; ++k) {
+        if (global_masks_py == nullptr || global_masks_py[k].data_ptr == nullptr) {
+            batch.add(_py_to_cv2(images_py[k]), _py_to_cv2(masks_py[k]));
+        } else {
+            batch.add(_py_to_cv2(images_py[k]), _py_to_cv2(masks_py[k]), _py_to_cv2(global_masks_py[k]));
+        }
+    }
+
+    auto results = batch.run(PM_verbose, PM_seed);
+    for (int k = 0; k < nr_images; ++k) results_py[k] = _cv2_to_py(results[k]);
+}
+
+int PM_inpaint_file(const char *image_path, const char *mask_path, const char *global_mask_path, const char *output_path,
+                    int width, int height, int patch_size, double memory_budget_mb) {
+    auto metric = PatchSSDDistanceMetric(patch_size);
+    TiledInpainting inpainting(image_path, mask_path, global_mask_path ? global_mask_path : "", output_path ? output_path : "", cv::Size(width, height), &metric);
+    if (memory_budget_mb > 0) inpainting.set_memory_budget(static_cast<size_t>(memory_budget_mb * (1 << 20)));
+    if (inpainting.run(PM_verbose, PM_seed)) return 0;
+    return inpainting.over_budget() ? -2 : -1;
+}
+
+int _inpaint_into(PM_mat_t source_py, PM_mat_t mask_py, PM_mat_t global_mask_py, int patch_size, bool split_components,
+                  const InpaintingOptions &options, ThreadPool *pool, bool verbose, unsigned int seed, PM_mat_t result_py,
+                  const Inpainting::ProgressCallback &progress, const std::atomic<bool> *cancel_flag,
+                  const Inpainting::LevelSink &sink, bool sink_full_size, InpaintingStats *stats) {
+    if (!_matches(result_py, source_py)) return -1;
+    cv::Mat source = _py_to_cv2(source_py);
+    cv::Mat mask = _py_to_cv2(mask_py);
+    cv::Mat global_mask = global_mask_py.data_ptr == nullptr ? cv::Mat() : _py_to_cv2(global_mask_py);
+
+    auto metric = PatchSSDDistanceMetric(patch_size);
+    cv::Mat result;
+    bool cancelled = false;
+    if (split_components) {
+        auto inpainting = global_mask.empty() ? ComponentInpainting(source, mask, &metric) : ComponentInpainting(source, mask, global_mask, &metric);
+        inpainting.set_thread_pool(pool);
+        inpainting.set_options(options);
+        inpainting.set_cancel_flag(cancel_flag);
+        result = inpainting.run(verbose, seed);
+        cancelled = inpainting.cancelled();
+    } else {
+        auto inpainting = global_mask.empty() ? Inpainting(source, mask, &metric) : Inpainting(source, mask, global_mask, &metric);
+        inpainting.set_thread_pool(pool);
+        inpainting.set_options(options);
+        inpainting.set_progress_callback(progress);
+        inpainting.set_cancel_flag(cancel_flag);
+        inpainting.set_level_sink(sink, sink_full_size);
+        inpainting.set_stats_enabled(stats != nullptr);
+        result = inpainting.run(verbose, false, seed);
+        cancelled = inpainting.cancelled();
+        if (stats != nullptr) *stats = inpainting.stats();
+    }
+    if (_cv2_into_py(result, result_py) != 0) return -1;
+    return cancelled ? 1 : 0;
+}
+
+InpaintingOptions _options_from_py(const PM_options_t *options_py) {
+    InpaintingOptions options;
+    if (options_py == nullptr) return options;
+    options.max_retry = options_py->max_retry;
+    options.em_iterations_base = options_py->em_iterations_base;
+    options.em_iterations_per_level = options_py->em_iterations_per_level;
+    options.nnf_passes_base = options_py->nnf_passes_base;
+    options.nnf_passes_per_level = options_py->nnf_passes_per_level;
+    options.max_nnf_passes = options_py->max_nnf_passes;
+    options.nnf_tolerance = options_py->nnf_tolerance;
+    options.em_tolerance = options_py->em_tolerance;
+    options.hole_aware_pyramid = options_py->hole_aware_pyramid != 0;
+    options.max_pyramid_levels = options_py->max_pyramid_levels;
+    options.similarity_sharpness = options_py->similarity_sharpness;
+    options.time_budget = options_py->time_budget;
+    options.warm_em_iterations = options_py->warm_em_iterations;
+    options.warm_nnf_passes = options_py->warm_nnf_passes;
+    options.warm_search_radius = options_py->warm_search_radius;
+    return options;
+}
+
+PM_options_t _options_to_py(const InpaintingOptions &options) {
+    PM_options_t options_py;
+    options_py.max_retry = options.max_retry;
+    options_py.em_iterations_base = options.em_iterations_base;
+    options_py.em_iterations_per_level = options.em_iterations_per_level;
+    options_py.nnf_passes_base = options.nnf_passes_base;
+    options_py.nnf_passes_per_level = options.nnf_passes_per_level;
+    options_py.max_nnf_passes = options.max_nnf_passes;
+    options_py.nnf_tolerance = options.nnf_tolerance;
+    options_py.em_tolerance = options.em_tolerance;
+    options_py.hole_aware_pyramid = options.hole_aware_pyramid;
+    options_py.max_pyramid_levels = options.max_pyramid_levels;
+    options_py.similarity_sharpness = options.similarity_sharpness;
+    options_py.time_budget = options.time_budget;
+    options_py.warm_em_iterations = options.warm_em_iterations;
+    options_py.warm_nnf_passes = options.warm_nnf_passes;
+    options_py.warm_search_radius = options.warm_search_radius;
+    return options_py;
+}
+
 int _dtype_py_to_cv(int dtype_py) {
     switch (dtype_py) {
         case PM_UINT8: return CV_8U;
@@ -88,10 +586,11 @@ int _dtype_cv_to_py(int dtype_cv) {
     return PM_UINT8;
 }
 
+// Wraps the caller's buffer without copying: the inpainting never writes to its inputs.
 cv::Mat _py_to_cv2(PM_mat_t pymat) {
-    int dtype = _dtype_py_to_cv(pymat.dtype);
-    dtype = CV_MAKETYPE(pymat.dtype, pymat.shape.channels);
-    return cv::Mat(cv::Size(pymat.shape.width, pymat.shape.height), dtype, pymat.data_ptr).clone();
+    int dtype = CV_MAKETYPE(_dtype_py_to_cv(pymat.dtype), pymat.shape.channels);
+    size_t step = pymat.stride == 0 ? static_cast<size_t>(cv::Mat::AUTO_STEP) : pymat.stride;
+    return cv::Mat(cv::Size(pymat.shape.width, pymat.shape.height), dtype, pymat.data_ptr, step);
 }
 
 PM_mat_t _cv2_to_py(cv::Mat cvmat) {
@@ -102,6 +601,27 @@ PM_mat_t _cv2_to_py(cv::Mat cvmat) {
     void *data_ptr = reinterpret_cast<void *>(malloc(dsize));
     memcpy(data_ptr, reinterpret_cast<void *>(cvmat.data), dsize);
 
-    return PM_mat_t {data_ptr, shape, dtype};
+    return PM_mat_t {data_ptr, shape, dtype, 0};
+}
+
+// Borrows the pixels of the matrix, which must outlive the view.
+PM_mat_t _cv2_view_py(const cv::Mat &cvmat) {
+    PM_shape_t shape = {cvmat.size().width, cvmat.size().height, cvmat.channels()};
+    return PM_mat_t {reinterpret_cast<void *>(cvmat.data), shape, _dtype_cv_to_py(cvmat.depth()), cvmat.step};
+}
+
+bool _matches(PM_mat_t pymat, PM_mat_t other) {
+    return pymat.data_ptr != nullptr && pymat.dtype == other.dtype && pymat.shape.width == other.shape.width &&
+           pymat.shape.height == other.shape.height && pymat.shape.channels == other.shape.channels;
+}
+
+// Returns -1, without writing, unless the caller's buffer has the size and type of the matrix: copyTo would otherwise
+// reallocate and leave the buffer untouched.
+int _cv2_into_py(cv::Mat cvmat, PM_mat_t pymat) {
+    if (pymat.data_ptr == nullptr) return -1;
+    cv::Mat out = _py_to_cv2(pymat);
+    if (out.size() != cvmat.size() || out.type() != cvmat.type()) return -1;
+    cvmat.copyTo(out);
+    return 0;
 }
 
@@ -1,4 +1,6 @@
 #include <opencv2/core.hpp>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
@@ -19,20 +21,162 @@ enum PM_dtype_e {
     PM_FLOAT64,
 };
 
+// A matrix borrowed from (or returned to) the caller. The pixels of a row are contiguous; stride is the number of
+// bytes between the starts of two rows, 0 meaning that the rows are contiguous too.
 struct PM_mat_t {
     void *data_ptr;
     PM_shape_t shape;
     int dtype;
+    size_t stride;
 };
 
 void PM_set_random_seed(unsigned int seed);
 void PM_set_verbose(int value);
+// Number of worker threads used by the inpainting routines (including the calling thread); <= 0 means all cores.
+void PM_set_nr_threads(int nr_threads);
+int PM_get_nr_threads(void);
+
+enum PM_isa_e {
+    PM_ISA_AUTO = -1,
+    PM_ISA_SCALAR = 0,
+    PM_ISA_SSE41 = 1,
+    PM_ISA_AVX2 = 2,
+    PM_ISA_AVX512 = 3,
+};
+
+// Instruction set of the kernels in use. PM_set_isa caps the request to what the CPU supports (PM_ISA_AUTO picks
+// the best one) and returns the instruction set actually selected.
+int PM_get_isa(void);
+int PM_get_detected_isa(void);
+int PM_set_isa(int isa);
+const char *PM_get_isa_name(int isa);
+
+// The tuning knobs of the inpainting (see InpaintingOptions in inpaint.h). Booleans are ints (0 or 1).
+struct PM_options_t {
+    int max_retry;
+    int em_iterations_base, em_iterations_per_level;
+    int nnf_passes_base, nnf_passes_per_level, max_nnf_passes;
+    double nnf_tolerance, em_tolerance;
+    int hole_aware_pyramid;
+    int max_pyramid_levels;
+    double similarity_sharpness;
+    double time_budget;  // In seconds; 0 for none.
+    int warm_em_iterations, warm_nnf_passes, warm_search_radius;
+};
+
+// Fills options with the preset of the given name: "fast", "balanced" (the default options) or "quality".
+// Returns 0 on success, -1 (leaving options untouched) if there is no such preset.
+int PM_options_preset(const char *name, PM_options_t *options);
+
+// A handle owning the options and (optionally) the worker pool of one caller; nothing else is shared between calls
+// but read-only tables. Calls on different contexts may run concurrently, from any threads; a context itself must
+// not be used by two threads at once. The global functions above and below use a default context.
+struct PM_context;
+typedef struct PM_context PM_context_t;
+
+PM_context_t *PM_context_create(void);
+void PM_context_destroy(PM_context_t *context);
+void PM_context_set_random_seed(PM_context_t *context, unsigned int seed);
+void PM_context_set_verbose(PM_context_t *context, int value);
+// Gives the context a pool of its own, of nr_threads threads; 0 shares the global pool (the default).
+void PM_context_set_nr_threads(PM_context_t *context, int nr_threads);
+// Inpaints every connected component of the hole in its own crop (see ComponentInpainting); off by default.
+void PM_context_set_split_components(PM_context_t *context, int value);
+// NULL restores the balanced preset.
+void PM_context_set_options(PM_context_t *context, const PM_options_t *options);
+// Called after every EM iteration of PM_context_inpaint(_regularity), on the calling thread, with the fraction of the
+// planned work done. NULL removes it. Not called with split_components (its jobs run concurrently).
+typedef void (*PM_progress_func_t)(int level, int iteration, double fraction, void *user_data);
+void PM_context_set_progress_callback(PM_context_t *context, PM_progress_func_t callback, void *user_data);
+// Called after every pyramid level of PM_context_inpaint(_regularity), on the calling thread, with the fill of the level
+// (see Inpainting::set_level_sink): with full_size, at the size of the input; otherwise at the size of the next finer
+// level. The image is borrowed for the duration of the call. NULL removes it. Not called with split_components.
+typedef void (*PM_level_sink_t)(int level, PM_mat_t image, void *user_data);
+void PM_context_set_level_sink(PM_context_t *context, PM_level_sink_t sink, int full_size, void *user_data);
+// Cancels the inpainting running on the context: it stops before its next EM iteration, writes the fill reached so
+// far (upsampled to the full size) and returns 1. The only context function that may be called from another thread
+// while the context is in use. The cancellation holds until a call returns: one arriving before the call reached
+// the library, or between two calls, cancels the next call.
+void PM_context_cancel(PM_context_t *context);
+// What the last call on a context did (see InpaintingStats in inpaint.h); the times are in seconds. The per field
+// arrays hold the source to target field at index 0, and the target to source one at index 1.
+struct PM_level_stats_t {
+    int level, width, height, active_pixels, em_iterations;
+    int warm_started;  // Whether the fields started from the previous frame (see PM_context_inpaint_frame).
+    double init_seconds, minimize_seconds, expectation_seconds, maximization_seconds, seconds;
+    int64_t distance_evaluations[2];
+    int64_t propagation_tries[2], propagation_accepts[2];
+    int64_t random_search_tries[2], random_search_accepts[2];
+    int nr_passes[2];
+    const double *mean_distance[2];  // The mean distance after every pass: nr_passes values.
+};
+struct PM_stats_t {
+    double pyramid_seconds, seconds;
+    int nr_levels;
+    const PM_level_stats_t *levels;  // Coarsest first.
+};
+// Whether PM_context_inpaint(_regularity) collect stats; off by default, and free when off. Not collected with
+// split_components.
+void PM_context_set_stats_enabled(PM_context_t *context, int value);
+// The stats of the last call on the context, which stay owned by the context until its next call. Returns 0, or -1
+// if that call did not collect any.
+int PM_get_last_stats(PM_context_t *context, PM_stats_t *stats);
+// As PM_inpaint2_into and PM_inpaint2_regularity_into; a NULL global_mask.data_ptr means no global mask. The
+// regularity guided inpainting ignores split_components (its metric depends on absolute positions). Return 1 if
+// cancelled (see PM_context_cancel).
+int PM_context_inpaint(PM_context_t *context, PM_mat_t image, PM_mat_t mask, PM_mat_t global_mask, int patch_size, PM_mat_t result);
+int PM_context_inpaint_regularity(PM_context_t *context, PM_mat_t image, PM_mat_t mask, PM_mat_t global_mask, PM_mat_t ijmap, int patch_size, float guide_weight, PM_mat_t result);
+// Inpaints the next frame of a video (see VideoInpainting): the fields start from those of the previous frame inpainted
+// on the context, moved by motion if its data_ptr is not NULL. motion is a float32 map of 2 channels of the size of
+// the image, holding for every pixel the offset (dx, dy) to the same content in the previous frame (backward optical
+// flow). Ignores split_components. Returns 0, 1 if cancelled, or -1 if the result or the motion does not match.
+// Changing the patch size starts from scratch, as does PM_context_reset_frames (e.g. at a scene cut).
+int PM_context_inpaint_frame(PM_context_t *context, PM_mat_t image, PM_mat_t mask, PM_mat_t global_mask, PM_mat_t motion, int patch_size, PM_mat_t result);
+void PM_context_reset_frames(PM_context_t *context);
+// A session inpainting one image again and again as its mask changes, e.g. in an editor (see InpaintingSession): the
+// pyramid of the image is kept, and every call starts from the last solution but around the changes of the mask. The
+// image (uint8, 3 channels) and global mask (uint8, 1 channel, of the size of the image; NULL data_ptr: none) are
+// copied; returns NULL if they do not match. Every call uses the options, pool, callbacks, stats and cancellation of
+// the context, which must outlive the session.
+struct PM_session;
+typedef struct PM_session PM_session_t;
+PM_session_t *PM_context_create_session(PM_context_t *context, PM_mat_t image, PM_mat_t global_mask, int patch_size);
+void PM_session_destroy(PM_session_t *session);
+// mask is a uint8 matrix of one channel, of the size of the image. Returns 0, 1 if cancelled, or -1 if the mask or the
+// result does not match the image.
+int PM_session_inpaint(PM_session_t *session, PM_mat_t mask, PM_mat_t result);
+// Forgets the last solution: the next call starts from scratch, but for the pyramid.
+void PM_session_reset(PM_session_t *session);
 
 void PM_free_pymat(PM_mat_t pymat);
 PM_mat_t PM_inpaint(PM_mat_t image, PM_mat_t mask, int patch_size);
 PM_mat_t PM_inpaint_regularity(PM_mat_t image, PM_mat_t mask, PM_mat_t ijmap, int patch_size, float guide_weight);
 PM_mat_t PM_inpaint2(PM_mat_t image, PM_mat_t mask, PM_mat_t global_mask, int patch_size);
 PM_mat_t PM_inpaint2_regularity(PM_mat_t image, PM_mat_t mask, PM_mat_t global_mask, PM_mat_t ijmap, int patch_size, float guide_weight);
+// Inpaints every connected component of the hole in its own crop, concurrently (see ComponentInpainting).
+PM_mat_t PM_inpaint_components(PM_mat_t image, PM_mat_t mask, int patch_size);
+PM_mat_t PM_inpaint2_components(PM_mat_t image, PM_mat_t mask, PM_mat_t global_mask, int patch_size);
+// The same, but the inputs are read in place and the result is written to a buffer owned by the caller, which must
+// have the size and type of the image (its stride may differ). Returns 0 on success, -1 if the result does not match.
+int PM_inpaint_into(PM_mat_t image, PM_mat_t mask, int patch_size, PM_mat_t result);
+int PM_inpaint_regularity_into(PM_mat_t image, PM_mat_t mask, PM_mat_t ijmap, int patch_size, float guide_weight, PM_mat_t result);
+int PM_inpaint2_into(PM_mat_t image, PM_mat_t mask, PM_mat_t global_mask, int patch_size, PM_mat_t result);
+int PM_inpaint2_regularity_into(PM_mat_t image, PM_mat_t mask, PM_mat_t global_mask, PM_mat_t ijmap, int patch_size, float guide_weight, PM_mat_t result);
+int PM_inpaint_components_into(PM_mat_t image, PM_mat_t mask, int patch_size, PM_mat_t result);
+int PM_inpaint2_components_into(PM_mat_t image, PM_mat_t mask, PM_mat_t global_mask, int patch_size, PM_mat_t result);
+// All of the above but the regularity guided ones, with options (NULL: the balanced preset). A NULL
+// global_mask.data_ptr means no global mask.
+int PM_inpaint_options_into(PM_mat_t image, PM_mat_t mask, PM_mat_t global_mask, int patch_size, int split_components,
+                            const PM_options_t *options, PM_mat_t result);
+// Inpaints nr_images independent images concurrently, largest first (see BatchInpainting). global_masks may be NULL,
+// as may the data_ptr of any of its entries (no global mask for that image). results receives nr_images matrices,
+// each to be freed with PM_free_pymat.
+void PM_inpaint_batch(int nr_images, const PM_mat_t *images, const PM_mat_t *masks, const PM_mat_t *global_masks, int patch_size, PM_mat_t *results);
+// Out-of-core inpainting of raw, memory-mapped files (see TiledInpainting). global_mask_path may be NULL (no global
+// mask) and output_path NULL (inpaint the image file in place). Returns 0 on success, -1 if a file cannot be mapped,
+// -2 if a single crop does not fit in the memory budget (nothing is written then).
+int PM_inpaint_file(const char *image_path, const char *mask_path, const char *global_mask_path, const char *output_path,
+                    int width, int height, int patch_size, double memory_budget_mb);
 
 } /*  extern "C" */
 
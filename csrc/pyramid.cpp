@@ -0,0 +1,264 @@
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#include "cpu_dispatch.h"
+#include "pyramid.h"
+
+namespace {
+
+// The masked downsampling of MaskedImage::downsample, one output row at a time. The horizontal sums of the input
+// rows are cached, so that consecutive output rows share the 4 input rows their kernels overlap on.
+class RowDownsampler {
+public:
+    explicit RowDownsampler(const MaskedImage &source)
+        : m_source(source), m_width(source.size().width / 2), m_sums(kNrCachedRows * 4 * m_width), m_gmasked(kNrCachedRows * m_width),
+          m_cached_y(kNrCachedRows, -1), m_vertical_sums(4 * m_width), m_downsample_row(active_kernels().downsample_row) {
+        // pass
+    }
+
+    // Output row y; global_mask is nullptr if the source has no global mask, or to skip it.
+    void downsample(int y, unsigned char *image, unsigned char *mask, unsigned char *global_mask) {
+        const int *kernel = MaskedImage::kDownsampleKernel;
+        const int height = m_source.size().height;
+        const int *rows[8];
+        int weights[8];
+        const unsigned char *gmasked_rows[8];
+        int nr_rows = 0;
+        for (int dy = -2; dy <= 3; ++dy) {
+            const int yy = 2 * y + dy;
+            if (yy < 0 || yy >= height) continue;
+            const int slot = _horizontal_pass(yy);
+            rows[nr_rows] = m_sums.data() + slot * 4 * m_width;
+            weights[nr_rows] = kernel[dy + 2];
+            gmasked_rows[nr_rows] = m_gmasked.data() + slot * m_width;
+            ++nr_rows;
+        }
+        m_downsample_row(rows, weights, nr_rows, m_vertical_sums.data(), 4 * m_width);
+
+        for (int x = 0; x < m_width; ++x) {
+            const int *sums_ptr = m_vertical_sums.data() + 4 * x;
+            const int ksum = sums_ptr[3];
+            if (ksum > 0) {
+                for (int c = 0; c < 3; ++c) image[3 * x + c] = static_cast<unsigned char>(sums_ptr[c] / ksum);
+                mask[x] = 0;
+            } else {
+                image[3 * x] = image[3 * x + 1] = image[3 * x + 2] = 0;
+                mask[x] = 1;
+            }
+            if (global_mask) {
+                unsigned char is_gmasked = 1;
+                for (int k = 0; k < nr_rows; ++k) is_gmasked &= gmasked_rows[k][x];
+                global_mask[x] = is_gmasked;
+            }
+        }
+    }
+
+private:
+    static const int kNrCachedRows = 8;  // The 6-tap kernel never needs more than 8 rows at a time.
+
+    // The sums (r, g, b, weight) over the unmasked taps of every output column of input row y, and whether all its
+    // taps are globally masked. Returns the cache slot.
+    int _horizontal_pass(int y) {
+        const int slot = y % kNrCachedRows;
+        if (m_cached_y[slot] == y) return slot;
+        m_cached_y[slot] = y;
+
+        const int *kernel = MaskedImage::kDownsampleKernel;
+        const int width = m_source.size().width;
+        const unsigned char *image = m_source.image().ptr<unsigned char>(y);
+        const unsigned char *mask = m_source.mask().ptr<unsigned char>(y);
+        const unsigned char *global_mask = m_source.global_mask().empty() ? nullptr : m_source.global_mask().ptr<unsigned char>(y);
+        int *sums = m_sums.data() + slot * 4 * m_width;
+        unsigned char *gmasked = m_gmasked.data() + slot * m_width;
+
+        for (int i = 0, x = 0; i < m_width; ++i, x += 2) {
+            // Taps x - 2 to x + 3, clipped to the row.
+            const int t_begin = std::max(0, 2 - x), t_end = std::min(6, width - x + 2);
+            int r = 0, g = 0, b = 0, ksum = 0;
+            unsigned char is_gmasked = 1;
+            for (int t = t_begin; t < t_end; ++t) {
+                const int xx = x - 2 + t;
+                const int k = mask[xx] ? 0 : kernel[t];
+                r += image[3 * xx] * k, g += image[3 * xx + 1] * k, b += image[3 * xx + 2] * k;
+                ksum += k;
+                if (global_mask) is_gmasked &= global_mask[xx] != 0;
+            }
+            sums[4 * i] = r, sums[4 * i + 1] = g, sums[4 * i + 2] = b, sums[4 * i + 3] = ksum;
+            gmasked[i] = is_gmasked;
+        }
+        return slot;
+    }
+
+    const MaskedImage &m_source;
+    int m_width;
+    std::vector<int> m_sums;
+    std::vector<unsigned char> m_gmasked;
+    std::vector<int> m_cached_y;
+    std::vector<int> m_vertical_sums;
+    DownsampleRowKernel m_downsample_row;
+};
+
+// The gradients of row y of an image of the given height, as computed by ImageGradients.
+void compute_gradient_row(int y, cv::Size size, const unsigned char *previous, const unsigned char *row, const unsigned char *next,
+                          unsigned char *grady, unsigned char *gradx) {
+    if (y == 0 || y == size.height - 1) {
+        std::memset(grady, 0, 3 * size.width);
+        std::memset(gradx, 0, 3 * size.width);
+        return;
+    }
+    ImageGradients::compute_row(previous, row, next, size.width, grady, gradx);
+}
+
+// Rows [y_begin, y_end) of the gradients (if compute_gradients) and of the packed features (unless nullptr) of an
+// image whose rows are all final.
+void compute_feature_rows(int y_begin, int y_end, const cv::Mat &image, const cv::Mat &mask, const cv::Mat &global_mask,
+                          bool compute_gradients, cv::Mat &grady, cv::Mat &gradx, PackedFeatures *packed) {
+    const cv::Size size = image.size();
+    for (int y = y_begin; y < y_end; ++y) {
+        if (compute_gradients) {
+            compute_gradient_row(y, size, image.ptr<unsigned char>(std::max(0, y - 1)), image.ptr<unsigned char>(y),
+                                 image.ptr<unsigned char>(std::min(size.height - 1, y + 1)), grady.ptr<unsigned char>(y), gradx.ptr<unsigned char>(y));
+        }
+        if (packed) {
+            packed->pack_row(y, image.ptr<unsigned char>(y), gradx.ptr<unsigned char>(y), grady.ptr<unsigned char>(y),
+                             mask.ptr<unsigned char>(y), global_mask.empty() ? nullptr : global_mask.ptr<unsigned char>(y));
+        }
+    }
+}
+
+}
+
+std::vector<MaskedImage> PyramidBuilder::build(const MaskedImage &image, int max_level, int min_size) const {
+    std::vector<MaskedImage> levels;
+    levels.push_back(image);
+    prepare(levels.back());
+    while (static_cast<int>(levels.size()) <= max_level &&
+           levels.back().size().height > min_size && levels.back().size().width > min_size) {
+        levels.push_back(downsample(levels.back()));
+    }
+    return levels;
+}
+
+MaskedImage PyramidBuilder::downsample(const MaskedImage &source) const {
+    const cv::Size new_size(source.size().width / 2, source.size().height / 2);
+    const bool has_global_mask = !source.global_mask().empty();
+    if (new_size.width == 0 || new_size.height == 0) {
+        auto ret = MaskedImage(new_size.width, new_size.height);
+        if (has_global_mask) ret.init_global_mask_mat();
+        return ret;
+    }
+
+    cv::Mat image(new_size, CV_8UC3), mask(new_size, CV_8U), global_mask;
+    cv::Mat grady(new_size, CV_8UC3), gradx(new_size, CV_8UC3);
+    if (has_global_mask) global_mask = cv::Mat(new_size, CV_8U);
+    std::shared_ptr<PackedFeatures> packed;
+    if (m_packed_border > 0) packed = std::make_shared<PackedFeatures>(new_size.width, new_size.height, m_packed_border);
+
+    _for_each_band(new_size.height, [&](int y_begin, int y_end) {
+        RowDownsampler downsampler(source);
+
+        // The rows just above and below the band belong to the neighbouring bands; they are recomputed here, for
+        // the gradients, rather than waiting for those bands.
+        const int row_bytes = 3 * new_size.width;
+        std::vector<unsigned char> halo(2 * row_bytes), halo_mask(new_size.width), halo_global_mask(new_size.width);
+        auto image_row = [&](int y) -> unsigned char * {
+            if (y < y_begin) return halo.data();
+            if (y >= y_end) return halo.data() + row_bytes;
+            return image.ptr<unsigned char>(y);
+        };
+
+        for (int y = std::max(0, y_begin - 1); y < std::min(new_size.height, y_end + 1); ++y) {
+            const bool in_band = y >= y_begin && y < y_end;
+            unsigned char *mask_ptr = in_band ? mask.ptr<unsigned char>(y) : halo_mask.data();
+            unsigned char *global_mask_ptr = !has_global_mask ? nullptr : in_band ? global_mask.ptr<unsigned char>(y) : halo_global_mask.data();
+            downsampler.downsample(y, image_row(y), mask_ptr, global_mask_ptr);
+        }
+
+        for (int y = y_begin; y < y_end; ++y) {
+            compute_gradient_row(y, new_size, image_row(y - 1), image_row(y), image_row(y + 1), grady.ptr<unsigned char>(y), gradx.ptr<unsigned char>(y));
+            if (packed) {
+                packed->pack_row(y, image.ptr<unsigned char>(y), gradx.ptr<unsigned char>(y), grady.ptr<unsigned char>(y),
+                                 mask.ptr<unsigned char>(y), has_global_mask ? global_mask.ptr<unsigned char>(y) : nullptr);
+            }
+        }
+    });
+
+    auto ret = MaskedImage(image, mask, global_mask, std::make_shared<ImageGradients>(grady, gradx));
+    if (packed) ret.set_packed_features(packed);
+    return ret;
+}
+
+void PyramidBuilder::prepare(MaskedImage &image) const {
+    const cv::Size size = image.size();
+    const bool needs_gradients = !image.has_image_gradients();
+    const bool needs_packed = m_packed_border > 0 && !image.has_packed_features(m_packed_border);
+    if (size.width == 0 || size.height == 0 || (!needs_gradients && !needs_packed)) return;
+
+    cv::Mat grady, gradx;
+    if (needs_gradients) {
+        grady = cv::Mat(size, CV_8UC3);
+        gradx = cv::Mat(size, CV_8UC3);
+    } else {
+        grady = image.grady();
+        gradx = image.gradx();
+    }
+    std::shared_ptr<PackedFeatures> packed;
+    if (needs_packed) packed = std::make_shared<PackedFeatures>(size.width, size.height, m_packed_border);
+
+    _for_each_band(size.height, [&](int y_begin, int y_end) {
+        compute_feature_rows(y_begin, y_end, image.image(), image.mask(), image.global_mask(), needs_gradients, grady, gradx, packed.get());
+    });
+
+    if (needs_gradients) image = MaskedImage(image.image(), image.mask(), image.global_mask(), std::make_shared<ImageGradients>(grady, gradx));
+    if (packed) image.set_packed_features(packed);
+}
+
+void PyramidBuilder::update(std::vector<MaskedImage> &levels, int y_begin, int y_end) const {
+    if (levels.empty()) return;
+    y_begin = std::max(0, y_begin), y_end = std::min(levels[0].size().height, y_end);
+
+    for (size_t level = 0; level < levels.size() && y_begin < y_end; ++level) {
+        MaskedImage &image = levels[level];
+        int feature_begin = y_begin, feature_end = y_end;
+        if (level > 0) {
+            // Output row y reads the input rows 2y - 2 to 2y + 3.
+            const int height = image.size().height;
+            y_begin = std::max(0, (y_begin - 2) / 2), y_end = std::min(height, (y_end + 1) / 2 + 1);
+            if (y_begin >= y_end) break;
+            cv::Mat rows_image = image.image(), rows_mask = image.mask();
+            const MaskedImage &source = levels[level - 1];
+            _for_each_band(y_end - y_begin, [&](int band_begin, int band_end) {
+                RowDownsampler downsampler(source);
+                for (int y = y_begin + band_begin; y < y_begin + band_end; ++y) {
+                    downsampler.downsample(y, rows_image.ptr<unsigned char>(y), rows_mask.ptr<unsigned char>(y), nullptr);
+                }
+            });
+            // The gradients of a row also read the rows above and below it. Those of level 0 only depend on its
+            // image, which is unchanged.
+            feature_begin = std::max(0, y_begin - 1), feature_end = std::min(height, y_end + 1);
+        }
+
+        cv::Mat grady = image.grady(), gradx = image.gradx();
+        PackedFeatures *packed = image.mutable_packed_features();
+        _for_each_band(feature_end - feature_begin, [&](int band_begin, int band_end) {
+            compute_feature_rows(feature_begin + band_begin, feature_begin + band_end, image.image(), image.mask(), image.global_mask(),
+                                 level > 0, grady, gradx, packed);
+        });
+    }
+}
+
+void PyramidBuilder::_for_each_band(int height, const std::function<void(int, int)> &func) const {
+    int nr_bands = 1;
+    if (m_thread_pool != nullptr && m_thread_pool->nr_threads() > 1) {
+        nr_bands = std::max(1, std::min(height / kMinBandRows, 4 * m_thread_pool->nr_threads()));
+    }
+    if (nr_bands == 1) {
+        func(0, height);
+        return;
+    }
+    m_thread_pool->parallel_for(0, nr_bands, [&](int band) {
+        func(height * band / nr_bands, height * (band + 1) / nr_bands);
+    });
+}
+
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "masked_image.h"
+#include "thread_pool.h"
+
+/**
+ * Builds the image pyramid of the inpainting: every level is the masked downsampling of the one below (see
+ * MaskedImage::downsample), with its gradients and, given a border, its packed features, all bit-identical to the
+ * lazy per-level computations. Each level is produced in one pass over bands of rows run concurrently on the pool:
+ * a band downsamples its rows (plus the row above and below it, which it keeps to itself), then derives their
+ * gradients and packed features while they are still in cache. The rows are read through raw pointers, and the
+ * vertical pass of the kernel and the gradients use the dispatched SIMD row kernels.
+ */
+class PyramidBuilder {
+public:
+    // A border of zero skips the packed features.
+    PyramidBuilder(ThreadPool *pool, int packed_border) : m_thread_pool(pool), m_packed_border(packed_border) {
+        // pass
+    }
+
+    // The levels 0 (a shallow copy of the image) to at most max_level; a level is only downsampled further while
+    // both its sides are larger than min_size.
+    std::vector<MaskedImage> build(const MaskedImage &image, int max_level, int min_size) const;
+
+    // The next level, with its features.
+    MaskedImage downsample(const MaskedImage &source) const;
+    // Computes the features of the image that are missing.
+    void prepare(MaskedImage &image) const;
+    // Brings levels built by build() up to date after the mask of level 0 changed in its rows [y_begin, y_end), its
+    // image and global mask being unchanged: only the rows of every level that depend on those rows are recomputed.
+    // The mask of level 0 must already hold the new values. The images, masks and gradients of the levels are
+    // rewritten in place, so their shallow copies see the new rows too; the packed features are copied first if shared.
+    void update(std::vector<MaskedImage> &levels, int y_begin, int y_end) const;
+
+    static const int kMinBandRows = 16;
+
+private:
+    void _for_each_band(int height, const std::function<void(int, int)> &func) const;
+
+    ThreadPool *m_thread_pool;
+    int m_packed_border;
+};
+
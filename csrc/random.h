@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * Counter-based random numbers: every value is a pure function of a key and a counter (the SplitMix64 finalizer
+ * applied to their combination), instead of the next state of a sequential generator. Keys are derived by hashing
+ * the coordinates of a draw, e.g. (seed, level, EM iteration, pass, pixel), so the numbers a pixel gets do not
+ * depend on the order in which the pixels are visited, on the tiling or on the number of threads.
+ */
+
+inline uint64_t random_mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// The key of the sub-stream number value of key.
+inline uint64_t random_key(uint64_t key, uint64_t value) {
+    return random_mix(key ^ random_mix(value + 0x9e3779b97f4a7c15ULL));
+}
+
+class CounterRandom {
+public:
+    explicit CounterRandom(uint64_t key) : m_key(key), m_counter(0) {
+        // pass
+    }
+
+    // A uniform non-negative int (31 bits).
+    inline int operator ()() {
+        return static_cast<int>(random_mix(m_key + (++m_counter) * 0x9e3779b97f4a7c15ULL) >> 33);
+    }
+
+private:
+    uint64_t m_key;
+    uint64_t m_counter;
+};
+
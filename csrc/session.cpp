@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+
+#include "pyramid.h"
+#include "session.h"
+
+InpaintingSession::InpaintingSession(cv::Mat image, const PatchDistanceMetric *metric)
+    : InpaintingSession(image, cv::Mat(), metric) {
+    // pass
+}
+
+InpaintingSession::InpaintingSession(cv::Mat image, cv::Mat global_mask, const PatchDistanceMetric *metric)
+    : m_image(image), m_global_mask(global_mask), m_mask(), m_distance_metric(metric), m_thread_pool(&ThreadPool::global()), m_options(),
+      m_progress_callback(), m_level_sink(), m_level_sink_full_size(false), m_cancel_flag(nullptr), m_cancelled(false),
+      m_stats_enabled(false), m_stats(), m_pyramid(), m_pyramid_max_level(-1), m_fields() {
+    // pass
+}
+
+cv::Mat InpaintingSession::inpaint(const cv::Mat &mask, bool verbose, unsigned int random_seed) {
+    assert(mask.type() == CV_8U && mask.size() == m_image.size());
+    const auto start = Inpainting::Clock::now();
+    const int patch_size = m_distance_metric->patch_size();
+    const int max_level = m_options.max_pyramid_levels < 0 ? std::numeric_limits<int>::max() : m_options.max_pyramid_levels;
+    const PyramidBuilder builder(m_thread_pool, patch_size + 1);
+
+    if (m_pyramid.empty() || max_level != m_pyramid_max_level) {
+        m_mask = mask.clone();
+        const MaskedImage level0 = m_global_mask.empty() ? MaskedImage(m_image, m_mask) : MaskedImage(m_image, m_mask, m_global_mask);
+        m_pyramid = builder.build(level0, max_level, patch_size);
+        m_pyramid_max_level = max_level;
+        m_fields = InpaintingFields();
+    } else {
+        const cv::Rect changed = _apply_mask(mask);
+        if (changed.area() > 0) {
+            builder.update(m_pyramid, changed.y, changed.y + changed.height);
+            _invalidate_fields(changed);
+        }
+        if (verbose) std::cerr << "Inpainting session: the mask changed within " << changed.width << "x" << changed.height << " pixels." << std::endl;
+    }
+    const double pyramid_seconds = std::chrono::duration<double>(Inpainting::Clock::now() - start).count();
+
+    std::unique_ptr<Inpainting> inpainting;
+    if (m_global_mask.empty()) inpainting.reset(new Inpainting(m_image, m_mask, m_distance_metric));
+    else inpainting.reset(new Inpainting(m_image, m_mask, m_global_mask, m_distance_metric));
+    inpainting->set_thread_pool(m_thread_pool);
+    inpainting->set_options(m_options);
+    inpainting->set_progress_callback(m_progress_callback);
+    inpainting->set_level_sink(m_level_sink, m_level_sink_full_size);
+    inpainting->set_cancel_flag(m_cancel_flag);
+    inpainting->set_stats_enabled(m_stats_enabled);
+    inpainting->set_pyramid(m_pyramid);
+    inpainting->set_keep_fields(true);
+    inpainting->set_warm_start(m_fields);
+
+    cv::Mat result = inpainting->run(verbose, false, random_seed);
+    m_cancelled = inpainting->cancelled();
+    if (m_stats_enabled) {
+        m_stats = inpainting->stats();
+        m_stats.pyramid_seconds += pyramid_seconds;
+        m_stats.seconds += pyramid_seconds;
+    }
+    m_fields = inpainting->fields();
+    return result;
+}
+
+void InpaintingSession::reset() {
+    m_fields = InpaintingFields();
+}
+
+cv::Rect InpaintingSession::_apply_mask(const cv::Mat &mask) {
+    const cv::Size size = m_mask.size();
+    int y_begin = size.height, y_end = 0, x_begin = size.width, x_end = 0;
+    for (int y = 0; y < size.height; ++y) {
+        unsigned char *row = m_mask.ptr<unsigned char>(y);
+        const unsigned char *new_row = mask.ptr<unsigned char>(y);
+        if (std::memcmp(row, new_row, size.width) == 0) continue;
+
+        int x_first = 0, x_last = size.width - 1;
+        while (row[x_first] == new_row[x_first]) ++x_first;
+        while (row[x_last] == new_row[x_last]) --x_last;
+        std::memcpy(row + x_first, new_row + x_first, x_last + 1 - x_first);
+        y_begin = std::min(y_begin, y), y_end = y + 1;
+        x_begin = std::min(x_begin, x_first), x_end = std::max(x_end, x_last + 1);
+    }
+    if (y_begin >= y_end) return cv::Rect();
+    return cv::Rect(x_begin, y_begin, x_end - x_begin, y_end - y_begin);
+}
+
+void InpaintingSession::_invalidate_fields(const cv::Rect &changed) {
+    // The changed rows of a level spread by up to 2 pixels over the levels below it (see PyramidBuilder::update),
+    // then by one more for the gradients, and a patch reads patch_size pixels around its center.
+    const int margin = m_distance_metric->patch_size() + 3;
+    for (int direction = 0; direction < 2; ++direction) {
+        auto &fields = direction == 0 ? m_fields.source2target : m_fields.target2source;
+        for (size_t level = 0; level < fields.size(); ++level) {
+            cv::Mat &field = fields[level];
+            if (field.empty()) continue;
+            const int y_begin = std::max(0, (changed.y >> level) - margin);
+            const int y_end = std::min(field.rows, ((changed.y + changed.height - 1) >> level) + 1 + margin);
+            const int x_begin = std::max(0, (changed.x >> level) - margin);
+            const int x_end = std::min(field.cols, ((changed.x + changed.width - 1) >> level) + 1 + margin);
+            for (int y = y_begin; y < y_end; ++y) {
+                int *row = field.ptr<int>(y);
+                for (int x = x_begin; x < x_end; ++x) row[3 * x] = NearestNeighborField::kInvalidMatch;
+            }
+        }
+    }
+}
+
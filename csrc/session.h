@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "inpaint.h"
+#include "masked_image.h"
+#include "nnf.h"
+#include "thread_pool.h"
+
+/**
+ * Inpaints one image again and again as its mask changes, e.g. under the brush of an editor. The session keeps the
+ * pyramid of the image with its features and the fields of the last solution. When the mask changes, only the rows of
+ * every level that depend on the changed rows are recomputed (see PyramidBuilder::update), and the fields only lose
+ * their matches around the changed pixels: those start from the coarser level, the others from the last solution,
+ * with the short schedule of the InpaintingOptions::warm_* options (see Inpainting::set_warm_start).
+ */
+class InpaintingSession {
+public:
+    InpaintingSession(cv::Mat image, const PatchDistanceMetric *metric);
+    InpaintingSession(cv::Mat image, cv::Mat global_mask, const PatchDistanceMetric *metric);
+
+    // Inpaints the image with the given mask, a CV_8U map of its size. The mask is copied: the caller may change it
+    // in place between two calls.
+    cv::Mat inpaint(const cv::Mat &mask, bool verbose = false, unsigned int random_seed = 1212);
+    // Forgets the last solution: the next call starts its fields from scratch (the pyramid is kept).
+    void reset();
+
+    // As in Inpainting, for every call.
+    inline void set_thread_pool(ThreadPool *pool) {
+        m_thread_pool = pool;
+    }
+    inline void set_options(const InpaintingOptions &options) {
+        m_options = options;
+    }
+    inline void set_progress_callback(Inpainting::ProgressCallback callback) {
+        m_progress_callback = std::move(callback);
+    }
+    inline void set_level_sink(Inpainting::LevelSink sink, bool full_size = false) {
+        m_level_sink = std::move(sink);
+        m_level_sink_full_size = full_size;
+    }
+    // A cancelled call keeps the fields of the levels it completed only.
+    inline void set_cancel_flag(const std::atomic<bool> *flag) {
+        m_cancel_flag = flag;
+    }
+    inline bool cancelled() const {
+        return m_cancelled;
+    }
+    inline void set_stats_enabled(bool value) {
+        m_stats_enabled = value;
+    }
+    // Of the last call with stats enabled; pyramid_seconds covers the update of the kept pyramid.
+    inline const InpaintingStats &stats() const {
+        return m_stats;
+    }
+
+private:
+    // Copies the rows of mask that differ into m_mask; returns the bounding box of the changed pixels.
+    cv::Rect _apply_mask(const cv::Mat &mask);
+    // Invalidates the matches of the fields whose patches may overlap the changed pixels, at every level.
+    void _invalidate_fields(const cv::Rect &changed);
+
+    cv::Mat m_image;
+    cv::Mat m_global_mask;
+    cv::Mat m_mask;  // Of the last call; level 0 of the pyramid.
+    const PatchDistanceMetric *m_distance_metric;
+    ThreadPool *m_thread_pool;
+    InpaintingOptions m_options;
+    Inpainting::ProgressCallback m_progress_callback;
+    Inpainting::LevelSink m_level_sink;
+    bool m_level_sink_full_size;
+    const std::atomic<bool> *m_cancel_flag;
+    bool m_cancelled;
+    bool m_stats_enabled;
+    InpaintingStats m_stats;
+
+    std::vector<MaskedImage> m_pyramid;  // Empty before the first call.
+    int m_pyramid_max_level;  // The level limit it was built with.
+    InpaintingFields m_fields;  // Of the last solution.
+};
+
@@ -0,0 +1,156 @@
+#include <algorithm>
+
+#include "thread_pool.h"
+
+namespace {
+    std::mutex kGlobalPoolMutex;
+    std::unique_ptr<ThreadPool> kGlobalPool;
+}
+
+ThreadPool::ThreadPool(int nr_threads) : m_workers(), m_nr_workers(0), m_queue(), m_nr_active(0) {
+    resize(nr_threads);
+}
+
+ThreadPool::~ThreadPool() {
+    _set_nr_workers(0);
+}
+
+void ThreadPool::resize(int nr_threads) {
+    if (nr_threads <= 0) nr_threads = hardware_nr_threads();
+    _set_nr_workers(nr_threads - 1);
+}
+
+void ThreadPool::_set_nr_workers(int nr_workers) {
+    std::lock_guard<std::mutex> resize_lock(m_resize_mutex);
+    const int current = static_cast<int>(m_workers.size());
+    if (nr_workers == current) return;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_nr_active = nr_workers;
+    }
+    m_nr_workers = nr_workers;
+
+    if (nr_workers < current) {
+        m_cond.notify_all();
+        for (int i = nr_workers; i < current; ++i) m_workers[i].join();
+        m_workers.resize(nr_workers);
+    } else {
+        for (int i = current; i < nr_workers; ++i) {
+            m_workers.emplace_back(&ThreadPool::_worker_loop, this, i);
+        }
+    }
+}
+
+int ThreadPool::hardware_nr_threads() {
+    int nr_threads = static_cast<int>(std::thread::hardware_concurrency());
+    return std::max(nr_threads, 1);
+}
+
+ThreadPool &ThreadPool::global() {
+    std::lock_guard<std::mutex> lock(kGlobalPoolMutex);
+    if (!kGlobalPool) kGlobalPool.reset(new ThreadPool());
+    return *kGlobalPool;
+}
+
+void ThreadPool::set_global_nr_threads(int nr_threads) {
+    ThreadPool *pool;
+    {
+        std::lock_guard<std::mutex> lock(kGlobalPoolMutex);
+        if (!kGlobalPool) {
+            kGlobalPool.reset(new ThreadPool(nr_threads));
+            return;
+        }
+        pool = kGlobalPool.get();
+    }
+    // Outside of the lock: a task of the pool that is waited for may be calling global().
+    pool->resize(nr_threads);
+}
+
+void ThreadPool::parallel_for(int begin, int end, const std::function<void(int)> &func) {
+    if (end <= begin) return;
+    if (m_nr_workers.load() == 0 || end - begin == 1) {
+        for (int i = begin; i < end; ++i) func(i);
+        return;
+    }
+
+    auto batch = std::make_shared<Batch>();
+    batch->func = &func;
+    batch->begin = begin, batch->end = end;
+    batch->next = begin;
+    batch->nr_done = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(batch);
+    }
+    m_cond.notify_all();
+
+    _run_batch(*batch);
+    _retire_batch(batch);
+
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->cond.wait(lock, [&batch, begin, end]() { return batch->nr_done.load() == end - begin; });
+}
+
+void ThreadPool::_worker_loop(int index) {
+    while (true) {
+        std::shared_ptr<Batch> batch;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this, index]() { return index >= m_nr_active || !m_queue.empty(); });
+            if (index >= m_nr_active) return;
+            batch = m_queue.front();
+        }
+        _run_batch(*batch);
+        _retire_batch(batch);
+    }
+}
+
+void ThreadPool::_run_batch(Batch &batch) {
+    const int count = batch.end - batch.begin;
+    while (true) {
+        int i = batch.next.fetch_add(1);
+        if (i >= batch.end) break;
+        (*batch.func)(i);
+        if (batch.nr_done.fetch_add(1) + 1 == count) {
+            std::lock_guard<std::mutex> lock(batch.mutex);
+            batch.cond.notify_all();
+        }
+    }
+}
+
+void ThreadPool::_retire_batch(const std::shared_ptr<Batch> &batch) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = std::find(m_queue.begin(), m_queue.end(), batch);
+    if (it != m_queue.end()) m_queue.erase(it);
+}
+
+int TaskGraph::add_task(std::function<void()> func, const std::vector<int> &dependencies) {
+    int depth = 0;
+    for (int dep : dependencies) {
+        depth = std::max(depth, m_depths[dep] + 1);
+    }
+    m_tasks.emplace_back(std::move(func));
+    m_depths.push_back(depth);
+    return static_cast<int>(m_tasks.size()) - 1;
+}
+
+void TaskGraph::run(ThreadPool *pool) {
+    int max_depth = -1;
+    for (int depth : m_depths) max_depth = std::max(max_depth, depth);
+
+    std::vector<int> stage;
+    for (int depth = 0; depth <= max_depth; ++depth) {
+        stage.clear();
+        for (int i = 0; i < static_cast<int>(m_tasks.size()); ++i) {
+            if (m_depths[i] == depth) stage.push_back(i);
+        }
+
+        if (pool == nullptr) {
+            for (int i : stage) m_tasks[i]();
+        } else {
+            pool->parallel_for(0, static_cast<int>(stage.size()), [this, &stage](int i) { m_tasks[stage[i]](); });
+        }
+    }
+}
+
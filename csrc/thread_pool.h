@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A minimal fork-join worker pool.
+ * parallel_for blocks until all indices are processed; the calling thread takes part in the work, so nested
+ * calls (from inside a running task) are safe and never deadlock. The pool can be resized while it is in use:
+ * the running batches simply go on with the workers that are left.
+ */
+class ThreadPool {
+public:
+    explicit ThreadPool(int nr_threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator =(const ThreadPool &) = delete;
+
+    inline int nr_threads() const {
+        return m_nr_workers.load() + 1;
+    }
+
+    void parallel_for(int begin, int end, const std::function<void(int)> &func);
+    // Changes the number of threads in place (0 for one per core). Removed workers finish their current batch
+    // first; must not be called from a task of the pool itself.
+    void resize(int nr_threads);
+
+    static int hardware_nr_threads();
+    // The pool lives until the program exits: set_global_nr_threads resizes it, so references to it stay valid.
+    static ThreadPool &global();
+    static void set_global_nr_threads(int nr_threads);
+
+private:
+    struct Batch {
+        const std::function<void(int)> *func;
+        int begin, end;
+        std::atomic<int> next;
+        std::atomic<int> nr_done;
+        std::mutex mutex;
+        std::condition_variable cond;
+    };
+
+    void _set_nr_workers(int nr_workers);
+    void _worker_loop(int index);
+    void _run_batch(Batch &batch);
+    void _retire_batch(const std::shared_ptr<Batch> &batch);
+
+    std::vector<std::thread> m_workers;  // Guarded by m_resize_mutex.
+    std::mutex m_resize_mutex;
+    std::atomic<int> m_nr_workers;
+    std::deque<std::shared_ptr<Batch>> m_queue;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    int m_nr_active;  // Guarded by m_mutex: the workers from this index on exit.
+};
+
+/**
+ * A tiny static task graph. Tasks are grouped into stages by their dependency depth; the tasks of a stage run
+ * concurrently on the pool and a stage only starts once the previous one has finished. The result is thus as
+ * deterministic as the tasks themselves.
+ */
+class TaskGraph {
+public:
+    TaskGraph() : m_tasks(), m_depths() {
+        // pass
+    }
+
+    int add_task(std::function<void()> func, const std::vector<int> &dependencies = std::vector<int>());
+    void run(ThreadPool *pool);
+
+private:
+    std::vector<std::function<void()>> m_tasks;
+    std::vector<int> m_depths;
+};
+
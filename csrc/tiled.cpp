@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+#include "active_set.h"
+#include "components.h"
+#include "inpaint.h"
+#include "tiled.h"
+
+/**
+ * Out-of-core inpainting (see tiled.h).
+ */
+
+namespace {
+
+// The rows streamed at once when copying the image or labeling the mask, before their pages are released.
+const size_t kStripBytes = size_t(16) << 20;
+// See TiledInpainting::crop_memory: the crop and its pyramid (image, masks, gradients and packed features, x4/3),
+// the two NNFs, the two vote buffers and the target, per pixel of the finest level.
+const size_t kCropBytesPerPixel = 192;
+
+int strip_rows(size_t row_bytes) {
+    return static_cast<int>(std::max<size_t>(1, kStripBytes / row_bytes));
+}
+
+}
+
+TiledInpainting::TiledInpainting(const std::string &image_path, const std::string &mask_path, const std::string &global_mask_path,
+                                 const std::string &output_path, cv::Size size, const PatchDistanceMetric *metric)
+    : m_image_path(image_path), m_mask_path(mask_path), m_global_mask_path(global_mask_path), m_output_path(output_path), m_size(size),
+      m_distance_metric(metric), m_thread_pool(&ThreadPool::global()), m_options(), m_memory_budget(kDefaultMemoryBudget),
+      m_over_budget(false), m_image(), m_mask(), m_global_mask(), m_output(), m_crops() {
+    // pass
+}
+
+size_t TiledInpainting::crop_memory(cv::Size crop) {
+    return static_cast<size_t>(crop.area()) * kCropBytesPerPixel;
+}
+
+bool TiledInpainting::_map_masks() {
+    const size_t nr_pixels = static_cast<size_t>(m_size.width) * m_size.height;
+    if (!m_mask.open(m_mask_path, nr_pixels)) return false;
+    return m_global_mask_path.empty() || m_global_mask.open(m_global_mask_path, nr_pixels);
+}
+
+bool TiledInpainting::_map_images() {
+    const size_t nr_pixels = static_cast<size_t>(m_size.width) * m_size.height;
+    // The jobs read their crop from the output: the crops are disjoint, so it still holds the input there.
+    if (m_output_path.empty()) return m_output.open(m_image_path, nr_pixels * 3, true);
+    return m_image.open(m_image_path, nr_pixels * 3) && m_output.create(m_output_path, nr_pixels * 3);
+}
+
+void TiledInpainting::_copy_image() {
+    const size_t row_bytes = static_cast<size_t>(m_size.width) * 3;
+    const int nr_rows = strip_rows(row_bytes);
+    for (int y = 0; y < m_size.height; y += nr_rows) {
+        const size_t offset = y * row_bytes, length = std::min(nr_rows, m_size.height - y) * row_bytes;
+        memcpy(m_output.data() + offset, m_image.data() + offset, length);
+        m_image.release(offset, length);
+        m_output.release(offset, length);
+    }
+    m_image.close();
+}
+
+void TiledInpainting::_initialize_crops() {
+    const size_t row_bytes = static_cast<size_t>(m_size.width);
+    const int nr_rows = strip_rows(row_bytes);
+
+    // Rows are requested in order: release every strip once the labeling is past it.
+    auto row_func = [this, row_bytes, nr_rows](MappedFile &file) {
+        return [&file, row_bytes, nr_rows](int y) -> const unsigned char * {
+            if (y > 0 && y % nr_rows == 0) file.release((y - nr_rows) * row_bytes, nr_rows * row_bytes);
+            return file.data() + y * row_bytes;
+        };
+    };
+    MaskRowFunc mask_row = row_func(m_mask);
+    MaskRowFunc global_mask_row = [](int) -> const unsigned char * { return nullptr; };
+    if (m_global_mask.is_open()) global_mask_row = row_func(m_global_mask);
+
+    auto boxes = hole_component_boxes(m_size, mask_row, global_mask_row);
+    m_crops = component_crops(boxes, m_size, m_distance_metric->patch_size());
+    m_mask.release(0, m_mask.size());
+    m_global_mask.release(0, m_global_mask.size());
+}
+
+bool TiledInpainting::run(bool verbose, unsigned int random_seed) {
+    m_over_budget = false;
+    if (!_map_masks()) {
+        if (verbose) std::cerr << "Tiled inpainting: cannot map the mask files." << std::endl;
+        m_mask.close(), m_global_mask.close();
+        return false;
+    }
+    _initialize_crops();
+
+    // The crops are sorted largest first.
+    if (!m_crops.empty() && crop_memory(m_crops[0].size()) > m_memory_budget) {
+        if (verbose) {
+            const cv::Rect &crop = m_crops[0];
+            std::cerr << "Tiled inpainting: the " << crop.width << "x" << crop.height << " crop at (" << crop.x << ", " << crop.y << ") needs about "
+                      << (crop_memory(crop.size()) >> 20) << " MB, over the memory budget of " << (m_memory_budget >> 20) << " MB." << std::endl;
+        }
+        m_over_budget = true;
+        m_mask.close(), m_global_mask.close();
+        return false;
+    }
+
+    // Mapped once the crops are known to fit, so that a failed run does not create the output.
+    if (!_map_images()) {
+        if (verbose) std::cerr << "Tiled inpainting: cannot map the image files." << std::endl;
+        m_image.close(), m_mask.close(), m_global_mask.close(), m_output.close();
+        return false;
+    }
+    if (m_image.is_open()) _copy_image();
+
+    const int nr_jobs = static_cast<int>(m_crops.size());
+    if (verbose) std::cerr << "Tiled inpainting: " << nr_jobs << " job(s), memory budget " << (m_memory_budget >> 20) << " MB." << std::endl;
+
+    // Every worker takes the next job and waits until its memory fits in what the running ones leave.
+    std::mutex mutex;
+    std::condition_variable cond;
+    size_t in_use = 0;
+    int next = 0;
+    auto worker = [&](int) {
+        for (;;) {
+            int k;
+            size_t memory;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (next == nr_jobs) return;
+                k = next++;
+                memory = crop_memory(m_crops[k].size());
+                cond.wait(lock, [&] { return in_use + memory <= m_memory_budget; });
+                in_use += memory;
+            }
+            if (verbose) {
+                const cv::Rect &crop = m_crops[k];
+                std::lock_guard<std::mutex> lock(mutex);
+                std::cerr << "  Job " << k << ": " << crop.width << "x" << crop.height << " at (" << crop.x << ", " << crop.y << ")." << std::endl;
+            }
+
+            _run_job(k, random_seed + static_cast<unsigned int>(k) * 2654435761u);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                in_use -= memory;
+            }
+            cond.notify_all();
+        }
+    };
+
+    if (m_thread_pool == nullptr) {
+        worker(0);
+    } else {
+        m_thread_pool->parallel_for(0, m_thread_pool->nr_threads(), worker);
+    }
+
+    bool ok = m_output.sync();
+    m_mask.close(), m_global_mask.close(), m_output.close();
+    return ok;
+}
+
+void TiledInpainting::_run_job(int index, unsigned int random_seed) {
+    const cv::Rect &crop = m_crops[index];
+    const size_t row_bytes = static_cast<size_t>(m_size.width);
+    const size_t rows_offset = crop.y * row_bytes, rows_length = crop.height * row_bytes;
+
+    cv::Mat image(crop.size(), CV_8UC3), mask(crop.size(), CV_8UC1), global_mask;
+    for (int i = 0; i < crop.height; ++i) {
+        const size_t offset = (crop.y + i) * row_bytes + crop.x;
+        memcpy(image.ptr<unsigned char>(i), m_output.data() + offset * 3, crop.width * 3);
+        memcpy(mask.ptr<unsigned char>(i), m_mask.data() + offset, crop.width);
+    }
+    m_mask.release(rows_offset, rows_length);
+    if (m_global_mask.is_open()) {
+        global_mask.create(crop.size(), CV_8UC1);
+        for (int i = 0; i < crop.height; ++i) {
+            memcpy(global_mask.ptr<unsigned char>(i), m_global_mask.data() + (crop.y + i) * row_bytes + crop.x, crop.width);
+        }
+        m_global_mask.release(rows_offset, rows_length);
+    }
+
+    std::unique_ptr<Inpainting> job;
+    if (global_mask.empty()) job.reset(new Inpainting(image, mask, m_distance_metric));
+    else job.reset(new Inpainting(image, mask, global_mask, m_distance_metric));
+    job->set_thread_pool(m_thread_pool);
+    job->set_options(m_options);
+    cv::Mat result = job->run(false, false, random_seed);
+    job.reset();
+
+    // Write back the pixels the inpainting may change: those whose patch touches the hole.
+    const MaskedImage source = global_mask.empty() ? MaskedImage(image, mask) : MaskedImage(image, mask, global_mask);
+    const ActiveSet changed(source, m_distance_metric->patch_size());
+    for (const auto &span : changed.spans()) {
+        const size_t offset = (crop.y + span.y) * row_bytes + crop.x + span.x_begin;
+        memcpy(m_output.data() + offset * 3, result.ptr<unsigned char>(span.y, span.x_begin), (span.x_end - span.x_begin) * 3);
+    }
+    m_output.release(rows_offset * 3, rows_length * 3);
+}
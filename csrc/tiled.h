@@ -0,0 +1,84 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "inpaint.h"
+#include "mapped_file.h"
+#include "nnf.h"
+#include "thread_pool.h"
+
+/**
+ * Out-of-core inpainting of images too large to hold in memory.
+ * The image, the mask and the optional global mask are raw files, memory mapped: the image is height x width x 3
+ * bytes, the masks height x width bytes (non-zero is masked), row-major and without padding, as written by
+ * numpy.ndarray.tofile. The hole is split into the crops of ComponentInpainting (found by streaming over the mask
+ * rows) and every crop is read, inpainted and written back to the mapped output on its own, so only the crops in
+ * flight and the pages around them are resident.
+ *
+ * The memory budget bounds the estimated memory of the crops in flight: a crop only starts once it fits in what
+ * the running ones leave, so a smaller budget means fewer concurrent crops. If a single crop does not fit in the
+ * budget, nothing is inpainted (see over_budget). The result is identical to ComponentInpainting with the same seed.
+ */
+class TiledInpainting {
+public:
+    // An empty global_mask_path means no global mask; an empty output_path inpaints the image file in place.
+    TiledInpainting(const std::string &image_path, const std::string &mask_path, const std::string &global_mask_path,
+                    const std::string &output_path, cv::Size size, const PatchDistanceMetric *metric);
+    // Returns false if the files cannot be mapped (missing, or smaller than the size implies), or if the largest crop
+    // does not fit in the memory budget; the output is then left untouched.
+    bool run(bool verbose = false, unsigned int random_seed = 1212);
+    // Whether the last run failed because of the memory budget.
+    inline bool over_budget() const {
+        return m_over_budget;
+    }
+
+    inline void set_thread_pool(ThreadPool *pool) {
+        m_thread_pool = pool;
+    }
+    // The options of every job.
+    inline void set_options(const InpaintingOptions &options) {
+        m_options = options;
+    }
+    inline void set_memory_budget(size_t bytes) {
+        m_memory_budget = bytes;
+    }
+    inline size_t memory_budget() const {
+        return m_memory_budget;
+    }
+    // The crop of every job, largest first (available after run).
+    inline const std::vector<cv::Rect> &crops() const {
+        return m_crops;
+    }
+
+    // A rough upper estimate of the peak memory of inpainting a crop: the crop, its pyramid, the NNFs and the votes.
+    static size_t crop_memory(cv::Size crop);
+
+    static const size_t kDefaultMemoryBudget = size_t(1) << 30;
+
+private:
+    bool _map_masks();
+    bool _map_images();
+    void _copy_image();
+    void _initialize_crops();
+    void _run_job(int index, unsigned int random_seed);
+
+    std::string m_image_path;
+    std::string m_mask_path;
+    std::string m_global_mask_path;
+    std::string m_output_path;
+    cv::Size m_size;
+    const PatchDistanceMetric *m_distance_metric;
+    ThreadPool *m_thread_pool;
+    InpaintingOptions m_options;
+    size_t m_memory_budget;
+    bool m_over_budget;
+
+    MappedFile m_image;
+    MappedFile m_mask;
+    MappedFile m_global_mask;
+    MappedFile m_output;
+    std::vector<cv::Rect> m_crops;
+};
+
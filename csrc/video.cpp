@@ -0,0 +1,34 @@
+#include <iostream>
+#include <memory>
+
+#include "video.h"
+
+cv::Mat VideoInpainting::next_frame(cv::Mat image, cv::Mat mask, cv::Mat global_mask, const cv::Mat &motion, bool verbose, unsigned int random_seed) {
+    std::unique_ptr<Inpainting> inpainting;
+    if (global_mask.empty()) inpainting.reset(new Inpainting(image, mask, m_distance_metric));
+    else inpainting.reset(new Inpainting(image, mask, global_mask, m_distance_metric));
+    inpainting->set_thread_pool(m_thread_pool);
+    inpainting->set_options(m_options);
+    inpainting->set_progress_callback(m_progress_callback);
+    inpainting->set_level_sink(m_level_sink, m_level_sink_full_size);
+    inpainting->set_cancel_flag(m_cancel_flag);
+    inpainting->set_stats_enabled(m_stats_enabled);
+    inpainting->set_keep_fields(true);
+
+    const bool has_motion = !motion.empty() && motion.type() == CV_32FC2 && motion.size() == image.size();
+    inpainting->set_warm_start(m_fields, has_motion ? motion : cv::Mat());
+    if (verbose) std::cerr << "Video inpainting: frame " << m_nr_frames << (has_motion ? ", motion compensated." : ".") << std::endl;
+
+    cv::Mat result = inpainting->run(verbose, false, random_seed);
+    m_cancelled = inpainting->cancelled();
+    if (m_stats_enabled) m_stats = inpainting->stats();
+    m_fields = inpainting->fields();
+    ++m_nr_frames;
+    return result;
+}
+
+void VideoInpainting::reset() {
+    m_fields = InpaintingFields();
+    m_nr_frames = 0;
+}
+
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <opencv2/core.hpp>
+
+#include "inpaint.h"
+#include "nnf.h"
+#include "thread_pool.h"
+
+/**
+ * Inpaints the frames of a video, one after the other. Every frame keeps the fields of its pyramid levels, and the
+ * fields of the next frame start from them (see Inpainting::set_warm_start), moved by the motion between the frames
+ * if it is given, instead of from random draws at the coarsest level. The warm-started levels only run the short,
+ * local schedule of the InpaintingOptions::warm_* options, and the matches, hence the fills, carry over from frame
+ * to frame. A level only starts warm if it has the size it had in the previous frame: a frame of another size, or
+ * whose hole needs another pyramid depth, starts its new levels from scratch.
+ */
+class VideoInpainting {
+public:
+    explicit VideoInpainting(const PatchDistanceMetric *metric)
+        : m_distance_metric(metric), m_thread_pool(&ThreadPool::global()), m_options(), m_progress_callback(), m_level_sink(), m_level_sink_full_size(false),
+          m_cancel_flag(nullptr), m_cancelled(false), m_stats_enabled(false), m_stats(), m_fields(), m_nr_frames(0) {
+        // pass
+    }
+
+    // Inpaints the next frame. motion is empty, or a CV_32FC2 map of the size of the frame holding, for every pixel,
+    // the offset (dx, dy) to the same content in the previous frame (backward optical flow); a map of another size or
+    // type is ignored. Every frame uses the same seed, so that the random searches agree from frame to frame too.
+    cv::Mat next_frame(cv::Mat image, cv::Mat mask, cv::Mat global_mask = cv::Mat(), const cv::Mat &motion = cv::Mat(),
+                       bool verbose = false, unsigned int random_seed = 1212);
+    // Forgets the previous frame, e.g. at a scene cut: the next one starts from scratch.
+    void reset();
+    // The frames inpainted since the last reset.
+    inline int nr_frames() const {
+        return m_nr_frames;
+    }
+
+    // As in Inpainting, for every frame.
+    inline void set_thread_pool(ThreadPool *pool) {
+        m_thread_pool = pool;
+    }
+    inline void set_options(const InpaintingOptions &options) {
+        m_options = options;
+    }
+    inline void set_progress_callback(Inpainting::ProgressCallback callback) {
+        m_progress_callback = std::move(callback);
+    }
+    inline void set_level_sink(Inpainting::LevelSink sink, bool full_size = false) {
+        m_level_sink = std::move(sink);
+        m_level_sink_full_size = full_size;
+    }
+    // A cancelled frame keeps the fields of the levels it completed only.
+    inline void set_cancel_flag(const std::atomic<bool> *flag) {
+        m_cancel_flag = flag;
+    }
+    inline bool cancelled() const {
+        return m_cancelled;
+    }
+    inline void set_stats_enabled(bool value) {
+        m_stats_enabled = value;
+    }
+    // Of the last frame with stats enabled.
+    inline const InpaintingStats &stats() const {
+        return m_stats;
+    }
+
+private:
+    const PatchDistanceMetric *m_distance_metric;
+    ThreadPool *m_thread_pool;
+    InpaintingOptions m_options;
+    Inpainting::ProgressCallback m_progress_callback;
+    Inpainting::LevelSink m_level_sink;
+    bool m_level_sink_full_size;
+    const std::atomic<bool> *m_cancel_flag;
+    bool m_cancelled;
+    bool m_stats_enabled;
+    InpaintingStats m_stats;
+    InpaintingFields m_fields;  // Of the previous frame.
+    int m_nr_frames;
+};
+
@@ -9,7 +9,7 @@
 
 import ctypes
 import os.path as osp
-from typing import Optional, Union
+from typing import Callable, List, Optional, Sequence, Union
 
 import numpy as np
 from PIL import Image
@@ -25,7 +25,7 @@ except ImportError as e:
     subprocess.check_call(['./travis.sh'], cwd=osp.dirname(__file__))
 
 
-__all__ = ['set_random_seed', 'set_verbose', 'inpaint', 'inpaint_regularity']
+__all__ = ['set_random_seed', 'set_verbose', 'set_nr_threads', 'get_nr_threads', 'get_isa', 'set_isa', 'inpaint', 'inpaint_batch', 'inpaint_regularity', 'inpaint_file', 'Context', 'InpaintingOptions']
 
 
 class CShapeT(ctypes.Structure):
@@ -40,7 +40,86 @@ class CMatT(ctypes.Structure):
     _fields_ = [
         ('data_ptr', ctypes.c_void_p),
         ('shape', CShapeT),
-        ('dtype', ctypes.c_int)
+        ('dtype', ctypes.c_int),
+        ('stride', ctypes.c_size_t)
+    ]
+
+
+class InpaintingOptions(ctypes.Structure):
+    """
+    The tuning knobs of the inpainting (see `InpaintingOptions` in csrc/inpaint.h). Start from a preset, e.g.
+    `InpaintingOptions.preset('fast')`, and adjust the fields; `InpaintingOptions()` is the balanced preset.
+    """
+
+    _fields_ = [
+        ('max_retry', ctypes.c_int),
+        ('em_iterations_base', ctypes.c_int),
+        ('em_iterations_per_level', ctypes.c_int),
+        ('nnf_passes_base', ctypes.c_int),
+        ('nnf_passes_per_level', ctypes.c_int),
+        ('max_nnf_passes', ctypes.c_int),
+        ('nnf_tolerance', ctypes.c_double),
+        ('em_tolerance', ctypes.c_double),
+        ('hole_aware_pyramid', ctypes.c_int),
+        ('max_pyramid_levels', ctypes.c_int),
+        ('similarity_sharpness', ctypes.c_double),
+        ('time_budget', ctypes.c_double),
+        ('warm_em_iterations', ctypes.c_int),
+        ('warm_nnf_passes', ctypes.c_int),
+        ('warm_search_radius', ctypes.c_int),
+    ]
+
+    PRESETS = ('fast', 'balanced', 'quality')
+
+    def __init__(self, **kwargs):
+        super().__init__()
+        ret = PMLIB.PM_options_preset(b'balanced', ctypes.byref(self))
+        assert ret == 0
+        for key, value in kwargs.items():
+            setattr(self, key, value)
+
+    @classmethod
+    def preset(cls, name: str, **kwargs) -> 'InpaintingOptions':
+        options = cls()
+        if PMLIB.PM_options_preset(name.encode('ascii'), ctypes.byref(options)) != 0:
+            raise ValueError('Unknown preset: {} (expected one of {}).'.format(name, ', '.join(cls.PRESETS)))
+        for key, value in kwargs.items():
+            setattr(options, key, value)
+        return options
+
+    def __repr__(self):
+        return 'InpaintingOptions({})'.format(', '.join('{}={}'.format(name, getattr(self, name)) for name, _ in self._fields_))
+
+
+class CLevelStatsT(ctypes.Structure):
+    _fields_ = [
+        ('level', ctypes.c_int),
+        ('width', ctypes.c_int),
+        ('height', ctypes.c_int),
+        ('active_pixels', ctypes.c_int),
+        ('em_iterations', ctypes.c_int),
+        ('warm_started', ctypes.c_int),
+        ('init_seconds', ctypes.c_double),
+        ('minimize_seconds', ctypes.c_double),
+        ('expectation_seconds', ctypes.c_double),
+        ('maximization_seconds', ctypes.c_double),
+        ('seconds', ctypes.c_double),
+        ('distance_evaluations', ctypes.c_int64 * 2),
+        ('propagation_tries', ctypes.c_int64 * 2),
+        ('propagation_accepts', ctypes.c_int64 * 2),
+        ('random_search_tries', ctypes.c_int64 * 2),
+        ('random_search_accepts', ctypes.c_int64 * 2),
+        ('nr_passes', ctypes.c_int * 2),
+        ('mean_distance', ctypes.POINTER(ctypes.c_double) * 2),
+    ]
+
+
+class CStatsT(ctypes.Structure):
+    _fields_ = [
+        ('pyramid_seconds', ctypes.c_double),
+        ('seconds', ctypes.c_double),
+        ('nr_levels', ctypes.c_int),
+        ('levels', ctypes.POINTER(CLevelStatsT)),
     ]
 
 
@@ -48,6 +127,44 @@ PMLIB = ctypes.CDLL(osp.join(osp.dirname(__file__), 'libpatchmatch.so'))
 
 PMLIB.PM_set_random_seed.argtypes = [ctypes.c_uint]
 PMLIB.PM_set_verbose.argtypes = [ctypes.c_int]
+PMLIB.PM_set_nr_threads.argtypes = [ctypes.c_int]
+PMLIB.PM_get_nr_threads.restype = ctypes.c_int
+PMLIB.PM_get_isa.restype = ctypes.c_int
+PMLIB.PM_get_detected_isa.restype = ctypes.c_int
+PMLIB.PM_set_isa.argtypes = [ctypes.c_int]
+PMLIB.PM_set_isa.restype = ctypes.c_int
+PMLIB.PM_get_isa_name.argtypes = [ctypes.c_int]
+PMLIB.PM_get_isa_name.restype = ctypes.c_char_p
+PMLIB.PM_options_preset.argtypes = [ctypes.c_char_p, ctypes.POINTER(InpaintingOptions)]
+PMLIB.PM_options_preset.restype = ctypes.c_int
+PMLIB.PM_context_create.restype = ctypes.c_void_p
+PMLIB.PM_context_destroy.argtypes = [ctypes.c_void_p]
+PMLIB.PM_context_set_random_seed.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+PMLIB.PM_context_set_verbose.argtypes = [ctypes.c_void_p, ctypes.c_int]
+PMLIB.PM_context_set_nr_threads.argtypes = [ctypes.c_void_p, ctypes.c_int]
+PMLIB.PM_context_set_split_components.argtypes = [ctypes.c_void_p, ctypes.c_int]
+PMLIB.PM_context_set_options.argtypes = [ctypes.c_void_p, ctypes.POINTER(InpaintingOptions)]
+PM_PROGRESS_FUNC = ctypes.CFUNCTYPE(None, ctypes.c_int, ctypes.c_int, ctypes.c_double, ctypes.c_void_p)
+PMLIB.PM_context_set_progress_callback.argtypes = [ctypes.c_void_p, PM_PROGRESS_FUNC, ctypes.c_void_p]
+PM_LEVEL_SINK = ctypes.CFUNCTYPE(None, ctypes.c_int, CMatT, ctypes.c_void_p)
+PMLIB.PM_context_set_level_sink.argtypes = [ctypes.c_void_p, PM_LEVEL_SINK, ctypes.c_int, ctypes.c_void_p]
+PMLIB.PM_context_set_stats_enabled.argtypes = [ctypes.c_void_p, ctypes.c_int]
+PMLIB.PM_get_last_stats.argtypes = [ctypes.c_void_p, ctypes.POINTER(CStatsT)]
+PMLIB.PM_get_last_stats.restype = ctypes.c_int
+PMLIB.PM_context_cancel.argtypes = [ctypes.c_void_p]
+PMLIB.PM_context_inpaint.argtypes = [ctypes.c_void_p, CMatT, CMatT, CMatT, ctypes.c_int, CMatT]
+PMLIB.PM_context_inpaint.restype = ctypes.c_int
+PMLIB.PM_context_inpaint_regularity.argtypes = [ctypes.c_void_p, CMatT, CMatT, CMatT, CMatT, ctypes.c_int, ctypes.c_float, CMatT]
+PMLIB.PM_context_inpaint_regularity.restype = ctypes.c_int
+PMLIB.PM_context_inpaint_frame.argtypes = [ctypes.c_void_p, CMatT, CMatT, CMatT, CMatT, ctypes.c_int, CMatT]
+PMLIB.PM_context_inpaint_frame.restype = ctypes.c_int
+PMLIB.PM_context_reset_frames.argtypes = [ctypes.c_void_p]
+PMLIB.PM_context_create_session.argtypes = [ctypes.c_void_p, CMatT, CMatT, ctypes.c_int]
+PMLIB.PM_context_create_session.restype = ctypes.c_void_p
+PMLIB.PM_session_destroy.argtypes = [ctypes.c_void_p]
+PMLIB.PM_session_inpaint.argtypes = [ctypes.c_void_p, CMatT, CMatT]
+PMLIB.PM_session_inpaint.restype = ctypes.c_int
+PMLIB.PM_session_reset.argtypes = [ctypes.c_void_p]
 PMLIB.PM_free_pymat.argtypes = [CMatT]
 PMLIB.PM_inpaint.argtypes = [CMatT, CMatT, ctypes.c_int]
 PMLIB.PM_inpaint.restype = CMatT
@@ -57,6 +174,27 @@ PMLIB.PM_inpaint2.argtypes = [CMatT, CMatT, CMatT, ctypes.c_int]
 PMLIB.PM_inpaint2.restype = CMatT
 PMLIB.PM_inpaint2_regularity.argtypes = [CMatT, CMatT, CMatT, CMatT, ctypes.c_int, ctypes.c_float]
 PMLIB.PM_inpaint2_regularity.restype = CMatT
+PMLIB.PM_inpaint_components.argtypes = [CMatT, CMatT, ctypes.c_int]
+PMLIB.PM_inpaint_components.restype = CMatT
+PMLIB.PM_inpaint2_components.argtypes = [CMatT, CMatT, CMatT, ctypes.c_int]
+PMLIB.PM_inpaint2_components.restype = CMatT
+PMLIB.PM_inpaint_into.argtypes = [CMatT, CMatT, ctypes.c_int, CMatT]
+PMLIB.PM_inpaint_into.restype = ctypes.c_int
+PMLIB.PM_inpaint_regularity_into.argtypes = [CMatT, CMatT, CMatT, ctypes.c_int, ctypes.c_float, CMatT]
+PMLIB.PM_inpaint_regularity_into.restype = ctypes.c_int
+PMLIB.PM_inpaint2_into.argtypes = [CMatT, CMatT, CMatT, ctypes.c_int, CMatT]
+PMLIB.PM_inpaint2_into.restype = ctypes.c_int
+PMLIB.PM_inpaint2_regularity_into.argtypes = [CMatT, CMatT, CMatT, CMatT, ctypes.c_int, ctypes.c_float, CMatT]
+PMLIB.PM_inpaint2_regularity_into.restype = ctypes.c_int
+PMLIB.PM_inpaint_components_into.argtypes = [CMatT, CMatT, ctypes.c_int, CMatT]
+PMLIB.PM_inpaint_components_into.restype = ctypes.c_int
+PMLIB.PM_inpaint2_components_into.argtypes = [CMatT, CMatT, CMatT, ctypes.c_int, CMatT]
+PMLIB.PM_inpaint2_components_into.restype = ctypes.c_int
+PMLIB.PM_inpaint_options_into.argtypes = [CMatT, CMatT, CMatT, ctypes.c_int, ctypes.c_int, ctypes.POINTER(InpaintingOptions), CMatT]
+PMLIB.PM_inpaint_options_into.restype = ctypes.c_int
+PMLIB.PM_inpaint_batch.argtypes = [ctypes.c_int, ctypes.POINTER(CMatT), ctypes.POINTER(CMatT), ctypes.POINTER(CMatT), ctypes.c_int, ctypes.POINTER(CMatT)]
+PMLIB.PM_inpaint_file.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_double]
+PMLIB.PM_inpaint_file.restype = ctypes.c_int
 
 
 def set_random_seed(seed: int):
@@ -67,12 +205,43 @@ def set_verbose(verbose: bool):
     PMLIB.PM_set_verbose(ctypes.c_int(verbose))
 
 
+def set_nr_threads(nr_threads: int):
+    """Set the number of threads used by the inpainting routines. Non-positive values use all cores."""
+    PMLIB.PM_set_nr_threads(ctypes.c_int(nr_threads))
+
+
+def get_nr_threads() -> int:
+    return PMLIB.PM_get_nr_threads()
+
+
+ISA_NAMES = ['scalar', 'sse4.1', 'avx2', 'avx512']
+
+
+def get_isa(detected: bool = False) -> str:
+    """Return the instruction set of the kernels in use (or, if detected is True, the best one the CPU supports)."""
+    isa = PMLIB.PM_get_detected_isa() if detected else PMLIB.PM_get_isa()
+    return PMLIB.PM_get_isa_name(ctypes.c_int(isa)).decode('ascii')
+
+
+def set_isa(isa: Optional[Union[str, int]] = None) -> str:
+    """Force the kernels of an instruction set ('scalar', 'sse4.1', 'avx2', 'avx512'); None restores the automatic
+    choice. The request is capped to what the CPU supports; return the instruction set actually selected."""
+    if isa is None:
+        isa = -1
+    elif isinstance(isa, str):
+        isa = ISA_NAMES.index(isa)
+    return PMLIB.PM_get_isa_name(ctypes.c_int(PMLIB.PM_set_isa(ctypes.c_int(isa)))).decode('ascii')
+
+
 def inpaint(
     image: Union[np.ndarray, Image.Image],
     mask: Optional[Union[np.ndarray, Image.Image]] = None,
     *,
     global_mask: Optional[Union[np.ndarray, Image.Image]] = None,
-    patch_size: int = 15
+    patch_size: int = 15,
+    split_components: bool = False,
+    options: Optional[Union[str, 'InpaintingOptions']] = None,
+    out: Optional[np.ndarray] = None
 ) -> np.ndarray:
     """
     PatchMatch based inpainting proposed in:
@@ -87,32 +256,75 @@ def inpaint(
         If not provided (None), the algorithm will treat all purely white pixels as the holes (255, 255, 255).
         global_mask (Union[np.array, Image.Image], optional): the target mask of the output image.
         patch_size (int): the patch size for the inpainting algorithm.
+        split_components (bool): inpaint every connected component of the hole separately, in a crop around it.
+        The crops run in parallel; much faster for many small, scattered holes, but each hole is only filled from
+        its neighborhood.
+        options (Union[str, InpaintingOptions], optional): the tuning knobs, or the name of a preset: 'fast',
+        'balanced' (the default) or 'quality'.
+        out (np.ndarray, optional): the array to write the result to, of the shape and dtype of the image. Its rows
+        may be strided (e.g. a crop of a larger array), but the pixels of a row must be contiguous.
 
     Return:
-        result (np.ndarray): the repaired image, of the same size as the input image.
+        result (np.ndarray): the repaired image, of the same size as the input image (out, if provided).
     """
 
-    if isinstance(image, Image.Image):
-        image = np.array(image)
-    image = np.ascontiguousarray(image)
-    assert image.ndim == 3 and image.shape[2] == 3 and image.dtype == 'uint8'
+    image, mask = _canonicalize_image_and_mask(image, mask)
+    out = _canonicalize_output_array(out, image)
+    global_mask = None if global_mask is None else _canonicalize_mask_array(global_mask)
+    options = _canonicalize_options(options)
 
-    if mask is None:
-        mask = (image == (255, 255, 255)).all(axis=2, keepdims=True).astype('uint8')
-        mask = np.ascontiguousarray(mask)
-    else:
-        mask = _canonicalize_mask_array(mask)
+    ret = PMLIB.PM_inpaint_options_into(
+        np_to_pymat(image), np_to_pymat(mask), _optional_np_to_pymat(global_mask), ctypes.c_int(patch_size),
+        ctypes.c_int(split_components), None if options is None else ctypes.byref(options), np_to_pymat(out)
+    )
+    assert ret == 0
 
-    if global_mask is None:
-        ret_pymat = PMLIB.PM_inpaint(np_to_pymat(image), np_to_pymat(mask), ctypes.c_int(patch_size))
-    else:
-        global_mask = _canonicalize_mask_array(global_mask)
-        ret_pymat = PMLIB.PM_inpaint2(np_to_pymat(image), np_to_pymat(mask), np_to_pymat(global_mask), ctypes.c_int(patch_size))
+    return out
+
+
+def inpaint_batch(
+    images: Sequence[Union[np.ndarray, Image.Image]],
+    masks: Optional[Sequence[Optional[Union[np.ndarray, Image.Image]]]] = None,
+    *,
+    global_masks: Optional[Sequence[Optional[Union[np.ndarray, Image.Image]]]] = None,
+    patch_size: int = 15
+) -> List[np.ndarray]:
+    """
+    Inpaint a batch of independent images concurrently, in one call. The images share the worker pool and are
+    started largest first, so that a large image does not stall the batch. The arguments are as for `inpaint`, one
+    entry per image; a None mask detects the holes as purely white pixels, a None global mask means no global mask.
 
-    ret_npmat = pymat_to_np(ret_pymat)
-    PMLIB.PM_free_pymat(ret_pymat)
+    Return:
+        results (List[np.ndarray]): the repaired images, in the order of the inputs.
+    """
 
-    return ret_npmat
+    nr_images = len(images)
+    if masks is None:
+        masks = [None] * nr_images
+    if global_masks is None:
+        global_masks = [None] * nr_images
+    assert len(masks) == nr_images and len(global_masks) == nr_images
+
+    # Keep the canonicalized arrays alive until the call returns: the C side only borrows them.
+    arrays = []
+    images_c, masks_c, global_masks_c = (CMatT * nr_images)(), (CMatT * nr_images)(), (CMatT * nr_images)()
+    for k in range(nr_images):
+        image, mask = _canonicalize_image_and_mask(images[k], masks[k])
+        arrays.extend([image, mask])
+        images_c[k], masks_c[k] = np_to_pymat(image), np_to_pymat(mask)
+        if global_masks[k] is not None:
+            global_mask = _canonicalize_mask_array(global_masks[k])
+            arrays.append(global_mask)
+            global_masks_c[k] = np_to_pymat(global_mask)
+
+    results_c = (CMatT * nr_images)()
+    PMLIB.PM_inpaint_batch(ctypes.c_int(nr_images), images_c, masks_c, global_masks_c, ctypes.c_int(patch_size), results_c)
+
+    results = []
+    for k in range(nr_images):
+        results.append(pymat_to_np(results_c[k]))
+        PMLIB.PM_free_pymat(results_c[k])
+    return results
 
 
 def inpaint_regularity(
@@ -121,33 +333,342 @@ def inpaint_regularity(
     ijmap: np.ndarray,
     *,
     global_mask: Optional[Union[np.ndarray, Image.Image]] = None,
-    patch_size: int = 15, guide_weight: float = 0.25
+    patch_size: int = 15, guide_weight: float = 0.25,
+    out: Optional[np.ndarray] = None
 ) -> np.ndarray:
-    if isinstance(image, Image.Image):
-        image = np.array(image)
-    image = np.ascontiguousarray(image)
-
     assert isinstance(ijmap, np.ndarray) and ijmap.ndim == 3 and ijmap.shape[2] == 3 and ijmap.dtype == 'float32'
-    ijmap = np.ascontiguousarray(ijmap)
-
-    assert image.ndim == 3 and image.shape[2] == 3 and image.dtype == 'uint8'
-    if mask is None:
-        mask = (image == (255, 255, 255)).all(axis=2, keepdims=True).astype('uint8')
-        mask = np.ascontiguousarray(mask)
-    else:
-        mask = _canonicalize_mask_array(mask)
+    ijmap = _as_row_strided(ijmap)
 
+    image, mask = _canonicalize_image_and_mask(image, mask)
+    out = _canonicalize_output_array(out, image)
 
     if global_mask is None:
-        ret_pymat = PMLIB.PM_inpaint_regularity(np_to_pymat(image), np_to_pymat(mask), np_to_pymat(ijmap), ctypes.c_int(patch_size), ctypes.c_float(guide_weight))
+        ret = PMLIB.PM_inpaint_regularity_into(np_to_pymat(image), np_to_pymat(mask), np_to_pymat(ijmap), ctypes.c_int(patch_size), ctypes.c_float(guide_weight), np_to_pymat(out))
     else:
         global_mask = _canonicalize_mask_array(global_mask)
-        ret_pymat = PMLIB.PM_inpaint2_regularity(np_to_pymat(image), np_to_pymat(mask), np_to_pymat(global_mask), np_to_pymat(ijmap), ctypes.c_int(patch_size), ctypes.c_float(guide_weight))
+        ret = PMLIB.PM_inpaint2_regularity_into(np_to_pymat(image), np_to_pymat(mask), np_to_pymat(global_mask), np_to_pymat(ijmap), ctypes.c_int(patch_size), ctypes.c_float(guide_weight), np_to_pymat(out))
+    assert ret == 0
+
+    return out
+
+
+def inpaint_file(
+    image_path: str,
+    mask_path: str,
+    width: int,
+    height: int,
+    *,
+    output_path: Optional[str] = None,
+    global_mask_path: Optional[str] = None,
+    patch_size: int = 15,
+    memory_budget_mb: float = 1024
+):
+    """
+    Out-of-core inpainting of images too large for memory. The files are raw and memory mapped: the image is
+    height x width x 3 uint8, the masks height x width uint8 (non-zero is masked), as written by `ndarray.tofile`.
+    Every connected component of the hole is inpainted in a crop around it (as with `inpaint(split_components=True)`)
+    and written back to the output file; memory_budget_mb bounds the memory of the crops processed concurrently.
 
-    ret_npmat = pymat_to_np(ret_pymat)
-    PMLIB.PM_free_pymat(ret_pymat)
+    Args:
+        image_path (str): the raw input image.
+        mask_path (str): the raw mask of the hole(s) to be filled.
+        width (int), height (int): the size of the image.
+        output_path (str, optional): the raw output image, created or overwritten. If None, the image file is
+        inpainted in place.
+        global_mask_path (str, optional): the raw target mask of the output image.
+        patch_size (int): the patch size for the inpainting algorithm.
+        memory_budget_mb (float): the memory budget of the concurrent crops, in MB. If a single crop does not fit,
+        nothing is inpainted and MemoryError is raised.
+    """
 
-    return ret_npmat
+    def encode(path):
+        return None if path is None else osp.expanduser(path).encode()
+
+    ret = PMLIB.PM_inpaint_file(
+        encode(image_path), encode(mask_path), encode(global_mask_path), encode(output_path),
+        ctypes.c_int(width), ctypes.c_int(height), ctypes.c_int(patch_size), ctypes.c_double(memory_budget_mb)
+    )
+    if ret == -2:
+        raise MemoryError('A connected component of the hole needs more than {} MB; raise memory_budget_mb.'.format(memory_budget_mb))
+    if ret != 0:
+        raise IOError('Cannot map the image files (missing, or smaller than {}x{}).'.format(width, height))
+
+
+class Context(object):
+    """
+    A reentrant inpainting context, owning its options (and, with nr_threads > 0, a worker pool of its own).
+    Different contexts can inpaint concurrently from different threads (the library releases the GIL); a context
+    itself should only be used by one thread at a time, except for `cancel`.
+
+    With a time budget (`InpaintingOptions.time_budget`, in seconds), the iterations of the remaining levels are cut
+    so that the finest level completes in time. `cancel()` stops the call in progress before its next EM iteration:
+    the call then returns the fill reached so far, upsampled to the full size, and `cancelled` is set. A level sink
+    receives the fill of every pyramid level as soon as it is done, e.g. to show a coarse result early. With
+    stats=True, `last_stats()` tells where the time of the last call went.
+    """
+
+    def __init__(
+        self, random_seed: int = 1212, verbose: bool = False, nr_threads: int = 0, split_components: bool = False,
+        options: Optional[Union[str, InpaintingOptions]] = None,
+        progress: Optional[Callable[[int, int, float], None]] = None,
+        level_sink: Optional[Callable[[int, np.ndarray], None]] = None, full_size_levels: bool = False,
+        stats: bool = False
+    ):
+        self._handle = PMLIB.PM_context_create()
+        self._progress = None
+        self._level_sink = None
+        self.cancelled = False
+        self.set_random_seed(random_seed)
+        self.set_verbose(verbose)
+        self.set_nr_threads(nr_threads)
+        self.set_split_components(split_components)
+        self.set_options(options)
+        self.set_progress_callback(progress)
+        self.set_level_sink(level_sink, full_size_levels)
+        self.set_stats_enabled(stats)
+
+    def __del__(self):
+        if getattr(self, '_handle', None) is not None:
+            PMLIB.PM_context_destroy(self._handle)
+            self._handle = None
+
+    def set_random_seed(self, seed: int):
+        PMLIB.PM_context_set_random_seed(self._handle, ctypes.c_uint(seed))
+
+    def set_verbose(self, verbose: bool):
+        PMLIB.PM_context_set_verbose(self._handle, ctypes.c_int(verbose))
+
+    def set_nr_threads(self, nr_threads: int):
+        """Give the context a pool of nr_threads threads of its own; 0 shares the global pool."""
+        PMLIB.PM_context_set_nr_threads(self._handle, ctypes.c_int(nr_threads))
+
+    def set_split_components(self, split_components: bool):
+        PMLIB.PM_context_set_split_components(self._handle, ctypes.c_int(split_components))
+
+    def set_options(self, options: Optional[Union[str, InpaintingOptions]]):
+        """The tuning knobs, or the name of a preset (see `inpaint`); None restores the balanced preset."""
+        options = _canonicalize_options(options)
+        PMLIB.PM_context_set_options(self._handle, None if options is None else ctypes.byref(options))
+
+    def set_progress_callback(self, progress: Optional[Callable[[int, int, float], None]]):
+        """
+        progress(level, iteration, fraction) is called after every EM iteration, on the thread calling `inpaint`,
+        with the fraction of the planned work done; None removes it. It is not called with split_components.
+        """
+        # Keep the C function alive as long as the context may call it.
+        self._progress = None if progress is None else PM_PROGRESS_FUNC(lambda level, iteration, fraction, _: progress(level, iteration, fraction))
+        PMLIB.PM_context_set_progress_callback(self._handle, self._progress if self._progress is not None else PM_PROGRESS_FUNC(), None)
+
+    def set_level_sink(self, level_sink: Optional[Callable[[int, np.ndarray], None]], full_size: bool = False):
+        """
+        level_sink(level, image) is called once every pyramid level is done, coarsest first, on the thread calling
+        `inpaint`, with a copy of the fill of the level; the last call has the final result. Level l > 0 ends with
+        the next finer level, so its image has that size, unless full_size upsamples it to the size of the input
+        (nearest neighbor, with the known pixels put back). None removes it. It is not called with split_components.
+        """
+        self._level_sink = None if level_sink is None else PM_LEVEL_SINK(lambda level, image, _: level_sink(level, pymat_to_np(image)))
+        PMLIB.PM_context_set_level_sink(self._handle, self._level_sink if self._level_sink is not None else PM_LEVEL_SINK(), ctypes.c_int(full_size), None)
+
+    def set_stats_enabled(self, stats: bool):
+        """Whether the calls collect stats (see `last_stats`); off by default, and free when off."""
+        PMLIB.PM_context_set_stats_enabled(self._handle, ctypes.c_int(stats))
+
+    def last_stats(self) -> Optional[dict]:
+        """
+        What the last call did, or None if it did not collect stats (they are not collected with split_components):
+        the times (in seconds) of the pyramid and of the whole call, and for every level, coarsest first, its size, its
+        active pixels, its EM iterations, whether it started from the previous frame (see `inpaint_frame`), the time of each phase (init, minimize, expectation, maximization; the two
+        NNF directions run concurrently and are summed), and for each NNF direction the distance evaluations, the
+        propagation and random search tries and acceptances, and the mean distance after every pass.
+        """
+        stats = CStatsT()
+        if PMLIB.PM_get_last_stats(self._handle, ctypes.byref(stats)) != 0:
+            return None
+
+        def nnf_stats(level, d):
+            return {
+                'distance_evaluations': level.distance_evaluations[d],
+                'propagation_tries': level.propagation_tries[d], 'propagation_accepts': level.propagation_accepts[d],
+                'random_search_tries': level.random_search_tries[d], 'random_search_accepts': level.random_search_accepts[d],
+                'mean_distance': [level.mean_distance[d][k] for k in range(level.nr_passes[d])],
+            }
+
+        levels = []
+        for k in range(stats.nr_levels):
+            level = stats.levels[k]
+            levels.append({
+                'level': level.level, 'width': level.width, 'height': level.height,
+                'active_pixels': level.active_pixels, 'em_iterations': level.em_iterations,
+                'warm_started': bool(level.warm_started),
+                'init_seconds': level.init_seconds, 'minimize_seconds': level.minimize_seconds,
+                'expectation_seconds': level.expectation_seconds, 'maximization_seconds': level.maximization_seconds,
+                'seconds': level.seconds,
+                'source2target': nnf_stats(level, 0), 'target2source': nnf_stats(level, 1),
+            })
+        return {'pyramid_seconds': stats.pyramid_seconds, 'seconds': stats.seconds, 'levels': levels}
+
+    def cancel(self):
+        """Cancel the inpainting in progress; can be called from any thread."""
+        PMLIB.PM_context_cancel(self._handle)
+
+    def inpaint(
+        self,
+        image: Union[np.ndarray, Image.Image],
+        mask: Optional[Union[np.ndarray, Image.Image]] = None,
+        *,
+        global_mask: Optional[Union[np.ndarray, Image.Image]] = None,
+        patch_size: int = 15,
+        out: Optional[np.ndarray] = None
+    ) -> np.ndarray:
+        """As the module level `inpaint`, with the options of the context."""
+        image, mask = _canonicalize_image_and_mask(image, mask)
+        out = _canonicalize_output_array(out, image)
+        global_mask = None if global_mask is None else _canonicalize_mask_array(global_mask)
+
+        ret = PMLIB.PM_context_inpaint(
+            self._handle, np_to_pymat(image), np_to_pymat(mask), _optional_np_to_pymat(global_mask),
+            ctypes.c_int(patch_size), np_to_pymat(out)
+        )
+        assert ret in (0, 1)
+        self.cancelled = ret == 1
+        return out
+
+    def inpaint_regularity(
+        self,
+        image: Union[np.ndarray, Image.Image],
+        mask: Optional[Union[np.ndarray, Image.Image]],
+        ijmap: np.ndarray,
+        *,
+        global_mask: Optional[Union[np.ndarray, Image.Image]] = None,
+        patch_size: int = 15, guide_weight: float = 0.25,
+        out: Optional[np.ndarray] = None
+    ) -> np.ndarray:
+        """As the module level `inpaint_regularity`, with the options of the context (split_components is ignored)."""
+        assert isinstance(ijmap, np.ndarray) and ijmap.ndim == 3 and ijmap.shape[2] == 3 and ijmap.dtype == 'float32'
+        ijmap = _as_row_strided(ijmap)
+        image, mask = _canonicalize_image_and_mask(image, mask)
+        out = _canonicalize_output_array(out, image)
+        global_mask = None if global_mask is None else _canonicalize_mask_array(global_mask)
+
+        ret = PMLIB.PM_context_inpaint_regularity(
+            self._handle, np_to_pymat(image), np_to_pymat(mask), _optional_np_to_pymat(global_mask), np_to_pymat(ijmap),
+            ctypes.c_int(patch_size), ctypes.c_float(guide_weight), np_to_pymat(out)
+        )
+        assert ret in (0, 1)
+        self.cancelled = ret == 1
+        return out
+
+    def inpaint_frame(
+        self,
+        image: Union[np.ndarray, Image.Image],
+        mask: Optional[Union[np.ndarray, Image.Image]] = None,
+        *,
+        global_mask: Optional[Union[np.ndarray, Image.Image]] = None,
+        motion: Optional[np.ndarray] = None,
+        patch_size: int = 15,
+        out: Optional[np.ndarray] = None
+    ) -> np.ndarray:
+        """
+        Inpaint the next frame of a video: the matches start from those of the previous frame inpainted with the
+        context, instead of from scratch, and only run the short warm schedule of the options (`warm_em_iterations`,
+        `warm_nnf_passes`, `warm_search_radius`). Consecutive fills are then both cheaper and steadier. motion is an
+        optional float32 array of shape (height, width, 2) holding, for every pixel, the offset (dx, dy) to the same
+        content in the previous frame (backward optical flow). A frame of another size, or another patch size, starts
+        from scratch; call `reset_frames` at a scene cut. split_components is ignored.
+        """
+        image, mask = _canonicalize_image_and_mask(image, mask)
+        out = _canonicalize_output_array(out, image)
+        global_mask = None if global_mask is None else _canonicalize_mask_array(global_mask)
+        if motion is not None:
+            assert isinstance(motion, np.ndarray) and motion.shape == image.shape[:2] + (2, ) and motion.dtype == 'float32'
+            motion = _as_row_strided(motion)
+
+        ret = PMLIB.PM_context_inpaint_frame(
+            self._handle, np_to_pymat(image), np_to_pymat(mask), _optional_np_to_pymat(global_mask),
+            _optional_np_to_pymat(motion), ctypes.c_int(patch_size), np_to_pymat(out)
+        )
+        assert ret in (0, 1)
+        self.cancelled = ret == 1
+        return out
+
+    def reset_frames(self):
+        """Forget the previous frame of `inpaint_frame`: the next one starts from scratch."""
+        PMLIB.PM_context_reset_frames(self._handle)
+
+    def session(
+        self,
+        image: Union[np.ndarray, Image.Image],
+        *,
+        global_mask: Optional[Union[np.ndarray, Image.Image]] = None,
+        patch_size: int = 15
+    ) -> 'Session':
+        """A `Session` inpainting the image under changing masks, with the options of the context."""
+        return Session(self, image, global_mask=global_mask, patch_size=patch_size)
+
+
+class Session(object):
+    """
+    Inpaints one image again and again as its mask changes, e.g. under the brush of an editor. The session keeps the
+    pyramid of the image, and every call only recomputes it around the pixels whose mask changed; the matches start
+    from the last solution there too, with the short warm schedule of the options (`warm_em_iterations`,
+    `warm_nnf_passes`, `warm_search_radius`). Every call uses the options, callbacks and stats of its context
+    (`context.last_stats()`, `context.cancel()`). Create it with `Context.session`.
+    """
+
+    def __init__(
+        self, context: Context, image: Union[np.ndarray, Image.Image], *,
+        global_mask: Optional[Union[np.ndarray, Image.Image]] = None, patch_size: int = 15
+    ):
+        if isinstance(image, Image.Image):
+            image = np.array(image)
+        assert image.ndim == 3 and image.shape[2] == 3 and image.dtype == 'uint8'
+        image = _as_row_strided(image)
+        global_mask = None if global_mask is None else _canonicalize_mask_array(global_mask)
+
+        self._context = context  # The session uses the context: keep it alive.
+        self._shape = image.shape
+        self._handle = PMLIB.PM_context_create_session(
+            context._handle, np_to_pymat(image), _optional_np_to_pymat(global_mask), ctypes.c_int(patch_size)
+        )
+        if self._handle is None:
+            raise ValueError('The global mask must be a uint8 map of the size of the image, and the patch size positive.')
+        self.cancelled = False
+
+    def __del__(self):
+        if getattr(self, '_handle', None) is not None:
+            PMLIB.PM_session_destroy(self._handle)
+            self._handle = None
+
+    def inpaint(self, mask: Union[np.ndarray, Image.Image], *, out: Optional[np.ndarray] = None) -> np.ndarray:
+        """Inpaint the image of the session under the given mask (uint8, of the size of the image)."""
+        mask = _canonicalize_mask_array(mask)
+        assert mask.shape[:2] == self._shape[:2]
+        if out is None:
+            out = np.empty(self._shape, 'uint8')
+        assert isinstance(out, np.ndarray) and out.shape == self._shape and out.dtype == 'uint8'
+        assert _is_row_strided(out), 'The pixels of a row of the output must be contiguous.'
+
+        ret = PMLIB.PM_session_inpaint(self._handle, np_to_pymat(mask), np_to_pymat(out))
+        assert ret in (0, 1)
+        self.cancelled = ret == 1
+        return out
+
+    def reset(self):
+        """Forget the last solution: the next call starts from scratch, but for the pyramid."""
+        PMLIB.PM_session_reset(self._handle)
+
+
+def _canonicalize_image_and_mask(image, mask):
+    if isinstance(image, Image.Image):
+        image = np.array(image)
+    assert image.ndim == 3 and image.shape[2] == 3 and image.dtype == 'uint8'
+    image = _as_row_strided(image)
+
+    if mask is None:
+        mask = (image == (255, 255, 255)).all(axis=2, keepdims=True).astype('uint8')
+    else:
+        mask = _canonicalize_mask_array(mask)
+    return image, mask
 
 
 def _canonicalize_mask_array(mask):
@@ -156,7 +677,36 @@ def _canonicalize_mask_array(mask):
     if mask.ndim == 2 and mask.dtype == 'uint8':
         mask = mask[..., np.newaxis]
     assert mask.ndim == 3 and mask.shape[2] == 1 and mask.dtype == 'uint8'
-    return np.ascontiguousarray(mask)
+    return _as_row_strided(mask)
+
+
+def _canonicalize_options(options):
+    if options is None or isinstance(options, InpaintingOptions):
+        return options
+    return InpaintingOptions.preset(options)
+
+
+def _canonicalize_output_array(out, image):
+    if out is None:
+        return np.empty(image.shape, image.dtype)
+    assert isinstance(out, np.ndarray) and out.shape == image.shape and out.dtype == image.dtype
+    assert _is_row_strided(out), 'The pixels of a row of the output must be contiguous.'
+    return out
+
+
+def _is_row_strided(array):
+    # The C side reads a matrix row by row, with an arbitrary (positive) row stride.
+    height, width, channels = array.shape
+    return (
+        (channels == 1 or array.strides[2] == array.itemsize) and
+        (width == 1 or array.strides[1] == array.itemsize * channels) and
+        (height == 1 or array.strides[0] >= array.itemsize * channels * width)
+    )
+
+
+def _as_row_strided(array):
+    """Return the array itself if the C side can read it in place (e.g. a crop of a larger image), else a contiguous copy."""
+    return array if _is_row_strided(array) else np.ascontiguousarray(array)
 
 
 dtype_pymat_to_ctypes = [
@@ -182,20 +732,26 @@ dtype_np_to_pymat = {
 
 
 def np_to_pymat(npmat):
-    assert npmat.ndim == 3
+    assert npmat.ndim == 3 and _is_row_strided(npmat)
     return CMatT(
         ctypes.cast(npmat.ctypes.data, ctypes.c_void_p),
         CShapeT(npmat.shape[1], npmat.shape[0], npmat.shape[2]),
-        dtype_np_to_pymat[str(npmat.dtype)]
+        dtype_np_to_pymat[str(npmat.dtype)],
+        npmat.strides[0] if npmat.shape[0] > 1 else 0
     )
 
 
+def _optional_np_to_pymat(npmat):
+    return CMatT() if npmat is None else np_to_pymat(npmat)
+
+
 def pymat_to_np(pymat):
-    npmat = np.ctypeslib.as_array(
-        ctypes.cast(pymat.data_ptr, ctypes.POINTER(dtype_pymat_to_ctypes[pymat.dtype])),
-        (pymat.shape.height, pymat.shape.width, pymat.shape.channels)
-    )
-    ret = np.empty(npmat.shape, npmat.dtype)
-    ret[:] = npmat
-    return ret
+    """A copy of the matrix; its rows may be strided (see PM_mat_t)."""
+    dtype = np.dtype(dtype_pymat_to_ctypes[pymat.dtype])
+    shape = (pymat.shape.height, pymat.shape.width, pymat.shape.channels)
+    row_size = shape[1] * shape[2] * dtype.itemsize
+    stride = pymat.stride if pymat.stride != 0 else row_size
+    buffer = np.ctypeslib.as_array(ctypes.cast(pymat.data_ptr, ctypes.POINTER(ctypes.c_uint8)), ((shape[0] - 1) * stride + row_size, ))
+    rows = np.lib.stride_tricks.as_strided(buffer, (shape[0], row_size), (stride, 1))
+    return rows.copy().view(dtype).reshape(shape)
 